@@ -1,6 +1,17 @@
 /*
  * blockio.cc
  *
+ * Reads from block devices go through readlogicalblocks(). When a cache is
+ * attached to a source (and hence to all the sources copied from it), the
+ * well-known header regions can be prefetched with a single pread() and
+ * the partition/volume detectors are served from memory.
+ *
+ * prefetchdevices() reads the headers of many devices at once (through
+ * io_uring when the kernel lets us use it, preadv() from a few threads
+ * otherwise); opencache() then seeds new caches with whatever was fetched
+ * for the corresponding device.
+ *
+ * Regular files (disk images) are simply mmap'ed by opencache().
  *
  */
 
@@ -17,28 +28,654 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <list>
+#include <map>
+#include <set>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
 
 __ID("@(#) $Id$");
 
+#define MAXCACHEDREGIONS 64
+#define RINGSIZE 256                              // number of reads in flight in a batch
+#define MAXPREFETCHREADS 16                       // reading threads, without io_uring
+
+struct cachedregion
+{
+  long long offset;
+  std::string data;
+};
+
+struct blockcache
+{
+  int fd;
+  const char * map;                               // whole file, for disk images
+  long long maplength;
+  std::list < cachedregion > regions;
+};
+
+static pthread_mutex_t prefetchlock = PTHREAD_MUTEX_INITIALIZER;
+static std::map < std::string, std::string > prefetched;
+
+static bool readcached(const source & s, void * buffer, long long offset, long long length)
+{
+  if(!s.cache || (s.cache->fd != s.fd))
+    return false;
+
+  if(s.cache->map)
+  {
+    if((offset < 0) || (offset + length > s.cache->maplength))
+      return false;
+    memcpy(buffer, s.cache->map + offset, length);
+    return true;
+  }
+
+  for(std::list < cachedregion >::const_iterator r = s.cache->regions.begin(); r != s.cache->regions.end(); ++r)
+    if((offset >= r->offset) && (offset + length <= r->offset + (long long)r->data.size()))
+    {
+      memcpy(buffer, r->data.data() + (offset - r->offset), length);
+      return true;
+    }
+
+  return false;
+}
+
+const void * peeklogicalblocks(source & s,
+long long pos, long long count)
+{
+  long long offset = s.offset + pos*s.blocksize;
+  long long length = count*s.blocksize;
+
+  if(!s.cache || (s.cache->fd != s.fd))
+    return NULL;
+
+  if((s.size>0) && ((pos+count)*s.blocksize>s.size))
+    return NULL;
+
+  if(s.cache->map)
+    return ((offset >= 0) && (offset + length <= s.cache->maplength))?(s.cache->map + offset):NULL;
+
+  if(s.cache->regions.empty())
+    return NULL;
+  else
+  {
+    const cachedregion & r = s.cache->regions.front();   // never evicted
+
+    if((offset >= r.offset) && (offset + length <= r.offset + (long long)r.data.size()))
+      return r.data.data() + (offset - r.offset);
+  }
+
+  return NULL;
+}
+
 ssize_t readlogicalblocks(source & s,
 void * buffer,
 long long pos, long long count)
 {
   long long result = 0;
 
-  memset(buffer, 0, count*s.blocksize);
-
                                                   /* attempt to read past the end of the section */
-  if((s.size>0) && ((pos+count)*s.blocksize>s.size)) return 0;
-
-  result = lseek(s.fd, s.offset + pos*s.blocksize, SEEK_SET);
+  if((s.size>0) && ((pos+count)*s.blocksize>s.size))
+  {
+    memset(buffer, 0, count*s.blocksize);
+    return 0;
+  }
 
-  if(result == -1) return 0;
+  if(readcached(s, buffer, s.offset + pos*s.blocksize, count*s.blocksize))
+    return count;
 
-  result = read(s.fd, buffer, count*s.blocksize);
+  result = pread(s.fd, buffer, count*s.blocksize, s.offset + pos*s.blocksize);
 
   if(result!=count*s.blocksize)
+  {
+    memset(buffer, 0, count*s.blocksize);
     return 0;
+  }
   else
     return count;
 }
+
+bool opencache(source & s)
+{
+  if(s.fd < 0)
+    return false;
+
+  if(!s.cache)
+  {
+    struct stat buf;
+
+    s.cache = new blockcache;
+    s.cache->fd = s.fd;
+    s.cache->map = NULL;
+    s.cache->maplength = 0;
+
+    if((fstat(s.fd, &buf) == 0) && S_ISREG(buf.st_mode) && (buf.st_size > 0))
+    {
+      void * map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, s.fd, 0);
+
+      if(map != MAP_FAILED)
+      {
+        s.cache->map = (const char*)map;
+        s.cache->maplength = buf.st_size;
+        return true;
+      }
+    }
+
+    if(s.diskname != "")
+    {
+      pthread_mutex_lock(&prefetchlock);
+      std::map < std::string, std::string >::iterator i = prefetched.find(s.diskname);
+      if(i != prefetched.end())
+      {
+        cachedregion region;
+
+        region.offset = 0;
+        region.data.swap(i->second);
+        s.cache->regions.push_back(region);
+        prefetched.erase(i);
+      }
+      pthread_mutex_unlock(&prefetchlock);
+    }
+  }
+
+  return true;
+}
+
+void closecache(source & s)
+{
+  if(s.cache && s.cache->map)
+    munmap((void*)s.cache->map, s.cache->maplength);
+  if(s.cache)
+    delete s.cache;
+  s.cache = NULL;
+}
+
+bool prefetchblocks(source & s, long long length)
+{
+  cachedregion region;
+  ssize_t result = 0;
+
+  if(!s.cache || (s.cache->fd != s.fd) || (length <= 0))
+    return false;
+
+  if(s.cache->map)
+    return true;                                  // everything is already there
+
+  if((s.size>0) && (length>s.size))
+    length = s.size;
+
+  for(std::list < cachedregion >::const_iterator r = s.cache->regions.begin(); r != s.cache->regions.end(); ++r)
+    if((s.offset >= r->offset) && (s.offset + length <= r->offset + (long long)r->data.size()))
+      return true;                                // already there
+
+  region.offset = s.offset;
+  region.data.resize(length);
+  result = pread(s.fd, &region.data[0], length, s.offset);
+  if(result <= 0)
+    return false;
+  region.data.resize(result);                     // short reads (small devices) are OK
+
+  if(s.cache->regions.size() >= MAXCACHEDREGIONS)
+    s.cache->regions.erase(++s.cache->regions.begin());  // keep the first region (disk header): it may be peeked at
+  s.cache->regions.push_back(region);
+
+  return true;
+}
+
+#ifdef __NR_io_uring_setup
+struct uring
+{
+  int fd;
+  void * sq;
+  void * cq;
+  size_t sqsize;
+  size_t cqsize;
+  struct io_uring_sqe * sqes;
+  size_t sqessize;
+  struct io_uring_params params;
+};
+
+static bool uring_open(uring & r, unsigned entries)
+{
+  memset(&r, 0, sizeof(r));
+  r.fd = syscall(__NR_io_uring_setup, entries, &r.params);
+  if(r.fd < 0)
+    return false;                                 // not supported or forbidden (seccomp)
+
+  r.sqsize = r.params.sq_off.array + r.params.sq_entries * sizeof(unsigned);
+  r.cqsize = r.params.cq_off.cqes + r.params.cq_entries * sizeof(struct io_uring_cqe);
+  if(r.params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if(r.cqsize > r.sqsize)
+      r.sqsize = r.cqsize;
+    r.cqsize = r.sqsize;
+  }
+  r.sqessize = r.params.sq_entries * sizeof(struct io_uring_sqe);
+
+  r.sq = mmap(NULL, r.sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+  if(r.params.features & IORING_FEAT_SINGLE_MMAP)
+    r.cq = r.sq;
+  else
+    r.cq = mmap(NULL, r.cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+  r.sqes = (struct io_uring_sqe *)mmap(NULL, r.sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES);
+
+  if((r.sq == MAP_FAILED) || (r.cq == MAP_FAILED) || (r.sqes == MAP_FAILED))
+  {
+    close(r.fd);
+    return false;
+  }
+
+  return true;
+}
+
+static void uring_close(uring & r)
+{
+  munmap(r.sqes, r.sqessize);
+  if(r.cq != r.sq)
+    munmap(r.cq, r.cqsize);
+  munmap(r.sq, r.sqsize);
+  close(r.fd);
+}
+
+static bool uring_read(uring & r, int fd, struct iovec * iov, uint64_t tag)
+{
+  unsigned * head = (unsigned*)((char*)r.sq + r.params.sq_off.head);
+  unsigned * tail = (unsigned*)((char*)r.sq + r.params.sq_off.tail);
+  unsigned mask = *(unsigned*)((char*)r.sq + r.params.sq_off.ring_mask);
+  unsigned * array = (unsigned*)((char*)r.sq + r.params.sq_off.array);
+  unsigned t = *tail;
+  struct io_uring_sqe * sqe = NULL;
+
+  if(t - __atomic_load_n(head, __ATOMIC_ACQUIRE) >= r.params.sq_entries)
+    return false;                                 // ring is full
+
+  sqe = &r.sqes[t & mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)iov;
+  sqe->len = 1;
+  sqe->off = 0;
+  sqe->user_data = tag;
+  array[t & mask] = t & mask;
+  __atomic_store_n(tail, t + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+static bool uring_reap(uring & r, uint64_t & tag, int & res)
+{
+  unsigned * head = (unsigned*)((char*)r.cq + r.params.cq_off.head);
+  unsigned * tail = (unsigned*)((char*)r.cq + r.params.cq_off.tail);
+  unsigned mask = *(unsigned*)((char*)r.cq + r.params.cq_off.ring_mask);
+  struct io_uring_cqe * cqes = (struct io_uring_cqe *)((char*)r.cq + r.params.cq_off.cqes);
+  unsigned h = *head;
+
+  if(h == __atomic_load_n(tail, __ATOMIC_ACQUIRE))
+    return false;                                 // nothing yet
+
+  tag = cqes[h & mask].user_data;
+  res = cqes[h & mask].res;
+  __atomic_store_n(head, h + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+#endif
+
+struct prefetchbatch
+{
+  std::vector < std::string > devices;
+  long long length;
+  time_t deadline;
+  void (*ready)(void);                            // called whenever a device is done
+  size_t next;                                    // next device for the read workers
+  unsigned int refs;                              // workers + prefetchdevices()/prefetchrelease()
+  bool released;                                  // results aren't wanted anymore
+};
+
+static prefetchbatch * current = NULL;
+static std::set < std::string > prefetching;      // devices whose headers are still on their way
+
+static void unrefbatch(prefetchbatch * batch)
+{
+  bool last = false;
+
+  pthread_mutex_lock(&prefetchlock);
+  last = (--batch->refs == 0);
+  pthread_mutex_unlock(&prefetchlock);
+
+  if(last)
+    delete batch;
+}
+
+/*
+ * Publish what was read for a device (nothing if res <= 0) and tell the
+ * caller, so that it can start probing that device right away
+ */
+static void prefetchdone(prefetchbatch * batch, const std::string & name, const void * data, ssize_t res)
+{
+  void (*ready)(void) = NULL;
+
+  pthread_mutex_lock(&prefetchlock);
+  if(!batch->released)
+  {
+    if(res > 0)
+      prefetched[name].assign((const char*)data, res);
+    prefetching.erase(name);
+    ready = batch->ready;
+  }
+  pthread_mutex_unlock(&prefetchlock);
+
+  if(ready)
+    ready();
+}
+
+/*
+ * Opening a device may hang (dead LUNs, disks in SCSI error handling) just
+ * like reading it, so it is always done by a worker thread.
+ */
+static int prefetchopen(const std::string & name)
+{
+  struct stat buf;
+  int fd = open(name.c_str(), O_RDONLY | O_NONBLOCK);
+
+  if((fd >= 0) && (fstat(fd, &buf) == 0) && S_ISREG(buf.st_mode))
+  {
+    close(fd);                                    // disk images get mmap'ed instead
+    fd = -1;
+  }
+
+  return fd;
+}
+
+/*
+ * Without io_uring, up to MAXPREFETCHREADS threads each open and read one
+ * device after the other.
+ */
+static void * preadworker(void * arg)
+{
+  prefetchbatch * batch = (prefetchbatch*)arg;
+
+  for(;;)
+  {
+    std::string name;
+    struct iovec iov;
+    ssize_t res = -1;
+    int fd = -1;
+
+    pthread_mutex_lock(&prefetchlock);
+    if(!batch->released && (batch->next < batch->devices.size()) && (time(NULL) < batch->deadline))
+      name = batch->devices[batch->next++];
+    pthread_mutex_unlock(&prefetchlock);
+
+    if(name == "")
+      break;
+
+    iov.iov_base = NULL;
+    iov.iov_len = batch->length;
+    fd = prefetchopen(name);
+    if(fd >= 0)
+      iov.iov_base = malloc(batch->length);
+    if(iov.iov_base)
+      res = preadv(fd, &iov, 1, 0);
+    if(fd >= 0)
+      close(fd);
+
+    prefetchdone(batch, name, iov.iov_base, res);
+    free(iov.iov_base);
+  }
+
+  unrefbatch(batch);
+  return NULL;
+}
+
+#ifdef __NR_io_uring_setup
+struct prefetchjob
+{
+  std::string name;
+  int fd;
+  struct iovec iov;
+  bool done;
+};
+
+struct uringbatch
+{
+  prefetchbatch * batch;
+  uring r;
+};
+
+static void freejob(prefetchjob & job)
+{
+  free(job.iov.iov_base);
+  job.iov.iov_base = NULL;
+  if(job.fd >= 0)
+    close(job.fd);
+  job.fd = -1;
+}
+
+/*
+ * Publish (until the deadline) and free the reads that have completed
+ */
+static void uring_collect(prefetchbatch * batch, uring & r, std::vector < prefetchjob > & jobs, unsigned int & pending, bool publish)
+{
+  uint64_t tag = 0;
+  int res = 0;
+
+  while((pending > 0) && uring_reap(r, tag, res))
+    if(tag < jobs.size() && !jobs[tag].done)
+    {
+      jobs[tag].done = true;
+      pending--;
+      if(publish)
+        prefetchdone(batch, jobs[tag].name, jobs[tag].iov.iov_base, res);
+      freejob(jobs[tag]);
+    }
+}
+
+static bool uring_wait(prefetchbatch * batch, uring & r)
+{
+  struct pollfd pfd;
+  long remaining = batch->deadline - time(NULL);
+
+  if(remaining <= 0)
+    return false;
+
+  pfd.fd = r.fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  poll(&pfd, 1, remaining * 1000);
+
+  return true;
+}
+
+/*
+ * With io_uring, one thread opens the devices and queues their reads (up to
+ * RINGSIZE in flight) as it goes. Results are published as they complete,
+ * until the deadline; reads that are still in flight at that point are
+ * waited for (the kernel may still write into their buffers) and freed when
+ * they complete.
+ */
+static void * uringworker(void * arg)
+{
+  uringbatch * u = (uringbatch*)arg;
+  prefetchbatch * batch = u->batch;
+  uring & r = u->r;
+  std::vector < prefetchjob > jobs;
+  unsigned int pending = 0;
+
+  jobs.reserve(batch->devices.size());            // the kernel keeps pointers to the iovecs
+  for(unsigned int i = 0; (i < batch->devices.size()) && (time(NULL) < batch->deadline); i++)
+  {
+    prefetchjob job;
+
+    job.name = batch->devices[i];
+    job.fd = prefetchopen(job.name);
+    job.iov.iov_base = NULL;
+    job.iov.iov_len = batch->length;
+    job.done = false;
+    if(job.fd >= 0)
+      job.iov.iov_base = malloc(batch->length);
+    jobs.push_back(job);
+
+    while((pending >= RINGSIZE) && uring_wait(batch, r))
+      uring_collect(batch, r, jobs, pending, true);
+
+    if(jobs[i].iov.iov_base && (pending < RINGSIZE) && uring_read(r, jobs[i].fd, &jobs[i].iov, i))
+    {
+      pending++;
+      syscall(__NR_io_uring_enter, r.fd, 1, 0, 0, NULL, 0);
+    }
+    else
+    {
+      jobs[i].done = true;
+      prefetchdone(batch, jobs[i].name, NULL, -1);
+      freejob(jobs[i]);
+    }
+
+    uring_collect(batch, r, jobs, pending, true);
+  }
+
+  while((pending > 0) && uring_wait(batch, r))
+    uring_collect(batch, r, jobs, pending, true);
+
+  while(pending > 0)
+  {
+    if(syscall(__NR_io_uring_enter, r.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+      if(errno != EINTR)
+        break;                                    // can't wait: leave the buffers alone
+
+    uring_collect(batch, r, jobs, pending, false);
+  }
+
+  uring_close(r);
+  delete u;
+  unrefbatch(batch);
+
+  return NULL;
+}
+#endif
+
+static bool startworker(prefetchbatch * batch, void * (*worker)(void *), void * arg)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  bool result = false;
+
+  pthread_mutex_lock(&prefetchlock);
+  batch->refs++;
+  pthread_mutex_unlock(&prefetchlock);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  result = (pthread_create(&thread, &attr, worker, arg) == 0);
+  pthread_attr_destroy(&attr);
+
+  if(!result)
+    unrefbatch(batch);
+
+  return result;
+}
+
+/*
+ * Start reading the first bytes of all the given devices in the background
+ * (through io_uring when the kernel lets us use it, with a few threads
+ * otherwise) and keep them for opencache(). ready() is called each time a
+ * device is done, so that its detectors can run while the others are still
+ * being read; prefetchready() tells whether that is the case. Devices that
+ * haven't answered when the timeout (in seconds) expires are simply left to
+ * the regular, synchronous path.
+ */
+bool prefetchdevices(const std::vector < std::string > & devices, void (*ready)(void), long long length, int timeout)
+{
+  prefetchbatch * batch = NULL;
+  unsigned int workers = 0;
+
+  if(devices.size() < 2)
+    return false;                                 // nothing to batch
+
+  prefetchrelease();
+
+  batch = new prefetchbatch;
+  batch->devices = devices;
+  batch->length = length;
+  batch->deadline = time(NULL) + timeout;
+  batch->ready = ready;
+  batch->next = 0;
+  batch->refs = 1;                                // dropped by prefetchrelease()
+  batch->released = false;
+
+  pthread_mutex_lock(&prefetchlock);
+  current = batch;
+  prefetching.insert(devices.begin(), devices.end());
+  pthread_mutex_unlock(&prefetchlock);
+
+#ifdef __NR_io_uring_setup
+  uringbatch * u = new uringbatch;
+
+  u->batch = batch;
+  if(uring_open(u->r, RINGSIZE))
+  {
+    if(startworker(batch, uringworker, u))
+      return true;
+    uring_close(u->r);
+  }
+  delete u;                                       // not supported or forbidden (seccomp)
+#endif
+
+  while((workers < MAXPREFETCHREADS) && (workers < devices.size()) && startworker(batch, preadworker, batch))
+    workers++;
+
+  if(workers == 0)
+  {
+    prefetchrelease();
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * true when the headers of the given device have been read (or couldn't be),
+ * i.e. when probing it won't wait for the prefetch
+ */
+bool prefetchready(const std::string & device)
+{
+  bool result = true;
+
+  pthread_mutex_lock(&prefetchlock);
+  if(current && (time(NULL) < current->deadline))
+    result = (prefetching.find(device) == prefetching.end());
+  pthread_mutex_unlock(&prefetchlock);
+
+  return result;
+}
+
+/*
+ * Forget about the current batch: headers that no opencache() claimed are
+ * freed and whatever is still being read will be dropped.
+ */
+void prefetchrelease()
+{
+  prefetchbatch * batch = NULL;
+
+  pthread_mutex_lock(&prefetchlock);
+  batch = current;
+  current = NULL;
+  if(batch)
+    batch->released = true;
+  prefetched.clear();
+  prefetching.clear();
+  pthread_mutex_unlock(&prefetchlock);
+
+  if(batch)
+    unrefbatch(batch);
+}
@@ -4,8 +4,12 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string>
+#include <vector>
 
 #define BLOCKSIZE 512
+#define PREFETCHSIZE (68*1024)                    /* covers every on-disk signature we look for (ReiserFS superblock is at 64KiB) */
+
+struct blockcache;
 
 struct source
 {
@@ -14,9 +18,22 @@ struct source
   ssize_t blocksize;
   long long offset;
   long long size;
+  blockcache * cache;
+
+  source(): fd(-1), blocksize(BLOCKSIZE), offset(0), size(0), cache(NULL) {}
 };
 
 ssize_t readlogicalblocks(source & s,
 void * buffer,
 long long pos, long long count);
+
+const void * peeklogicalblocks(source & s,
+long long pos, long long count);                  /* pointer into the cache or NULL, valid until closecache() */
+
+bool opencache(source & s);
+void closecache(source & s);
+bool prefetchblocks(source & s, long long length = PREFETCHSIZE);
+bool prefetchdevices(const std::vector < std::string > & devices, void (*ready)(void) = NULL, long long length = PREFETCHSIZE, int timeout = 5);
+bool prefetchready(const std::string & device);
+void prefetchrelease();
 #endif
@@ -0,0 +1,221 @@
+/*
+ * cache.cc
+ *
+ * Small persistent key/value stores (one "key<TAB>value" per line) and raw
+ * binary blobs used to avoid re-reading slow hardware (module EEPROMs,
+ * firmware tables...) when it hasn't changed since the last run.
+ *
+ * Caches are kept in CACHEDIR and can be ignored with "-disable cache".
+ * They are only used if CACHEDIR belongs to root and nobody else can write
+ * to it (or to the cache files themselves).
+ */
+
+#include "version.h"
+#include "cache.h"
+#include "options.h"
+#include "osutils.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+__ID("@(#) $Id$");
+
+using namespace std;
+
+#ifndef CACHEDIR
+#define CACHEDIR "/var/cache/lshw"
+#endif
+
+static bool trusted(const struct stat & buf)
+{
+  return (buf.st_uid == 0) && !(buf.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+
+static bool trusteddir()
+{
+  struct stat buf;
+
+  if (lstat(CACHEDIR, &buf) != 0)                 // not a symlink to somewhere else
+    return false;
+
+  return S_ISDIR(buf.st_mode) && trusted(buf);
+}
+
+
+static bool trustedfile(const string & path)
+{
+  struct stat buf;
+
+  if (!trusteddir() || (lstat(path.c_str(), &buf) != 0))
+    return false;
+
+  return S_ISREG(buf.st_mode) && trusted(buf);
+}
+
+
+bool loadcache(const string & name, map < string, string > & entries)
+{
+  string path = string(CACHEDIR"/") + name;
+  vector < string > lines;
+
+  entries.clear();
+  if (!enabled("cache") || !trustedfile(path) || !loadfile(path, lines))
+    return false;
+
+  for (size_t i = 0; i < lines.size(); i++)
+  {
+    size_t tab = lines[i].find('\t');
+
+    if (tab != string::npos)
+      entries[lines[i].substr(0, tab)] = lines[i].substr(tab + 1);
+  }
+
+  return true;
+}
+
+
+static bool writecache(const string & name, const string & content, mode_t mode)
+{
+  string path = string(CACHEDIR"/") + name;
+  string pattern = path + ".XXXXXX";
+  vector < char > tmp(pattern.begin(), pattern.end());
+  int fd = -1;
+
+  mkdir(CACHEDIR, 0755);
+  if (!trusteddir())
+    return false;
+  tmp.push_back('\0');
+  fd = mkstemp(&tmp[0]);                          // O_EXCL: never follows a symlink
+  if (fd < 0)
+    return false;
+  fchmod(fd, mode);
+
+  if (write(fd, content.data(), content.length()) != (ssize_t)content.length())
+  {
+    close(fd);
+    unlink(&tmp[0]);
+    return false;
+  }
+  close(fd);
+
+  if (rename(&tmp[0], path.c_str()) != 0)         // never leave a half-written cache behind
+  {
+    unlink(&tmp[0]);
+    return false;
+  }
+
+  return true;
+}
+
+
+bool savecache(const string & name, const map < string, string > & entries)
+{
+  string content = "";
+
+  if (!enabled("cache"))
+    return false;
+
+  for (map < string, string >::const_iterator i = entries.begin(); i != entries.end(); i++)
+  {
+    if ((i->first.find_first_of("\t\n") != string::npos) || (i->second.find('\n') != string::npos))
+      continue;
+    content += i->first + "\t" + i->second + "\n";
+  }
+
+  return writecache(name, content, 0644);
+}
+
+
+/*
+ * binary caches: a "key<TAB>length<TAB>checksum" line followed by the raw
+ * data, which is used in place (mapped read-only)
+ */
+static uint32_t blobsum(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  uint32_t sum = 2166136261U;                     // FNV-1a
+
+  for (size_t i = 0; i < len; i++)
+    sum = (sum ^ p[i]) * 16777619U;
+
+  return sum;
+}
+
+
+static string blobheader(const string & key, const void *data, size_t len)
+{
+  char buffer[32];
+
+  snprintf(buffer, sizeof(buffer), "\t%lu\t%08x\n", (unsigned long) len, blobsum(data, len));
+
+  return key + string(buffer);
+}
+
+
+const void *mapcache(const string & name, const string & key, size_t & len)
+{
+  string path = string(CACHEDIR"/") + name;
+  struct stat buf;
+  void *map = MAP_FAILED;
+  const char *data = NULL;
+  size_t size = 0;
+  int fd = -1;
+
+  len = 0;
+  if (!enabled("cache") || (key == "") || (key.find_first_of("\t\n") != string::npos))
+    return NULL;
+
+  if (!trusteddir())
+    return NULL;
+  fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+  if (fd < 0)
+    return NULL;
+  if ((fstat(fd, &buf) == 0) && S_ISREG(buf.st_mode) && trusted(buf) && (buf.st_size > 0))
+  {
+    size = buf.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  data = (const char *) memchr(map, '\n', size < 128 ? size : 128);
+  if (data)
+  {
+    data++;
+    len = size - (data - (const char *) map);
+    if (string((const char *) map, data - (const char *) map) == blobheader(key, data, len))
+      return data;
+  }
+
+  munmap(map, size);
+  len = 0;
+  return NULL;
+}
+
+
+void unmapcache(const void *data, size_t len)
+{
+  uintptr_t page = getpagesize();
+  const char *map = (const char *) ((uintptr_t) data & ~(page - 1)); // the header is shorter than a page
+
+  if (data)
+    munmap((void *) map, ((const char *) data - map) + len);
+}
+
+
+bool savecache(const string & name, const string & key, const void *data, size_t len)
+{
+  if (!enabled("cache") || (key == "") || (key.find_first_of("\t\n") != string::npos))
+    return false;
+
+  return writecache(name, blobheader(key, data, len) + string((const char *) data, len), 0600);
+}
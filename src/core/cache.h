@@ -0,0 +1,15 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <string>
+#include <map>
+#include <stddef.h>
+
+bool loadcache(const std::string & name, std::map < std::string, std::string > & entries);
+bool savecache(const std::string & name, const std::map < std::string, std::string > & entries);
+
+const void * mapcache(const std::string & name, const std::string & key, size_t & len);
+void unmapcache(const void * data, size_t len);
+bool savecache(const std::string & name, const std::string & key, const void * data, size_t len);
+
+#endif
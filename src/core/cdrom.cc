@@ -17,18 +17,24 @@
 
 #include "version.h"
 #include "cdrom.h"
-#include "partitions.h"
+#include "disk.h"
+#include "osutils.h"
+#include "options.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <linux/cdrom.h>
 #include <climits>
 
 __ID("@(#) $Id$");
 
+#define PROC_CDROM_INFO "/proc/sys/dev/cdrom/info"
+
 #ifndef CDC_CD_R
 #define CDC_CD_R 0x2000
 #endif
@@ -45,6 +51,134 @@ __ID("@(#) $Id$");
 #define CDC_DVD_RAM 0x20000
 #endif
 
+/*
+ * what the kernel already knows about the drive (no need to open it)
+ *
+ * The cdrom driver only publishes the capabilities it got when the drive
+ * was registered here: sysfs has no equivalent attribute (it only says
+ * whether the media is removable, which scsi.cc already reads).
+ */
+static bool cdrom_info(hwNode & n)
+{
+  vector < string > info;
+  string drive = shortname(realpath(n.getLogicalName()));
+  size_t column = 0;
+
+  if (!loadfile(PROC_CDROM_INFO, info))
+    return false;
+
+  for (size_t i = 0; i < info.size(); i++)
+  {
+    size_t colon = info[i].find(':');
+    vector < string > fields;
+    vector < string > values;
+
+    if (colon == string::npos)
+      continue;
+
+    string key = info[i].substr(0, colon);
+    string value = "";
+    splitlines(info[i].substr(colon + 1), fields, '\t');
+    for (size_t j = 0; j < fields.size(); j++)
+      if (hw::strip(fields[j]) != "")
+        values.push_back(hw::strip(fields[j]));
+
+    if (key == "drive name")
+    {
+      for (column = 0; column < values.size(); column++)
+        if (values[column] == drive)
+          break;
+      if (column >= values.size())
+        return false;
+      continue;
+    }
+    if (column < values.size())
+      value = values[column];
+
+    if (value != "1")
+      continue;
+    if (key == "Can play audio")
+      n.addCapability("audio", "Audio CD playback");
+    if (key == "Can write CD-R")
+    {
+      n.addCapability("cd-r", "CD-R burning");
+      n.setDescription("CD-R writer");
+    }
+    if (key == "Can write CD-RW")
+    {
+      n.addCapability("cd-rw", "CD-RW burning");
+      n.setDescription("CD-R/CD-RW writer");
+    }
+    if (key == "Can read DVD")
+    {
+      n.addCapability("dvd", "DVD playback");
+      n.setDescription("DVD reader");
+    }
+    if (key == "Can write DVD-R")
+    {
+      n.addCapability("dvd-r", "DVD-R burning");
+      n.setDescription("DVD writer");
+    }
+    if (key == "Can write DVD-RAM")
+    {
+      n.addCapability("dvd-ram", "DVD-RAM burning");
+      n.setDescription("DVD-RAM writer");
+    }
+  }
+
+  return true;
+}
+
+/*
+ * a drive that is spinning up (or just broken) can take a long time to
+ * answer: query it from a separate thread and give up after
+ * MEDIAPROBETIMEOUT seconds
+ */
+static pthread_mutex_t cdromlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cdromfinished = PTHREAD_COND_INITIALIZER;
+
+struct cdromprobe
+{
+  string device;
+  int capabilities;                               // CDROM_GET_CAPABILITY
+  int status;                                     // CDROM_DRIVE_STATUS
+  bool done;
+  bool abandoned;
+
+  cdromprobe(const string & d):
+    device(d), capabilities(-1), status(-1), done(false), abandoned(false) {}
+};
+
+static void * probe_cdrom(void * arg)
+{
+  cdromprobe * p = (cdromprobe*)arg;
+  int capabilities = -1, status = -1;
+  bool abandoned = false;
+  int fd = open(p->device.c_str(), O_RDONLY | O_NONBLOCK);
+
+  if (fd >= 0)
+  {
+    if (ioctl(fd, CDROM_DRIVE_STATUS, CDSL_CURRENT) >= 0)
+      capabilities = ioctl(fd, CDROM_GET_CAPABILITY);
+    if (capabilities >= 0)
+      status = ioctl(fd, CDROM_DRIVE_STATUS, 0);
+    close(fd);
+  }
+
+  pthread_mutex_lock(&cdromlock);
+  p->capabilities = capabilities;
+  p->status = status;
+  p->done = true;
+  abandoned = p->abandoned;
+  pthread_cond_broadcast(&cdromfinished);
+  pthread_mutex_unlock(&cdromlock);
+
+  if (abandoned)
+    delete p;                                     // nobody is waiting for us anymore
+
+  return NULL;
+}
+
 bool scan_cdrom(hwNode & n)
 {
   if (n.getLogicalName() == "")
@@ -52,25 +186,42 @@ bool scan_cdrom(hwNode & n)
 
   n.addHint("icon", string("cd"));
 
-  int fd = open(n.getLogicalName().c_str(), O_RDONLY | O_NONBLOCK);
+  if (!enabled("media"))                          // -no-media: don't even open the drive
+    return cdrom_info(n);
 
-  if (fd < 0)
-    return false;
+  cdromprobe * p = new cdromprobe(n.getLogicalName());
+  pthread_attr_t attr;
+  pthread_t thread;
+  struct timespec deadline;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  deadline.tv_sec = time(NULL) + MEDIAPROBETIMEOUT;
+  deadline.tv_nsec = 0;
 
-  int status = ioctl(fd, CDROM_DRIVE_STATUS, CDSL_CURRENT);
-  if (status < 0)
+  if (pthread_create(&thread, &attr, probe_cdrom, p) != 0)
+    probe_cdrom(p);                               // can't start a thread: probe synchronously
+  pthread_attr_destroy(&attr);
+
+  pthread_mutex_lock(&cdromlock);
+  while (!p->done)
+    if (pthread_cond_timedwait(&cdromfinished, &cdromlock, &deadline) != 0)
+      break;
+  if (!p->done)
   {
-    close(fd);
-    return false;
+    p->abandoned = true;                          // the thread will clean up after itself
+    pthread_mutex_unlock(&cdromlock);
+    n.setConfig("probe", "timed out");
+    return cdrom_info(n);
   }
+  pthread_mutex_unlock(&cdromlock);
 
-  int capabilities = ioctl(fd, CDROM_GET_CAPABILITY);
+  int capabilities = p->capabilities;
+  int status = p->status;
 
+  delete p;
   if (capabilities < 0)
-  {
-    close(fd);
     return false;
-  }
 
   if (capabilities & CDC_PLAY_AUDIO)
     n.addCapability("audio", "Audio CD playback");
@@ -100,7 +251,7 @@ bool scan_cdrom(hwNode & n)
     n.setDescription("DVD-RAM writer");
   }
 
-  switch(ioctl(fd, CDROM_DRIVE_STATUS, 0))
+  switch(status)
   {
     case CDS_NO_INFO:
     case CDS_NO_DISC:
@@ -114,10 +265,9 @@ bool scan_cdrom(hwNode & n)
       break;
     case CDS_DISC_OK:
       n.setConfig("status", "ready");
-      scan_partitions(n);
+      defer_probe(n);                             // the disc will be read by probe_disks()
       break;
   }
-  close(fd);
 
   return true;
 }
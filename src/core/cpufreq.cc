@@ -10,6 +10,7 @@
 #include "version.h"
 #include "hw.h"
 #include "osutils.h"
+#include "topology.h"
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -39,11 +40,11 @@ static long get_long(const string & path)
 }
 
 
-static string cpubusinfo(int cpu)
+static string cpufreq(int cpu)
 {
-  char buffer[10];
+  char buffer[PATH_MAX];
 
-  snprintf(buffer, sizeof(buffer), "cpu@%d", cpu);
+  snprintf(buffer, sizeof(buffer), DEVICESCPUFREQ, cpu);
 
   return string(buffer);
 }
@@ -51,27 +52,32 @@ static string cpubusinfo(int cpu)
 
 bool scan_cpufreq(hwNode & node)
 {
-  char buffer[PATH_MAX];
-  unsigned i =0;
+  vector < hwNode * > cpus = cpu_nodes(node);
 
-  while(hwNode * cpu = node.findChildByBusInfo(cpubusinfo(i)))
+  for (unsigned i = 0; i < cpus.size(); i++)
   {
-    snprintf(buffer, sizeof(buffer), DEVICESCPUFREQ, i);
-    if(exists(buffer))
+    hwNode * cpu = cpus[i];
+    vector < int > logical = logical_cpus(i, cpus.size());
+
+    if (!cpu)
+      break;
+
+    if (exists(cpufreq(logical[0])))
     {
-      unsigned long long max, cur;
-      pushd(buffer);
+      unsigned long long max = 0, cur;
 
                                                   // in Hz
-      max = 1000*(unsigned long long)get_long("cpuinfo_max_freq");
+      for (unsigned j = 0; j < logical.size(); j++)
+      {                                           // hybrid parts: cores differ
+        unsigned long long m = 1000*(unsigned long long)get_long(cpufreq(logical[j]) + "cpuinfo_max_freq");
+        if (m > max) max = m;
+      }
                                                   // in Hz
-      cur = 1000*(unsigned long long)get_long("scaling_cur_freq");
+      cur = 1000*(unsigned long long)get_long(cpufreq(logical[0]) + "scaling_cur_freq");
       cpu->addCapability("cpufreq", "CPU Frequency scaling");
       if(cur) cpu->setSize(cur);
       if(max>cpu->getCapacity()) cpu->setCapacity(max);
-      popd();
     }
-    i++;
   }
 
   return true;
@@ -1,22 +1,27 @@
 #include "version.h"
 #include "config.h"
 #include "cpuid.h"
+#include "topology.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <cstring>
+#include <vector>
+#include <map>
 
 __ID("@(#) $Id$");
 
-#if defined(__i386__) || defined(__alpha__)
+#if defined(__i386__) || defined(__x86_64__) || defined(__alpha__)
 
 static hwNode *getcache(hwNode & node,
 int n = 0)
 {
-  char cachename[10];
+  char cachename[20];
   hwNode *cache = NULL;
 
   if (n < 0)
@@ -41,7 +46,7 @@ int n = 0)
 static hwNode *getcpu(hwNode & node,
 int n = 0)
 {
-  char cpubusinfo[10];
+  char cpubusinfo[20];
   hwNode *cpu = NULL;
 
   if (n < 0)
@@ -71,10 +76,22 @@ int n = 0)
   else
     return NULL;
 }
-#endif                                            // __i386__ || __alpha__
+#endif                                            // __i386__ || __x86_64__ || __alpha__
 
-#ifdef __i386__
+#if defined(__i386__) || defined(__x86_64__)
 
+#ifdef __x86_64__
+#define cpuid_up(in,a,b,c,d)\
+  __asm__ ("cpuid"					\
+	   : "=a" (a), "=b" (b), "=c" (c), "=d" (d)	\
+	   : "0" (in))
+
+/* same, with a sub-leaf in %ecx */
+#define cpuid_count(in,sub,a,b,c,d)\
+  __asm__ ("cpuid"					\
+	   : "=a" (a), "=b" (b), "=c" (c), "=d" (d)	\
+	   : "0" (in), "2" (sub))
+#else
 /* %ebx may be the PIC register.  */
 #define cpuid_up(in,a,b,c,d)\
   __asm__ ("xchgl\t%%ebx, %1\n\t"			\
@@ -83,17 +100,60 @@ int n = 0)
 	   : "=a" (a), "=r" (b), "=c" (c), "=d" (d)	\
 	   : "0" (in))
 
+/* same, with a sub-leaf in %ecx */
+#define cpuid_count(in,sub,a,b,c,d)\
+  __asm__ ("xchgl\t%%ebx, %1\n\t"			\
+	   "cpuid\n\t"					\
+	   "xchgl\t%%ebx, %1\n\t"			\
+	   : "=a" (a), "=r" (b), "=c" (c), "=d" (d)	\
+	   : "0" (in), "2" (sub))
+#endif
+
+struct cpuid_regs
+{
+  unsigned int eax, ebx, ecx, edx;
+};
+
+/*
+ * CPUID results for each logical CPU, collected by one worker thread pinned
+ * to that CPU (see collect_cpuids())
+ */
+struct cpuid_cpu
+{
+  int cpu;
+  bool done;
+  bool measure;                                   // estimate its clock too
+  float MHz;
+  std::map < unsigned long, cpuid_regs > leaves;
+};
+
+static std::vector < cpuid_cpu > cpuids;
+
 static void cpuid(int cpunumber,
 unsigned long idx,
-unsigned long &eax,
-unsigned long &ebx,
-unsigned long &ecx,
-unsigned long &edx)
+unsigned int &eax,
+unsigned int &ebx,
+unsigned int &ecx,
+unsigned int &edx)
 {
   char cpuname[50];
   int fd = -1;
   unsigned char buffer[16];
 
+  if ((cpunumber >= 0) && ((size_t)cpunumber < cpuids.size()) && cpuids[cpunumber].done)
+  {
+    std::map < unsigned long, cpuid_regs >::const_iterator leaf = cpuids[cpunumber].leaves.find(idx);
+
+    if (leaf != cpuids[cpunumber].leaves.end())
+    {
+      eax = leaf->second.eax;
+      ebx = leaf->second.ebx;
+      ecx = leaf->second.ecx;
+      edx = leaf->second.edx;
+      return;
+    }
+  }
+
   snprintf(cpuname, sizeof(cpuname), "/dev/cpu/%d/cpuid", cpunumber);
   fd = open(cpuname, O_RDONLY);
   if (fd >= 0)
@@ -102,10 +162,10 @@ unsigned long &edx)
     memset(buffer, 0, sizeof(buffer));
     if(read(fd, buffer, sizeof(buffer)) == sizeof(buffer))
     {
-      eax = (*(unsigned long *) buffer);
-      ebx = (*(unsigned long *) (buffer + 4));
-      ecx = (*(unsigned long *) (buffer + 8));
-      edx = (*(unsigned long *) (buffer + 12));
+      memcpy(&eax, buffer, 4);
+      memcpy(&ebx, buffer + 4, 4);
+      memcpy(&ecx, buffer + 8, 4);
+      memcpy(&edx, buffer + 12, 4);
     }
     close(fd);
   }
@@ -253,13 +313,33 @@ long long &l2cache)
 }
 
 
-static bool dointel(unsigned long maxi,
+/*
+ * family.model.stepping from leaf 1, with the extended family and model
+ * fields decoded the way the kernel does
+ */
+static void cpuversion(hwNode * cpu, unsigned int eax)
+{
+  char buffer[20];
+  unsigned int stepping = eax & 0xf;
+  unsigned int model = (eax >> 4) & 0xf;
+  unsigned int family = (eax >> 8) & 0xf;
+
+  if (family == 0xf)
+    family += (eax >> 20) & 0xff;
+  if (family >= 6)
+    model += ((eax >> 16) & 0xf) << 4;
+
+  snprintf(buffer, sizeof(buffer), "%u.%u.%u", family, model, stepping);
+  cpu->setVersion(buffer);
+}
+
+
+static bool dointel(unsigned int maxi,
 hwNode * cpu,
 int cpunumber = 0)
 {
   char buffer[1024];
-  unsigned long signature = 0, flags = 0, bflags = 0, eax = 0, ebx = 0, ecx = 0, edx = 0, unused = 0;
-  int stepping, model, family;
+  unsigned int signature = 0, flags = 0, bflags = 0, eax = 0, ebx = 0, ecx = 0, edx = 0, unused = 0;
 
   if (!cpu)
     return false;
@@ -271,15 +351,10 @@ int cpunumber = 0)
     cpuid(cpunumber, 1, eax, ebx, ecx, edx);
 
     signature = eax;
-
-    stepping = eax & 0xf;
-    model = (eax >> 4) & 0xf;
-    family = (eax >> 8) & 0xf;
     flags = edx;
     bflags = ebx;
 
-    snprintf(buffer, sizeof(buffer), "%d.%d.%d", family, model, stepping);
-    cpu->setVersion(buffer);
+    cpuversion(cpu, eax);
 
     if(ecx & (1 << 5))
       cpu->addCapability("vmx", _("CPU virtualization (Vanderpool)"));
@@ -396,12 +471,12 @@ int cpunumber = 0)
     }
   }
 
-  if (maxi >= 3)
+  if ((maxi >= 3) && (flags & (1 << 18)))        // processor serial number
   {
     cpuid(cpunumber, 3, unused, unused, ecx, edx);
 
     snprintf(buffer, sizeof(buffer),
-      "%04lX-%04lX-%04lX-%04lX-%04lX-%04lX",
+      "%04X-%04X-%04X-%04X-%04X-%04X",
       signature >> 16,
       signature & 0xffff,
       edx >> 16, edx & 0xffff, ecx >> 16, ecx & 0xffff);
@@ -415,14 +490,12 @@ int cpunumber = 0)
 }
 
 
-static bool doamd(unsigned long maxi,
+static bool doamd(unsigned int maxi,
 hwNode * cpu,
 int cpunumber = 0)
 {
-  unsigned long maxei = 0, eax, ebx, ecx, edx;
+  unsigned int maxei = 0, eax, ebx, ecx, edx;
   long long l1cache = 0, l2cache = 0;
-  unsigned int family = 0, model = 0, stepping = 0;
-  char buffer[1024];
 
   if (maxi < 1)
     return false;
@@ -430,11 +503,7 @@ int cpunumber = 0)
   cpu->addHint("logo", string("amd"));
 
   cpuid(cpunumber, 1, eax, ebx, ecx, edx);
-  stepping = eax & 0xf;
-  model = (eax >> 4) & 0xf;
-  family = (eax >> 8) & 0xf;
-  snprintf(buffer, sizeof(buffer), "%d.%d.%d", family, model, stepping);
-  cpu->setVersion(buffer);
+  cpuversion(cpu, eax);
 
   cpuid(cpunumber, 0x80000000, maxei, ebx, ecx, edx);
 
@@ -488,28 +557,28 @@ int cpunumber = 0)
 }
 
 
-static bool docyrix(unsigned long maxi,
+static bool docyrix(unsigned int maxi,
 hwNode * cpu,
 int cpunumber = 0)
 {
-  unsigned long eax, ebx, ecx, edx;
-  unsigned int family = 0, model = 0, stepping = 0;
-  char buffer[1024];
+  unsigned int eax, ebx, ecx, edx;
 
   if (maxi < 1)
     return false;
 
   cpuid(cpunumber, 1, eax, ebx, ecx, edx);
-  stepping = eax & 0xf;
-  model = (eax >> 4) & 0xf;
-  family = (eax >> 8) & 0xf;
-  snprintf(buffer, sizeof(buffer), "%d.%d.%d", family, model, stepping);
-  cpu->setVersion(buffer);
+  cpuversion(cpu, eax);
 
   return true;
 }
 
 
+#ifdef __x86_64__
+static bool haveCPUID()
+{
+  return true;                                    // always there in long mode
+}
+#else
 static __inline__ bool flag_is_changeable_p(unsigned int flag)
 {
   unsigned int f1, f2;
@@ -530,6 +599,7 @@ static bool haveCPUID()
 {
   return flag_is_changeable_p(0x200000);
 }
+#endif
 
 
 /*
@@ -540,9 +610,9 @@ static bool haveCPUID()
 
 static __inline__ unsigned long long int rdtsc()
 {
-  unsigned long long int x;
-  __asm__ volatile (".byte 0x0f, 0x31":"=A" (x));
-  return x;
+  unsigned int lo, hi;                            // "=A" is only edx:eax on i386
+  __asm__ volatile (".byte 0x0f, 0x31":"=a" (lo), "=d" (hi));
+  return ((unsigned long long int) hi << 32) | lo;
 }
 
 
@@ -553,7 +623,7 @@ long sleeptime = 250000)
   struct timeval tvstart, tvstop;
   unsigned long long int cycles[2];               /* gotta be 64 bit */
   float microseconds;                             /* total time taken */
-  unsigned long eax, ebx, ecx, edx;
+  unsigned int eax, ebx, ecx, edx;
   double freq = 1.0f;
 
 /*
@@ -616,39 +686,184 @@ static long round_MHz(float fMHz)
 }
 
 
+static void native_cpuid(cpuid_cpu & c, unsigned long idx)
+{
+  cpuid_regs & r = c.leaves[idx];
+
+  cpuid_count(idx, 0, r.eax, r.ebx, r.ecx, r.edx);
+}
+
+
+static void *cpuid_worker(void *arg)
+{
+  cpuid_cpu & c = *(cpuid_cpu *) arg;
+  cpu_set_t cpus;
+  unsigned int maxi = 0, maxei = 0;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(c.cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+    return NULL;                                  // offline: use /dev/cpu/N/cpuid
+
+  native_cpuid(c, 0);
+  maxi = c.leaves[0].eax & 0xffff;
+  for (unsigned int leaf = 1; (leaf <= 3) && (leaf <= maxi); leaf++)
+    native_cpuid(c, leaf);
+  if (maxi >= 7)
+    native_cpuid(c, 7);
+  if (maxi >= 0x1a)
+    native_cpuid(c, 0x1a);                        // hybrid core type
+  native_cpuid(c, 0x80000000);
+  maxei = c.leaves[0x80000000].eax;
+  if ((maxei >= 0x80000005) && (maxei < 0x8000ffff))
+    native_cpuid(c, 0x80000005);
+  if ((maxei >= 0x80000006) && (maxei < 0x8000ffff))
+    native_cpuid(c, 0x80000006);
+  c.done = true;
+
+  if (c.measure)                                  // RDTSC on the right CPU
+    c.MHz = average_MHz(c.cpu);
+
+  return NULL;
+}
+
+
+/*
+ * run CPUID on all the CPUs at the same time, each from a thread pinned to
+ * it, instead of reading /dev/cpu/N/cpuid leaf by leaf
+ */
+static void collect_cpuids(const std::vector < bool > & measure)
+{
+  long count = sysconf(_SC_NPROCESSORS_CONF);
+  std::vector < pthread_t > threads;
+  std::vector < bool > started;
+
+  if (count < (long)measure.size())
+    count = measure.size();
+  if (count <= 0)
+    return;
+
+  cpuids.resize(count);
+  threads.resize(count);
+  started.resize(count, false);
+  for (long i = 0; i < count; i++)
+  {
+    cpuids[i].cpu = i;
+    cpuids[i].done = false;
+    cpuids[i].measure = (i < (long)measure.size()) && measure[i];
+    cpuids[i].MHz = 0;
+  }
+
+  for (long i = 0; i < count; i++)
+    started[i] = (pthread_create(&threads[i], NULL, cpuid_worker, &cpuids[i]) == 0);
+  for (long i = 0; i < count; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+}
+
+
+/*
+ * hybrid parts (Alder Lake and later) mix performance and efficiency cores:
+ * count them among the package's logical CPUs
+ */
+static void dohybrid(hwNode * cpu, const std::vector < int > & logical)
+{
+  unsigned int performance = 0, efficiency = 0;
+
+  for (size_t j = 0; j < logical.size(); j++)
+  {
+    size_t i = logical[j];
+
+    if ((i >= cpuids.size()) || !cpuids[i].done || !cpuids[i].leaves.count(7) ||
+      !(cpuids[i].leaves[7].edx & (1 << 15)) || !cpuids[i].leaves.count(0x1a))
+      continue;
+
+    switch (cpuids[i].leaves[0x1a].eax >> 24)
+    {
+      case 0x20:                                  // Atom
+        efficiency++;
+        break;
+      case 0x40:                                  // Core
+        performance++;
+        break;
+    }
+  }
+
+  if (performance && efficiency)
+  {
+    cpu->addCapability("hybrid", _("Performance and efficiency cores"));
+    cpu->setConfig("performancecpus", performance);
+    cpu->setConfig("efficiencycpus", efficiency);
+  }
+}
+
+
 bool scan_cpuid(hwNode & n)
 {
-  unsigned long maxi, ebx, ecx, edx;
+  unsigned int maxi, ebx, ecx, edx;
   hwNode *cpu = NULL;
   int currentcpu = 0;
+  size_t count = 0;
+  std::vector < std::vector < int > > logical;    // CPU node -> its logical CPUs
+  std::vector < bool > measure;
+  float unpinned = 0;                             // clock measured without a worker
 
   if (!haveCPUID())
     return false;
 
-  while ((cpu = getcpu(n, currentcpu)))
+  while (getcpu(n, count))
+    count++;
+  for (size_t i = 0; i < count; i++)
   {
+    logical.push_back(logical_cpus(i, count));
+    if (logical.back().empty())
+      logical.back().push_back(i);
+    if ((size_t)logical.back()[0] >= measure.size())
+      measure.resize(logical.back()[0] + 1, false);
+    measure[logical.back()[0]] = (getcpu(n, i)->getSize() == 0);
+  }
+  collect_cpuids(measure);
+
+  while ((cpu = getcpu(n, currentcpu)) && ((size_t)currentcpu < count))
+  {
+    int first = logical[currentcpu][0];           // CPUID runs on the package's first CPU
+
     cpu->claim(true);                             // claim the cpu and all its children
-    cpuid(currentcpu, 0, maxi, ebx, ecx, edx);
+    cpuid(first, 0, maxi, ebx, ecx, edx);
     maxi &= 0xffff;
 
     switch (ebx)
     {
       case 0x756e6547:                            /* Intel */
-        dointel(maxi, cpu, currentcpu);
+        dointel(maxi, cpu, first);
+        dohybrid(cpu, logical[currentcpu]);
         break;
       case 0x68747541:                            /* AMD */
-        doamd(maxi, cpu, currentcpu);
+        doamd(maxi, cpu, first);
         break;
       case 0x69727943:                            /* Cyrix */
-        docyrix(maxi, cpu, currentcpu);
+        docyrix(maxi, cpu, first);
         break;
       default:
         return false;
     }
 
+    cpu->internCapabilities();
     cpu->claim(true);                             // claim the cpu and all its children
     if (cpu->getSize() == 0)
-      cpu->setSize((unsigned long long) (1000000uL * round_MHz(average_MHz(currentcpu))));
+    {
+      float MHz = 0;
+
+      if (((size_t)first < cpuids.size()) && cpuids[first].measure && cpuids[first].done)
+        MHz = cpuids[first].MHz;                  // already measured by its worker
+      else
+      {
+        if (unpinned == 0)                        // same CPU each time: measure once
+          unpinned = average_MHz(first);
+        MHz = unpinned;
+      }
+      cpu->setSize((unsigned long long) (1000000uL * round_MHz(MHz)));
+    }
 
     currentcpu++;
   }
@@ -759,4 +974,4 @@ bool scan_cpuid(hwNode & n)
   return true;
 }
 #endif                                            /* __alpha__ */
-#endif                                            /* __i386__ */
+#endif                                            /* __i386__ || __x86_64__ */
@@ -7,12 +7,46 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
+#include <map>
+#include <algorithm>
 
 __ID("@(#) $Id$");
 
+#define CPUINFO_CHUNK 65536
+
 static int currentcpu = 0;
 
+/*
+ * flags/features lines are usually the same for all the CPUs (and huge on
+ * recent x86): they are split only once and shared
+ */
+static const vector < string > & cpuflags(const string & value)
+{
+  static map < string, vector < string > > parsed;
+  map < string, vector < string > >::iterator it = parsed.find(value);
+
+  if (it != parsed.end())
+    return it->second;
+
+  vector < string > & flags = parsed[value];
+  size_t start = 0;
+
+  while (start < value.length())
+  {
+    size_t end = value.find(' ', start);
+
+    if (end == string::npos)
+      end = value.length();
+    if (end > start)
+      flags.push_back(value.substr(start, end - start));
+    start = end + 1;
+  }
+
+  return flags;
+}
+
 static inline bool is_system_ppc_ibm(hwNode & node)
 {
   string desc = node.getDescription();
@@ -113,16 +147,8 @@ string value)
 {
   if (id == "features")
     {
-      while (value.length() > 0)
-        {
-          size_t pos = value.find(' ');
-          string capability = (pos==string::npos)?value:value.substr(0, pos);
-          s390x_features.push_back(capability);
-          if (pos == string::npos)
-            value = "";
-          else
-            value = hw::strip(value.substr(pos));
-        }
+      const vector < string > & features = cpuflags(value);
+      s390x_features.insert(s390x_features.end(), features.begin(), features.end());
     }
 
   if (id == "vendor_id")
@@ -174,16 +200,9 @@ static void cpuinfo_arm(hwNode & node,
       cpu->claim(true);
       if (id == "Features")
         {
-          while (value.length() > 0)
-            {
-              size_t pos = value.find(' ');
-              string capability = (pos==string::npos)?value:value.substr(0, pos);
-              cpu->addCapability(capability);
-              if (pos == string::npos)
-                value = "";
-              else
-                value = hw::strip(value.substr(pos));
-            }
+          const vector < string > & features = cpuflags(value);
+          for (size_t i = 0; i < features.size(); i++)
+            cpu->addCapability(features[i]);
         }
       /* With help from:
          http://infocenter.arm.com/help/index.jsp
@@ -213,6 +232,8 @@ static void cpuinfo_arm(hwNode & node,
       cpu->describeCapability("idivt", "SDIV and UDIV hardware division in Thumb mode");
       cpu->describeCapability("lpae", "Large Physical Address Extension architecture");
       cpu->describeCapability("evtstrm", "Unknown");
+      if (id == "Features")
+        cpu->internCapabilities();                // identical on most CPUs
     }
 }
 
@@ -249,29 +270,22 @@ static void cpuinfo_aarch64(hwNode & node,
             node.setDescription(aarch64_processor_name);
           cpu->claim(true);
 
-          while (value.length() > 0)
-            {
-              size_t pos = value.find(' ');
-              string capability = (pos==string::npos)?value:value.substr(0, pos);
-              aarch64_features.push_back(capability);
-              if (pos == string::npos)
-                value = "";
-              else
-                value = hw::strip(value.substr(pos));
-            }
+          const vector < string > & features = cpuflags(value);
+          for (size_t i = 0; i < features.size(); i++)
+            if (find(aarch64_features.begin(), aarch64_features.end(), features[i]) == aarch64_features.end())
+              aarch64_features.push_back(features[i]);
 
           for(size_t i=0; i < aarch64_features.size(); i++)
-            {
-              cpu->addCapability(aarch64_features[i]);
-              cpu->describeCapability("fp", "Floating point instructions");
-              cpu->describeCapability("asimd", "Advanced SIMD");
-              cpu->describeCapability("evtstrm", "Event stream");
-              cpu->describeCapability("aes", "AES instructions");
-              cpu->describeCapability("pmull", "PMULL instruction");
-              cpu->describeCapability("sha1", "SHA1 instructions");
-              cpu->describeCapability("sha2", "SHA2 instructions");
-              cpu->describeCapability("crc32", "CRC extension");
-            }
+            cpu->addCapability(aarch64_features[i]);
+          cpu->describeCapability("fp", "Floating point instructions");
+          cpu->describeCapability("asimd", "Advanced SIMD");
+          cpu->describeCapability("evtstrm", "Event stream");
+          cpu->describeCapability("aes", "AES instructions");
+          cpu->describeCapability("pmull", "PMULL instruction");
+          cpu->describeCapability("sha1", "SHA1 instructions");
+          cpu->describeCapability("sha2", "SHA2 instructions");
+          cpu->describeCapability("crc32", "CRC extension");
+          cpu->internCapabilities();              // identical on most CPUs
         }
     }
 }
@@ -418,6 +432,67 @@ string value)
   }
 }
 
+static void describe_x86(hwNode & cpu)
+{
+  cpu.describeCapability("fpu", "mathematical co-processor");
+  cpu.describeCapability("vme", "virtual mode extensions");
+  cpu.describeCapability("de", "debugging extensions");
+  cpu.describeCapability("pse", "page size extensions");
+  cpu.describeCapability("tsc", "time stamp counter");
+  cpu.describeCapability("msr", "model-specific registers");
+  cpu.describeCapability("mce", "machine check exceptions");
+  cpu.describeCapability("cx8", "compare and exchange 8-byte");
+  cpu.describeCapability("apic", "on-chip advanced programmable interrupt controller (APIC)");
+  cpu.describeCapability("sep", "fast system calls");
+  cpu.describeCapability("mtrr", "memory type range registers");
+  cpu.describeCapability("pge", "page global enable");
+  cpu.describeCapability("mca", "machine check architecture");
+  cpu.describeCapability("cmov", "conditional move instruction");
+  cpu.describeCapability("pat", "page attribute table");
+  cpu.describeCapability("pse36", "36-bit page size extensions");
+  cpu.describeCapability("pn", "processor serial number");
+  cpu.describeCapability("psn", "processor serial number");
+//cpu.describeCapability("clflush", "");
+  cpu.describeCapability("dts", "debug trace and EMON store MSRs");
+  cpu.describeCapability("acpi", "thermal control (ACPI)");
+  cpu.describeCapability("fxsr", "fast floating point save/restore");
+  cpu.describeCapability("sse", "streaming SIMD extensions (SSE)");
+  cpu.describeCapability("sse2", "streaming SIMD extensions (SSE2)");
+  cpu.describeCapability("ss", "self-snoop");
+  cpu.describeCapability("tm", "thermal interrupt and status");
+  cpu.describeCapability("ia64", "IA-64 (64-bit Intel CPU)");
+  cpu.describeCapability("pbe", "pending break event");
+  cpu.describeCapability("syscall", "fast system calls");
+  cpu.describeCapability("mp", "multi-processor capable");
+  cpu.describeCapability("nx", "no-execute bit (NX)");
+  cpu.describeCapability("mmxext", "multimedia extensions (MMXExt)");
+  cpu.describeCapability("3dnowext", "multimedia extensions (3DNow!Ext)");
+  cpu.describeCapability("3dnow", "multimedia extensions (3DNow!)");
+//cpu.describeCapability("recovery", "");
+  cpu.describeCapability("longrun", "LongRun Dynamic Power/Thermal Management");
+  cpu.describeCapability("lrti", "LongRun Table Interface");
+  cpu.describeCapability("cxmmx", "multimedia extensions (Cyrix MMX)");
+  cpu.describeCapability("k6_mtrr", "AMD K6 MTRRs");
+//cpu.describeCapability("cyrix_arr", "");
+//cpu.describeCapability("centaur_mcr", "");
+//cpu.describeCapability("pni", "");
+//cpu.describeCapability("monitor", "");
+//cpu.describeCapability("ds_cpl", "");
+//cpu.describeCapability("est", "");
+//cpu.describeCapability("tm2", "");
+//cpu.describeCapability("cid", "");
+//cpu.describeCapability("xtpr", "");
+  cpu.describeCapability("rng", "random number generator");
+  cpu.describeCapability("rng_en", "random number generator (enhanced)");
+  cpu.describeCapability("ace", "advanced cryptography engine");
+  cpu.describeCapability("ace_en", "advanced cryptography engine (enhanced)");
+  cpu.describeCapability("ht", "HyperThreading");
+  cpu.describeCapability("lm", "64bits extensions (x86-64)");
+  cpu.describeCapability("x86-64", "64bits extensions (x86-64)");
+  cpu.describeCapability("mmx", "multimedia extensions (MMX)");
+  cpu.describeCapability("pae", "4GB+ memory addressing (Physical Address Extension)");
+}
+
 static void cpuinfo_x86(hwNode & node,
 string id,
 string value)
@@ -500,78 +575,17 @@ string value)
     if ((id == "fpu_exception") && (value == "yes"))
       cpu->addCapability("fpu_exception", "FPU exceptions reporting");
     if (id == "flags")
-      while (value.length() > 0)
     {
-      size_t pos = value.find(' ');
-      string capability = (pos==string::npos)?value:value.substr(0, pos);
-
-      if(capability == "lm") capability = "x86-64";
-
-      cpu->addCapability(capability);
+      const vector < string > & flags = cpuflags(value);
 
-      if (pos == string::npos)
-        value = "";
-      else
-        value = hw::strip(value.substr(pos));
+      for (size_t i = 0; i < flags.size(); i++)
+        cpu->addCapability((flags[i] == "lm")?string("x86-64"):flags[i]);
     }
 
-    cpu->describeCapability("fpu", "mathematical co-processor");
-    cpu->describeCapability("vme", "virtual mode extensions");
-    cpu->describeCapability("de", "debugging extensions");
-    cpu->describeCapability("pse", "page size extensions");
-    cpu->describeCapability("tsc", "time stamp counter");
-    cpu->describeCapability("msr", "model-specific registers");
-    cpu->describeCapability("mce", "machine check exceptions");
-    cpu->describeCapability("cx8", "compare and exchange 8-byte");
-    cpu->describeCapability("apic", "on-chip advanced programmable interrupt controller (APIC)");
-    cpu->describeCapability("sep", "fast system calls");
-    cpu->describeCapability("mtrr", "memory type range registers");
-    cpu->describeCapability("pge", "page global enable");
-    cpu->describeCapability("mca", "machine check architecture");
-    cpu->describeCapability("cmov", "conditional move instruction");
-    cpu->describeCapability("pat", "page attribute table");
-    cpu->describeCapability("pse36", "36-bit page size extensions");
-    cpu->describeCapability("pn", "processor serial number");
-    cpu->describeCapability("psn", "processor serial number");
-//cpu->describeCapability("clflush", "");
-    cpu->describeCapability("dts", "debug trace and EMON store MSRs");
-    cpu->describeCapability("acpi", "thermal control (ACPI)");
-    cpu->describeCapability("fxsr", "fast floating point save/restore");
-    cpu->describeCapability("sse", "streaming SIMD extensions (SSE)");
-    cpu->describeCapability("sse2", "streaming SIMD extensions (SSE2)");
-    cpu->describeCapability("ss", "self-snoop");
-    cpu->describeCapability("tm", "thermal interrupt and status");
-    cpu->describeCapability("ia64", "IA-64 (64-bit Intel CPU)");
-    cpu->describeCapability("pbe", "pending break event");
-    cpu->describeCapability("syscall", "fast system calls");
-    cpu->describeCapability("mp", "multi-processor capable");
-    cpu->describeCapability("nx", "no-execute bit (NX)");
-    cpu->describeCapability("mmxext", "multimedia extensions (MMXExt)");
-    cpu->describeCapability("3dnowext", "multimedia extensions (3DNow!Ext)");
-    cpu->describeCapability("3dnow", "multimedia extensions (3DNow!)");
-//cpu->describeCapability("recovery", "");
-    cpu->describeCapability("longrun", "LongRun Dynamic Power/Thermal Management");
-    cpu->describeCapability("lrti", "LongRun Table Interface");
-    cpu->describeCapability("cxmmx", "multimedia extensions (Cyrix MMX)");
-    cpu->describeCapability("k6_mtrr", "AMD K6 MTRRs");
-//cpu->describeCapability("cyrix_arr", "");
-//cpu->describeCapability("centaur_mcr", "");
-//cpu->describeCapability("pni", "");
-//cpu->describeCapability("monitor", "");
-//cpu->describeCapability("ds_cpl", "");
-//cpu->describeCapability("est", "");
-//cpu->describeCapability("tm2", "");
-//cpu->describeCapability("cid", "");
-//cpu->describeCapability("xtpr", "");
-    cpu->describeCapability("rng", "random number generator");
-    cpu->describeCapability("rng_en", "random number generator (enhanced)");
-    cpu->describeCapability("ace", "advanced cryptography engine");
-    cpu->describeCapability("ace_en", "advanced cryptography engine (enhanced)");
-    cpu->describeCapability("ht", "HyperThreading");
-    cpu->describeCapability("lm", "64bits extensions (x86-64)");
-    cpu->describeCapability("x86-64", "64bits extensions (x86-64)");
-    cpu->describeCapability("mmx", "multimedia extensions (MMX)");
-    cpu->describeCapability("pae", "4GB+ memory addressing (Physical Address Extension)");
+    if ((id == "flags") || (value == "yes"))
+      describe_x86(*cpu);                         // only when capabilities were added
+    if (id == "flags")
+      cpu->internCapabilities();                  // identical on most CPUs
 
     if(cpu->isCapable("ia64") || cpu->isCapable("lm") || cpu->isCapable("x86-64"))
       cpu->setWidth(64);
@@ -580,6 +594,44 @@ string value)
   }
 }
 
+typedef void (*cpuinfo_handler)(hwNode &, string, string);
+
+static cpuinfo_handler platform_handler(const string & plat)
+{
+  if (plat == "ppc" || plat == "ppc64" || plat == "ppc64le")
+    return cpuinfo_ppc;
+  if (plat == "hppa")
+    return cpuinfo_hppa;
+  if (plat == "alpha")
+    return cpuinfo_alpha;
+  if (plat == "ia64")
+    return cpuinfo_ia64;
+  if (plat == "s390" || plat == "s390x")
+    return cpuinfo_s390x;
+  if (plat.compare(0, 3, "arm") == 0)
+    return cpuinfo_arm;
+  if (plat == "aarch64")
+    return cpuinfo_aarch64;
+  return cpuinfo_x86;
+}
+
+static void trim(const char * & start, const char * & end)
+{
+  while ((start < end) && ((unsigned char)*start <= ' '))
+    start++;
+  while ((end > start) && ((unsigned char)end[-1] <= ' '))
+    end--;
+}
+
+static string cpuinfo_string(const char * start, const char * end)
+{
+  for (const char * p = start; p < end; p++)
+    if (((unsigned char)*p < ' ') || ((unsigned char)*p >= 0x80))
+      return hw::strip(string(start, end - start));
+
+  return string(start, end - start);
+}
+
 bool scan_cpuinfo(hwNode & n)
 {
   hwNode *core = n.getChild("core");
@@ -596,84 +648,83 @@ bool scan_cpuinfo(hwNode & n)
 
   if (core)
   {
-    char buffer[1024];
+    string buffer = "";
+    size_t length = 0;
     ssize_t count;
-    string cpuinfo_str = "";
     string description = "", version = "";
     string plat = platform();
+    cpuinfo_handler handler = platform_handler(plat);
+    bool ppc_ibm = (plat == "ppc" || plat == "ppc64" || plat == "ppc64le") && is_system_ppc_ibm(n);
+    map < string, string > applied;               // what the current CPU already got
+    int appliedcpu = -1;
 
-    while ((count = read(cpuinfo, buffer, sizeof(buffer))) > 0)
+    do                                            // read everything at once
     {
-      cpuinfo_str += string(buffer, count);
-    }
+      buffer.resize(length + CPUINFO_CHUNK);
+      count = read(cpuinfo, &buffer[length], CPUINFO_CHUNK);
+      if (count > 0)
+        length += count;
+    } while (count > 0);
     close(cpuinfo);
+    buffer.resize(length);
 
-    vector < string > cpuinfo_lines;
-    splitlines(cpuinfo_str, cpuinfo_lines);
-    cpuinfo_str = "";                             // free memory
     currentcpu = -1;
 
-    for (unsigned int i = 0; i < cpuinfo_lines.size(); i++)
+    for (const char * line = buffer.data(), * end = buffer.data() + length; line < end; )
     {
-      string id = "";
-      string value = "";
-      size_t pos = 0;
+      const char * eol = (const char *)memchr(line, '\n', end - line);
+      const char * colon = NULL;
 
-      pos = cpuinfo_lines[i].find(':');
+      if (!eol)
+        eol = end;
+      colon = (const char *)memchr(line, ':', eol - line);
 
-      if (pos != string::npos)
+      if (colon)
       {
-        id = hw::strip(cpuinfo_lines[i].substr(0, pos));
-        value = hw::strip(cpuinfo_lines[i].substr(pos + 1));
+        const char * key = line, * keyend = colon;
+        const char * value = colon + 1, * valueend = eol;
 
-        if (plat == "ppc" || plat == "ppc64" || plat == "ppc64le")
-        {
-          // All cores have same product name and version on power systems
-          if (is_system_ppc_ibm(n))
-            {
-              if (id == "cpu")
-                description = value;
-              if (id == "revision")
-                version = value;
-
-              if (description != "" && version != "")
-              {
-                cpuinfo_ppc_ibm(n, description, version);
-                break;
-              }
-            }
-          else
-            cpuinfo_ppc(n, id, value);
-        }
-        else if (plat == "hppa")
-        {
-          cpuinfo_hppa(n, id, value);
-        }
-        else if (plat == "alpha")
-        {
-          cpuinfo_alpha(n, id, value);
-        }
-        else if (plat == "ia64")
-        {
-          cpuinfo_ia64(n, id, value);
-        }
-        else if (plat == "s390" || plat == "s390x")
-        {
-          cpuinfo_s390x(n, id, value);
-        }
-        else if (plat.compare(0, 3, "arm") == 0)
+        trim(key, keyend);
+        trim(value, valueend);
+
+        string id = cpuinfo_string(key, keyend);
+        map < string, string >::iterator last = applied.find(id);
+
+        // on SMT/multi-core systems most lines are the same for all the
+        // logical CPUs that end up in the same node: skip them
+        if ((appliedcpu == currentcpu) && (last != applied.end()) &&
+          (last->second.compare(0, string::npos, value, valueend - value) == 0))
         {
-          cpuinfo_arm(n, id, value);
+          line = eol + 1;
+          continue;
         }
-        else if (plat == "aarch64")
+
+        if (ppc_ibm)
         {
-          cpuinfo_aarch64(n, id, value);
+          // All cores have same product name and version on power systems
+          if (id == "cpu")
+            description = cpuinfo_string(value, valueend);
+          if (id == "revision")
+            version = cpuinfo_string(value, valueend);
+
+          if (description != "" && version != "")
+          {
+            cpuinfo_ppc_ibm(n, description, version);
+            break;
+          }
         }
         else
+          handler(n, id, cpuinfo_string(value, valueend));
+
+        if (appliedcpu != currentcpu)
         {
-          cpuinfo_x86(n, id, value);
+          applied.clear();
+          appliedcpu = currentcpu;
         }
+        applied[id] = string(value, valueend - value);
       }
+
+      line = eol + 1;
     }
   }
   else
@@ -29,6 +29,7 @@
 #include <dirent.h>
 #include <utility>
 #include <map>
+#include <set>
 
 __ID("@(#) $Id$");
 
@@ -44,36 +45,376 @@ struct dimminfo
 
 #define DEVICETREE "/proc/device-tree"
 #define DEVICETREEVPD  "/proc/device-tree/vpd/"
+#define DEVICETREEBASE "/sys/firmware/devicetree/base"
+#define FDT "/sys/firmware/fdt"
+
+#define FDT_MAGIC 0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE 2
+#define FDT_PROP 3
+#define FDT_NOP 4
+#define FDT_END 9
 
 /*
- * Integer properties in device tree are usually represented as a single 
- * "u32 cell" which is an unsigned 32-bit big-endian integer.
+ * Snapshot of the device tree: instead of opening every property file under
+ * /proc/device-tree, the flattened blob the kernel was booted with is parsed
+ * once. Nodes it does not know about (hotplugged since boot, or no blob at
+ * all) or that the kernel has changed since boot (see dt_valid()) are read
+ * from the live tree and their properties remembered.
+ * Properties are indexed by their path below the root ("/cpus/cpu@0/reg").
  */
-static uint32_t get_u32(const string & path)
+static bool dt_loaded = false;
+static map < string, size_t > dt_nodes;           // nodes found in the blob -> number of properties
+static map < string, string > dt_properties;      // path -> raw value, from the blob
+static map < string, bool > dt_checked;           // blob nodes checked against the live tree
+static set < string > dt_subnodes;                // live sub-nodes of the nodes checked
+static map < string, string > dt_live;            // path -> raw value, from the live tree
+
+static bool dt_parse(const string & blob)
 {
-  uint32_t result = 0;
-  int fd = open(path.c_str(), O_RDONLY);
+  const char *fdt = blob.data();
+  size_t size = blob.size();
+  map < string, size_t > nodes;
+  map < string, string > properties;
+  vector < string > path;
+
+  if ((size < 40) || (be_long(fdt) != FDT_MAGIC) || (be_long(fdt + 4) > size))
+    return false;
+
+  size_t structs = be_long(fdt + 8);
+  size_t strings = be_long(fdt + 12);
+  size_t version = be_long(fdt + 20);
+  size_t stringsize = be_long(fdt + 32);
+  size_t end = size;
 
-  if (fd >= 0)
+  if (version < 16)                               // nodes named by full path
+    return false;
+  if (version >= 17)
+    end = structs + be_long(fdt + 36);
+  if ((end > size) || (strings > size) || (stringsize > size - strings))
+    return false;
+
+  size_t offset = structs;
+  while (offset + 4 <= end)
   {
-    if(read(fd, &result, sizeof(result)) != sizeof(result))
-      result = 0;
+    uint32_t token = be_long(fdt + offset);
+    offset += 4;
+
+    switch (token)
+    {
+    case FDT_BEGIN_NODE:
+      {
+        const char *name = fdt + offset;
+        size_t len = strnlen(name, end - offset);
+
+        if (offset + len >= end)
+          return false;
+        string node = path.empty() ? "" : path.back() + "/" + string(name, len);
+        path.push_back(node);
+        nodes[node] = 1;
+        // the kernel makes up "name" for nodes that don't have one
+        properties[node + "/name"] = string(name, strcspn(name, "@")) + '\0';
+        offset += (len + 4) & ~3;                 // name, NUL and padding
+      }
+      break;
+    case FDT_END_NODE:
+      if (path.empty())
+        return false;
+      path.pop_back();
+      break;
+    case FDT_PROP:
+      {
+        if (path.empty() || (offset + 8 > end))
+          return false;
+        size_t len = be_long(fdt + offset);
+        size_t nameoff = be_long(fdt + offset + 4);
+
+        offset += 8;
+        if ((len > end - offset) || (nameoff >= stringsize))
+          return false;
+        const char *name = fdt + strings + nameoff;
+        string key = path.back() + "/" + string(name, strnlen(name, stringsize - nameoff));
+
+        if (properties.find(key) == properties.end())
+          nodes[path.back()]++;
+        properties[key] = string(fdt + offset, len);
+        offset += (len + 3) & ~3;
+      }
+      break;
+    case FDT_NOP:
+      break;
+    case FDT_END:
+      if (!path.empty())
+        return false;
+      dt_nodes.swap(nodes);
+      dt_properties.swap(properties);
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * raw content of a property file (get_string() can't tell a missing
+ * property from an empty one)
+ */
+static bool dt_read(const string & path, string & value)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat buf;
+  char buffer[1024];
+  ssize_t count = 0;
 
+  if (fd < 0)
+    return false;
+  if ((fstat(fd, &buf) != 0) || !S_ISREG(buf.st_mode))
+  {
     close(fd);
+    return false;
   }
 
-  return ntohl(result);
+  value = "";
+  while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+    value += string(buffer, count);
+  close(fd);
+
+  return true;
 }
 
-static uint64_t read_int(FILE *f, size_t length = 4)
+static void dt_load()
 {
-  vector < uint8_t > bytes(length);
-  uint64_t result = 0;
-  if (fread(bytes.data(), length, 1, f) != 1)
+  string blob;
+
+  if (dt_loaded)
+    return;
+  dt_loaded = true;
+
+  if (dt_read(FDT, blob))
+    dt_parse(blob);
+}
+
+/*
+ * path below the root of the device tree, with "//" and trailing slashes
+ * removed (false for paths outside of the device tree)
+ */
+static bool dt_key(const string & path, string & key)
+{
+  const char *roots[] = { DEVICETREE, DEVICETREEBASE };
+
+  for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); i++)
+  {
+    size_t len = strlen(roots[i]);
+
+    if ((path.compare(0, len, roots[i]) != 0) ||
+      ((path.length() > len) && (path[len] != '/')))
+      continue;
+
+    key = "";
+    for (size_t j = len; j < path.length(); j++)
+      if ((path[j] != '/') || ((j + 1 < path.length()) && (path[j + 1] != '/')))
+        key += path[j];
+    dt_load();
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * true if the blob still describes this node. The kernel changes properties
+ * after boot (partition migration, DLPAR, overlays...) by removing their
+ * sysfs files and creating new ones, with new inode numbers. At boot, a
+ * node's property files are all created right after its directory, so their
+ * inode numbers follow the directory's: a single listing of the live node
+ * tells whether any of them has been added, removed or replaced since.
+ */
+static bool dt_valid(const string & node)
+{
+  map < string, size_t >::const_iterator n = dt_nodes.find(node);
+
+  if (n == dt_nodes.end())
+    return false;
+
+  map < string, bool >::const_iterator checked = dt_checked.find(node);
+  if (checked != dt_checked.end())
+    return checked->second;
+
+  DIR *dir = opendir((DEVICETREEBASE + node).c_str());
+  struct dirent *entry = NULL;
+  vector < ino_t > inodes;
+  ino_t self = 0;
+  bool valid = (dir != NULL);
+
+  while (valid && ((entry = readdir(dir)) != NULL))
+  {
+    if (strcmp(entry->d_name, ".") == 0)
+      self = entry->d_ino;
+    else
+    if (entry->d_name[0] == '.')
+      continue;
+    else
+    if (entry->d_type == DT_DIR)
+      dt_subnodes.insert(node + "/" + entry->d_name);
+    else
+    if ((entry->d_type != DT_REG) ||
+      (dt_properties.find(node + "/" + entry->d_name) == dt_properties.end()))
+      valid = false;                              // can't tell, or new property
+    else
+      inodes.push_back(entry->d_ino);
+  }
+  if (dir)
+    closedir(dir);
+
+  valid = valid && (self != 0) && (inodes.size() == n->second);
+  sort(inodes.begin(), inodes.end());
+  for (size_t i = 0; valid && (i < inodes.size()); i++)
+    valid = (inodes[i] == self + 1 + i);
+
+  dt_checked[node] = valid;
+  return valid;
+}
+
+static string dt_parent(const string & key)
+{
+  size_t slash = key.rfind('/');
+
+  return (slash == string::npos) ? "" : key.substr(0, slash);
+}
+
+static bool dt_property(const string & path, string & value)
+{
+  string key;
+  bool keyed = dt_key(path, key);
+
+  if (keyed)
+  {
+    if (dt_valid(dt_parent(key)))
+    {
+      map < string, string >::const_iterator it = dt_properties.find(key);
+
+      if (it == dt_properties.end())
+        return false;
+      value = it->second;
+      return true;
+    }
+
+    map < string, string >::const_iterator it = dt_live.find(key);
+    if (it != dt_live.end())
+    {
+      value = it->second;
+      return true;
+    }
+  }
+
+  if (!dt_read(path, value))
+    return false;
+  if (keyed)
+    dt_live[key] = value;
+  return true;
+}
+
+static bool dt_exists(const string & path)
+{
+  string key;
+
+  if (dt_key(path, key))
+  {
+    if (dt_valid(key) || (dt_live.find(key) != dt_live.end()))
+      return true;
+    if (dt_valid(dt_parent(key)))
+      return (dt_properties.find(key) != dt_properties.end()) ||
+        (dt_subnodes.find(key) != dt_subnodes.end());
+  }
+
+  return exists(path);
+}
+
+static string dt_string(const string & path, const string & def = "")
+{
+  string value;
+
+  if (dt_property(path, value))
+    return value;
+  else
+    return def;
+}
+
+static long dt_number(const string & path, long def = 0)
+{
+  string s = dt_string(path);
+
+  if (s == "")
+    return def;
+
+  return strtol(s.c_str(), NULL, 10);
+}
+
+static bool dt_before(const string & a, const string & b)
+{
+  return strcoll(a.c_str(), b.c_str()) < 0;
+}
+
+/*
+ * sub-nodes (or properties) of a node, sorted like scandir(..., alphasort)
+ * would. Listings always come from the live tree, so that nodes added or
+ * removed since boot are noticed.
+ */
+static vector < string > dt_entries(const string & path, bool nodes = true)
+{
+  vector < string > result;
+  DIR *dir = opendir(path.c_str());
+  struct dirent *entry = NULL;
+
+  if (!dir)
+    return result;
+
+  while ((entry = readdir(dir)) != NULL)
+  {
+    unsigned char type = entry->d_type;
+
+    if (entry->d_name[0] == '.')
+      continue;
+    if (type == DT_UNKNOWN)
+    {
+      struct stat buf;
+
+      if (lstat((path + "/" + entry->d_name).c_str(), &buf) != 0)
+        continue;
+      type = S_ISDIR(buf.st_mode) ? DT_DIR : S_ISREG(buf.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if (type == (nodes ? DT_DIR : DT_REG))
+      result.push_back(entry->d_name);
+  }
+  closedir(dir);
+
+  sort(result.begin(), result.end(), dt_before);
+  return result;
+}
+
+/*
+ * Integer properties in device tree are usually represented as a single 
+ * "u32 cell" which is an unsigned 32-bit big-endian integer.
+ */
+static uint32_t get_u32(const string & path)
+{
+  string value;
+
+  if (!dt_property(path, value) || (value.length() < sizeof(uint32_t)))
     return 0;
+
+  return be_long(value.data());
+}
+
+static uint64_t read_int(const string & value, size_t offset, size_t length = 4)
+{
+  uint64_t result = 0;
+
   for (size_t i = 0; i < length; i ++)
   {
-    result += ((uint64_t) bytes[length - i - 1]) << (i * 8);
+    result = (result << 8) | (uint8_t) value[offset + i];
   }
   return result;
 }
@@ -91,35 +432,34 @@ struct reg_entry {
 static vector < reg_entry > get_reg_property(const string & node)
 {
   vector < reg_entry > result;
+  string parent = node.substr(0, node.rfind('/'));
+  string reg;
 
   uint32_t num_address_cells = 1;
   uint32_t num_size_cells = 1;
 
-  if (exists(node + "/../#address-cells"))
-    num_address_cells = get_u32(node + "/../#address-cells");
-  if (exists(node + "/../#size-cells"))
-    num_size_cells = get_u32(node + "/../#size-cells");
+  if (dt_exists(parent + "/#address-cells"))
+    num_address_cells = get_u32(parent + "/#address-cells");
+  if (dt_exists(parent + "/#size-cells"))
+    num_size_cells = get_u32(parent + "/#size-cells");
 
   if (num_address_cells > 2 || num_size_cells > 2)
     return result;
+  if (num_address_cells + num_size_cells == 0)
+    return result;
 
-  FILE *f = fopen((node + "/reg").c_str(), "r");
-  if (f == NULL)
+  if (!dt_property(node + "/reg", reg))
     return result;
 
-  while (true)
+  size_t entrysize = (num_address_cells + num_size_cells) * 4;
+  for (size_t offset = 0; offset + entrysize <= reg.length(); offset += entrysize)
   {
     reg_entry entry = {0};
-    entry.address = read_int(f, num_address_cells * 4);
-    if (feof(f))
-      break;
-    entry.size = read_int(f, num_size_cells * 4);
-    if (feof(f))
-      break;
+    entry.address = read_int(reg, offset, num_address_cells * 4);
+    entry.size = read_int(reg, offset + num_address_cells * 4, num_size_cells * 4);
     result.push_back(entry);
   }
 
-  fclose(f);
   return result;
 }
 
@@ -127,37 +467,21 @@ static vector < string > get_strings(const string & path,
 unsigned int offset = 0)
 {
   vector < string > result;
-  char *strings = NULL;
-  char *curstring = NULL;
+  string strings;
 
-  int fd = open(path.c_str(), O_RDONLY);
+  if (!dt_property(path, strings))
+    return result;
 
-  if (fd >= 0)
+  while (offset < strings.length())
   {
-    struct stat buf;
-
-    if (fstat(fd, &buf) == 0)
-    {
-      strings = (char *) malloc(buf.st_size + 1);
-      if (strings)
-      {
-        memset(strings, 0, buf.st_size + 1);
-        if(read(fd, strings, buf.st_size) == buf.st_size)
-        {
-          curstring = strings + offset;
-
-          while (strlen(curstring))
-          {
-            result.push_back(string(curstring));
-            curstring += strlen(curstring) + 1;
-          }
-        }
-
-        free(strings);
-      }
-    }
+    size_t end = strings.find('\0', offset);
 
-    close(fd);
+    if (end == string::npos)
+      end = strings.length();
+    if (end == offset)
+      break;
+    result.push_back(strings.substr(offset, end - offset));
+    offset = end + 1;
   }
 
   return result;
@@ -172,19 +496,19 @@ static void scan_devtree_root(hwNode & core)
 
 static void scan_devtree_bootrom(hwNode & core)
 {
-  if (exists(DEVICETREE "/rom/boot-rom"))
+  if (dt_exists(DEVICETREE "/rom/boot-rom"))
   {
     hwNode bootrom("firmware",
       hw::memory);
     string upgrade = "";
 
-    bootrom.setProduct(get_string(DEVICETREE "/rom/boot-rom/model"));
+    bootrom.setProduct(dt_string(DEVICETREE "/rom/boot-rom/model"));
     bootrom.setDescription("BootROM");
     bootrom.
-      setVersion(get_string(DEVICETREE "/rom/boot-rom/BootROM-version"));
+      setVersion(dt_string(DEVICETREE "/rom/boot-rom/BootROM-version"));
 
     if ((upgrade =
-      get_string(DEVICETREE "/rom/boot-rom/write-characteristic")) != "")
+      dt_string(DEVICETREE "/rom/boot-rom/write-characteristic")) != "")
     {
       bootrom.addCapability("upgrade");
       bootrom.addCapability(upgrade);
@@ -202,17 +526,17 @@ static void scan_devtree_bootrom(hwNode & core)
     core.addChild(bootrom);
   }
 
-  if (exists(DEVICETREE "/openprom"))
+  if (dt_exists(DEVICETREE "/openprom"))
   {
     hwNode openprom("firmware",
       hw::memory);
 
-    if (exists(DEVICETREE "/openprom/ibm,vendor-model"))
-	    openprom.setProduct(get_string(DEVICETREE "/openprom/ibm,vendor-model"));
+    if (dt_exists(DEVICETREE "/openprom/ibm,vendor-model"))
+	    openprom.setProduct(dt_string(DEVICETREE "/openprom/ibm,vendor-model"));
     else
-	    openprom.setProduct(get_string(DEVICETREE "/openprom/model"));
+	    openprom.setProduct(dt_string(DEVICETREE "/openprom/model"));
 
-    if (exists(DEVICETREE "/openprom/supports-bootinfo"))
+    if (dt_exists(DEVICETREE "/openprom/supports-bootinfo"))
       openprom.addCapability("bootinfo");
 
 //openprom.setLogicalName(DEVICETREE "/openprom");
@@ -229,11 +553,9 @@ static hwNode *add_base_opal_node(hwNode & core)
   string basepath = DEVICETREE "/ibm,opal";
   hwNode opal("firmware");
 
-  if (!exists(basepath))
+  if (!dt_exists(basepath))
     return NULL;
 
-  pushd(basepath);
-
   opal.setProduct("OPAL firmware");
   opal.setDescription("skiboot");
 
@@ -243,59 +565,47 @@ static hwNode *add_base_opal_node(hwNode & core)
       opal.addCapability((*it).erase(0,4));
   }
 
-  if (exists(basepath + "/ipmi/compatible") &&
-    matches(get_string(basepath + "/ipmi/compatible"), "^ibm,opal-ipmi"))
+  if (dt_exists(basepath + "/ipmi/compatible") &&
+    matches(dt_string(basepath + "/ipmi/compatible"), "^ibm,opal-ipmi"))
     opal.addCapability("ipmi");
 
-  if (exists(basepath + "/diagnostics/compatible") &&
-    matches(get_string(basepath + "/diagnostics/compatible"), "^ibm,opal-prd"))
+  if (dt_exists(basepath + "/diagnostics/compatible") &&
+    matches(dt_string(basepath + "/diagnostics/compatible"), "^ibm,opal-prd"))
     opal.addCapability("prd");
 
-  popd();
-
   opal.claim();
   return core.addChild(opal);
 }
 
 static void scan_devtree_firmware_powernv(hwNode & core)
 {
-  int n;
-  struct dirent **namelist;
+  vector < string > versions;
 
   hwNode *opal = add_base_opal_node(core);
 
-  if (!exists(DEVICETREE "/ibm,firmware-versions"))
+  if (!dt_exists(DEVICETREE "/ibm,firmware-versions"))
     return;
 
-  pushd(DEVICETREE "/ibm,firmware-versions");
-  n = scandir(".", &namelist, selectfile, alphasort);
-  popd();
+  versions = dt_entries(DEVICETREE "/ibm,firmware-versions", false);
 
-  if (n <= 0)
-    return;
-
-  for (int i = 0; i < n; i++)
+  for (size_t i = 0; i < versions.size(); i++)
   {
-    string sname = string(namelist[i]->d_name);
+    string sname = versions[i];
     string fullpath = string(DEVICETREE) + "/ibm,firmware-versions/" + sname;
 
     if (sname != "linux,phandle" && sname != "name" && sname != "phandle")
     {
       hwNode fwnode("firmware");
       fwnode.setDescription(sname);
-      fwnode.setVersion(hw::strip(get_string(fullpath)));
+      fwnode.setVersion(hw::strip(dt_string(fullpath)));
       fwnode.claim();
       if (opal && sname == "skiboot") {
         opal->merge(fwnode);
-        free(namelist[i]);
         continue;
       }
       core.addChild(fwnode);
     }
-    free(namelist[i]);
   }
-
-  free(namelist);
 }
 
 static string cpubusinfo(int cpu)
@@ -310,17 +620,17 @@ static string cpubusinfo(int cpu)
 
 static void set_cpu(hwNode & cpu, int currentcpu, const string & basepath)
 {
-  cpu.setProduct(get_string(basepath + "/name"));
+  cpu.setProduct(dt_string(basepath + "/name"));
   cpu.claim();
   cpu.setBusInfo(cpubusinfo(currentcpu));
 
   cpu.setSize(get_u32(basepath + "/clock-frequency"));
   cpu.setClock(get_u32(basepath + "/bus-frequency"));
 
-  if (exists(basepath + "/altivec"))
+  if (dt_exists(basepath + "/altivec"))
     cpu.addCapability("altivec");
 
-  if (exists(basepath + "/performance-monitor"))
+  if (dt_exists(basepath + "/performance-monitor"))
     cpu.addCapability("performance-monitor");
 }
 
@@ -332,7 +642,7 @@ static void fill_cache_info(string cache_type, string cachebase,
   cache.setDescription(cache_type);
   cache.setSize(get_u32(cachebase + "/d-cache-size"));
 
-  if (exists(cachebase + "/cache-unified"))
+  if (dt_exists(cachebase + "/cache-unified"))
     cache.setDescription(cache.getDescription() + " (unified)");
   else
   {
@@ -346,97 +656,76 @@ static void fill_cache_info(string cache_type, string cachebase,
 
 static void scan_devtree_cpu(hwNode & core)
 {
-  struct dirent **namelist;
-  int n;
+  vector < string > cpus = dt_entries(DEVICETREE "/cpus");
   int currentcpu=0;
 
-  pushd(DEVICETREE "/cpus");
-  n = scandir(".", &namelist, selectdir, alphasort);
-  popd();
-  if (n < 0)
-    return;
-  else
+  for (size_t i = 0; i < cpus.size(); i++)
   {
-    for (int i = 0; i < n; i++)
+    string basepath =
+      string(DEVICETREE "/cpus/") + cpus[i];
+    unsigned long version = 0;
+    hwNode cpu("cpu",
+      hw::processor);
+    vector < string > caches;
+
+    if (dt_exists(basepath + "/device_type") &&
+      hw::strip(dt_string(basepath + "/device_type")) != "cpu")
+      break;                                      // oops, not a CPU!
+
+    cpu.setDescription("CPU");
+    set_cpu(cpu, currentcpu++, basepath);
+
+    version = get_u32(basepath + "/cpu-version");
+    if (version != 0)
     {
-      string basepath =
-        string(DEVICETREE "/cpus/") + string(namelist[i]->d_name);
-      unsigned long version = 0;
-      hwNode cpu("cpu",
-        hw::processor);
-      struct dirent **cachelist;
-      int ncache;
-
-      if (exists(basepath + "/device_type") &&
-        hw::strip(get_string(basepath + "/device_type")) != "cpu")
-        break;                                    // oops, not a CPU!
-
-      cpu.setDescription("CPU");
-      set_cpu(cpu, currentcpu++, basepath);
-
-      version = get_u32(basepath + "/cpu-version");
-      if (version != 0)
-      {
-        int minor = version & 0x00ff;
-        int major = (version & 0xff00) >> 8;
-        char buffer[20];
+      int minor = version & 0x00ff;
+      int major = (version & 0xff00) >> 8;
+      char buffer[20];
 
-        snprintf(buffer, sizeof(buffer), "%lx.%d.%d",
-          (version & 0xffff0000) >> 16, major, minor);
-        cpu.setVersion(buffer);
-      }
+      snprintf(buffer, sizeof(buffer), "%lx.%d.%d",
+        (version & 0xffff0000) >> 16, major, minor);
+      cpu.setVersion(buffer);
+    }
 
-      if (hw::strip(get_string(basepath + "/state")) != "running")
-        cpu.disable();
+    if (hw::strip(dt_string(basepath + "/state")) != "running")
+      cpu.disable();
 
-      if (exists(basepath + "/d-cache-size"))
-      {
-        hwNode cache("cache",
-          hw::memory);
-
-        cache.claim();
-        cache.setDescription("L1 Cache");
-        cache.setSize(get_u32(basepath + "/d-cache-size"));
-        if (cache.getSize() > 0)
-          cpu.addChild(cache);
-      }
+    if (dt_exists(basepath + "/d-cache-size"))
+    {
+      hwNode cache("cache",
+        hw::memory);
 
-      pushd(basepath);
-      ncache = scandir(".", &cachelist, selectdir, alphasort);
-      popd();
-      if (ncache > 0)
-      {
-        for (int j = 0; j < ncache; j++)
-        {
-          hwNode cache("cache",
-            hw::memory);
-          hwNode icache("cache",
-            hw::memory);
-          string cachebase = basepath + "/" + cachelist[j]->d_name;
-
-          if (hw::strip(get_string(cachebase + "/device_type")) != "cache" &&
-            hw::strip(get_string(cachebase + "/device_type")) != "l2-cache")
-            break;                                // oops, not a cache!
-
-	  cache.setClock(get_u32(cachebase + "/clock-frequency"));
-	  fill_cache_info("L2 Cache", cachebase, cache, icache);
-
-          if (icache.getSize() > 0)
-            cpu.addChild(icache);
-
-          if (cache.getSize() > 0)
-            cpu.addChild(cache);
-
-          free(cachelist[j]);
-        }
-        free(cachelist);
-      }
+      cache.claim();
+      cache.setDescription("L1 Cache");
+      cache.setSize(get_u32(basepath + "/d-cache-size"));
+      if (cache.getSize() > 0)
+        cpu.addChild(cache);
+    }
+
+    caches = dt_entries(basepath);
+    for (size_t j = 0; j < caches.size(); j++)
+    {
+      hwNode cache("cache",
+        hw::memory);
+      hwNode icache("cache",
+        hw::memory);
+      string cachebase = basepath + "/" + caches[j];
+
+      if (hw::strip(dt_string(cachebase + "/device_type")) != "cache" &&
+        hw::strip(dt_string(cachebase + "/device_type")) != "l2-cache")
+        break;                                    // oops, not a cache!
 
-      core.addChild(cpu);
+      cache.setClock(get_u32(cachebase + "/clock-frequency"));
+      fill_cache_info("L2 Cache", cachebase, cache, icache);
 
-      free(namelist[i]);
+      if (icache.getSize() > 0)
+        cpu.addChild(icache);
+
+      if (cache.getSize() > 0)
+        cpu.addChild(cache);
     }
-    free(namelist);
+
+    core.addChild(cpu);
   }
 }
 
@@ -453,75 +742,53 @@ struct chip_vpd_data
 static void add_chip_vpd(string path, string name,
 			 map <uint32_t, chip_vpd_data *> & vpd)
 {
-  int n;
-  struct dirent **dirlist;
+  string node = path + name;
+  vector < string > children;
 
-  pushd(path + name);
-
-  if (name.substr(0, 9) == "processor" && exists("ibm,chip-id"))
+  if (name.substr(0, 9) == "processor" && dt_exists(node + "/ibm,chip-id"))
   {
-    uint32_t chip_id = get_u32("ibm,chip-id");
+    uint32_t chip_id = get_u32(node + "/ibm,chip-id");
     chip_vpd_data *data = new chip_vpd_data();
 
     if (data)
     {
-      if (exists("serial-number"))
-        data->serial = hw::strip(get_string("serial-number"));
+      if (dt_exists(node + "/serial-number"))
+        data->serial = hw::strip(dt_string(node + "/serial-number"));
 
-      if (exists("ibm,loc-code"))
-	data->slot = hw::strip(get_string("ibm,loc-code"));
+      if (dt_exists(node + "/ibm,loc-code"))
+	data->slot = hw::strip(dt_string(node + "/ibm,loc-code"));
 
-      if (exists("part-number"))
-        data->product = hw::strip(get_string("part-number"));
+      if (dt_exists(node + "/part-number"))
+        data->product = hw::strip(dt_string(node + "/part-number"));
 
-      if (exists("vendor"))
-        data->vendor = hw::strip(get_string("vendor"));
+      if (dt_exists(node + "/vendor"))
+        data->vendor = hw::strip(dt_string(node + "/vendor"));
 
-      if (exists("fru-number"))
-        data->product += " FRU# " + hw::strip(get_string("fru-number"));
+      if (dt_exists(node + "/fru-number"))
+        data->product += " FRU# " + hw::strip(dt_string(node + "/fru-number"));
 
       vpd.insert(std::pair<uint32_t, chip_vpd_data *>(chip_id, data));
     }
   }
 
-  n = scandir(".", &dirlist, selectdir, alphasort);
-  popd();
-
-  if (n <= 0)
-    return;
-
-  for (int i = 0; i < n; i++)
-  {
-    add_chip_vpd(path + name + "/", dirlist[i]->d_name, vpd);
-    free(dirlist[i]);
-  }
+  children = dt_entries(node);
 
-  free(dirlist);
+  for (size_t i = 0; i < children.size(); i++)
+    add_chip_vpd(node + "/", children[i], vpd);
 }
 
 
 static void scan_chip_vpd(map <uint32_t, chip_vpd_data *> & vpd)
 {
-  int n;
-  struct dirent **namelist;
+  vector < string > children;
 
-  if (!exists(DEVICETREEVPD))
+  if (!dt_exists(DEVICETREEVPD))
     return;
 
-  pushd(DEVICETREEVPD);
-  n = scandir(".", &namelist, selectdir, alphasort);
-  popd();
-
-  if (n <= 0)
-    return;
+  children = dt_entries(DEVICETREEVPD);
 
-  for (int i = 0; i < n; i++)
-  {
-    add_chip_vpd(DEVICETREEVPD, namelist[i]->d_name, vpd);
-    free(namelist[i]);
-  }
-
-  free(namelist);
+  for (size_t i = 0; i < children.size(); i++)
+    add_chip_vpd(DEVICETREEVPD, children[i], vpd);
 }
 
 
@@ -533,7 +800,7 @@ static void fill_core_vpd(hwNode & cpu, string & basepath,
   chip_vpd_data *data;
   string xscom_path;
 
-  if (!exists(basepath + "/ibm,chip-id"))
+  if (!dt_exists(basepath + "/ibm,chip-id"))
     return;
 
   chip_id = get_u32(basepath + "/ibm,chip-id");
@@ -554,19 +821,19 @@ static void fill_core_vpd(hwNode & cpu, string & basepath,
   {
     vector <string> board_pieces;
 
-    splitlines(hw::strip(get_string(xscom_path + "/board-info")),
+    splitlines(hw::strip(dt_string(xscom_path + "/board-info")),
 	       board_pieces, ' ');
     if (board_pieces.size() > 0)
       cpu.setVendor(board_pieces[0]);
 
-    if (exists(xscom_path + "/serial-number"))
-      cpu.setSerial(hw::strip(get_string(xscom_path + "/serial-number")));
+    if (dt_exists(xscom_path + "/serial-number"))
+      cpu.setSerial(hw::strip(dt_string(xscom_path + "/serial-number")));
 
-    if (exists(xscom_path + "/ibm,slot-location-code"))
-      cpu.setSlot(hw::strip(get_string(xscom_path + "/ibm,slot-location-code")));
+    if (dt_exists(xscom_path + "/ibm,slot-location-code"))
+      cpu.setSlot(hw::strip(dt_string(xscom_path + "/ibm,slot-location-code")));
 
-    if (exists(xscom_path + "/part-number"))
-      cpu.setProduct(hw::strip(get_string(xscom_path + "/part-number")));
+    if (dt_exists(xscom_path + "/part-number"))
+      cpu.setProduct(hw::strip(dt_string(xscom_path + "/part-number")));
   }
 }
 
@@ -577,19 +844,15 @@ static void set_cpu_config_threads(hwNode & cpu, const string & basepath)
   /* In power systems, there are equal no. of threads per cpu-core */
   if (threads_per_cpu == 0)
   {
-    int rc;
-    struct stat sbuf;
-    string p = hw::strip(basepath + string("/ibm,ppc-interrupt-server#s"));
+    string servers;
 
     /*
-     * This file contains as many 32 bit interrupt server numbers, as the
-     * number of threads per CPU (in hexadecimal format). st_size gives size
-     * in bytes of a file. Hence, grouping by 4 bytes, we get the thread
-     * count.
+     * This property contains as many 32 bit interrupt server numbers, as the
+     * number of threads per CPU (in hexadecimal format). Hence, grouping its
+     * bytes by 4, we get the thread count.
      */
-    rc = stat(p.c_str(), &sbuf);
-    if (!rc)
-      threads_per_cpu = sbuf.st_size / 4;
+    if (dt_property(basepath + "/ibm,ppc-interrupt-server#s", servers))
+      threads_per_cpu = servers.length() / 4;
   }
 
   cpu.setConfig("threads", threads_per_cpu);
@@ -598,18 +861,10 @@ static void set_cpu_config_threads(hwNode & cpu, const string & basepath)
 
 static void scan_xscom_node(map <uint32_t, string> & xscoms)
 {
-  int n;
-  struct dirent **namelist;
-
-  pushd(DEVICETREE);
-  n = scandir(".", &namelist, selectdir, alphasort);
-  popd();
+  vector < string > nodes = dt_entries(DEVICETREE);
 
-  if (n <= 0)
-    return;
-
-  for (int i = 0; i < n; i++) {
-    string sname = string(namelist[i]->d_name);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    string sname = nodes[i];
     string fullpath = "";
     int chip_id = 0;
 
@@ -618,26 +873,20 @@ static void scan_xscom_node(map <uint32_t, string> & xscoms)
       chip_id = get_u32(fullpath + "/ibm,chip-id");
       xscoms.insert(std::pair<uint32_t, string>(chip_id, fullpath));
     }
-
-    free(namelist[i]);
   }
-  free(namelist);
 }
 
 static void scan_devtree_cpu_power(hwNode & core)
 {
-  int n;
+  vector < string > nodes;
   int currentcpu = 0;
-  struct dirent **namelist;
   map <uint32_t, pair<uint32_t, vector <hwNode> > > l2_caches;
   map <uint32_t, vector <hwNode> > l3_caches;
   map <uint32_t, chip_vpd_data *> chip_vpd;
   map <uint32_t, string> xscoms;
 
-  pushd(DEVICETREE "/cpus");
-  n = scandir(".", &namelist, selectdir, alphasort);
-  popd();
-  if (n < 0)
+  nodes = dt_entries(DEVICETREE "/cpus");
+  if (nodes.empty())
     return;
 
   /*
@@ -647,23 +896,23 @@ static void scan_devtree_cpu_power(hwNode & core)
    * First pass creates cache nodes and second pass will link cache nodes to
    * corresponding CPU nodes.
    */
-  for (int i = 0; i < n; i++)
+  for (size_t i = 0; i < nodes.size(); i++)
   {
     string product;
-    string basepath = string(DEVICETREE "/cpus/") + string(namelist[i]->d_name);
+    string basepath = string(DEVICETREE "/cpus/") + nodes[i];
     hwNode cache("cache", hw::memory);
     hwNode icache("cache", hw::memory);
     vector <hwNode> value;
 
-    if (!exists(basepath + "/device_type"))
+    if (!dt_exists(basepath + "/device_type"))
       continue;
 
-    if (hw::strip(get_string(basepath + "/device_type")) != "cache")
+    if (hw::strip(dt_string(basepath + "/device_type")) != "cache")
       continue;
 
-    product = hw::strip(get_string(basepath + "/name"));
+    product = hw::strip(dt_string(basepath + "/name"));
 
-    if (hw::strip(get_string(basepath + "/status")) != "okay")
+    if (hw::strip(dt_string(basepath + "/status")) != "okay")
     {
       cache.disable();
       icache.disable();
@@ -684,9 +933,9 @@ static void scan_devtree_cpu_power(hwNode & core)
     {
       uint32_t phandle = 0;
 
-      if (exists(basepath + "/phandle"))
+      if (dt_exists(basepath + "/phandle"))
         phandle = get_u32(basepath + "/phandle");
-      else if (exists(basepath + "/ibm,phandle")) // on pSeries LPARs
+      else if (dt_exists(basepath + "/ibm,phandle")) // on pSeries LPARs
         phandle = get_u32(basepath + "/ibm,phandle");
 
       if (!phandle)
@@ -696,9 +945,9 @@ static void scan_devtree_cpu_power(hwNode & core)
       {
         uint32_t l3_key = 0; // 0 indicating no next level of cache
 
-        if (exists(basepath + "/l2-cache"))
+        if (dt_exists(basepath + "/l2-cache"))
           l3_key = get_u32(basepath + "/l2-cache");
-        else if (exists(basepath + "/next-level-cache")) //on OpenPOWER systems
+        else if (dt_exists(basepath + "/next-level-cache")) //on OpenPOWER systems
           l3_key = get_u32(basepath + "/next-level-cache");
 
         pair <uint32_t, vector <hwNode> > p (l3_key, value);
@@ -721,25 +970,19 @@ static void scan_devtree_cpu_power(hwNode & core)
   // List all xscom nodes under DT
   scan_xscom_node(xscoms);
 
-  for (int i = 0; i < n; i++) //second and final pass
+  for (size_t i = 0; i < nodes.size(); i++) //second and final pass
   {
     uint32_t l2_key = 0;
     uint32_t version = 0;
     uint32_t reg;
-    string basepath = string(DEVICETREE "/cpus/") + string(namelist[i]->d_name);
+    string basepath = string(DEVICETREE "/cpus/") + nodes[i];
     hwNode cpu("cpu", hw::processor);
 
-    if (!exists(basepath + "/device_type"))
-    {
-      free(namelist[i]);
+    if (!dt_exists(basepath + "/device_type"))
       continue;
-    }
 
-    if (hw::strip(get_string(basepath + "/device_type")) != "cpu")
-    {
-      free(namelist[i]);
+    if (hw::strip(dt_string(basepath + "/device_type")) != "cpu")
       continue;
-    }
 
     cpu.setDescription("CPU");
     cpu.addHint("logo", string("powerpc"));
@@ -754,12 +997,12 @@ static void scan_devtree_cpu_power(hwNode & core)
 
     fill_core_vpd(cpu, basepath, chip_vpd, xscoms);
 
-    if (hw::strip(get_string(basepath + "/status")) != "okay")
+    if (hw::strip(dt_string(basepath + "/status")) != "okay")
       cpu.disable();
 
     set_cpu_config_threads(cpu, basepath);
 
-    if (exists(basepath + "/d-cache-size"))
+    if (dt_exists(basepath + "/d-cache-size"))
     {
       hwNode cache("cache", hw::memory);
       hwNode icache("cache", hw::memory);
@@ -772,16 +1015,16 @@ static void scan_devtree_cpu_power(hwNode & core)
       if (cache.getSize() > 0)
         cpu.addChild(cache);
 
-      if (hw::strip(get_string(basepath + "/status")) != "okay")
+      if (hw::strip(dt_string(basepath + "/status")) != "okay")
       {
         cache.disable();
         icache.disable();
       }
     }
 
-    if (exists(basepath + "/l2-cache"))
+    if (dt_exists(basepath + "/l2-cache"))
         l2_key = get_u32(basepath + "/l2-cache");
-    else if (exists(basepath + "/next-level-cache"))
+    else if (dt_exists(basepath + "/next-level-cache"))
         l2_key = get_u32(basepath + "/next-level-cache");
 
     if (l2_key != 0)
@@ -805,10 +1048,7 @@ static void scan_devtree_cpu_power(hwNode & core)
     }
 
     core.addChild(cpu);
-
-    free(namelist[i]);
   }
-  free(namelist);
 
   map <uint32_t, chip_vpd_data *>::iterator it;
   for (it = chip_vpd.begin(); it != chip_vpd.end(); it++)
@@ -819,30 +1059,19 @@ static bool add_memory_bank_mba_dimm(string path,
 				     unsigned long serial, hwNode & bank)
 {
   bool found = false;
-  int n;
-  struct dirent **namelist;
-
-  pushd(path);
-  n = scandir(".", &namelist, selectdir, alphasort);
-  popd();
+  vector < string > children = dt_entries(path);
 
-  if (n < 0)
-    return found;
-
-  for (int i = 0; i < n; i++)
+  for (size_t i = 0; i < children.size(); i++)
   {
-    string sname = string(namelist[i]->d_name);
+    string sname = children[i];
     string fullpath = path + "/" + sname;
 
     if (found)
-    {
-      free(namelist[i]);
-      continue;
-    }
+      break;
 
     if (sname.substr(0, 13) == "memory-buffer")
     {
-      if (exists(fullpath + "/frequency-mhz"))
+      if (dt_exists(fullpath + "/frequency-mhz"))
       {
         int hz = get_u32(fullpath + "/frequency-mhz") * 1000000;
         bank.setClock(hz);
@@ -855,13 +1084,11 @@ static bool add_memory_bank_mba_dimm(string path,
       vector < reg_entry > regs = get_reg_property(fullpath);
       bank.setSize(regs[0].size);
 
-      bank.setSlot(hw::strip(get_string(fullpath + "/ibm,slot-location-code")));
+      bank.setSlot(hw::strip(dt_string(fullpath + "/ibm,slot-location-code")));
       found = true;
     }
-    free(namelist[i]);
   }
 
-  free(namelist);
   return found;
 }
 
@@ -878,19 +1105,15 @@ static void add_memory_bank_spd(string path, hwNode & bank)
   uint16_t ver_offset;
   uint16_t serial_offset;
   uint16_t bus_width_offset;
-  int fd;
+  string spd;
   size_t len = 0;
   dimminfo_buf dimminfo;
 
-  fd = open(path.c_str(), O_RDONLY);
-  if (fd < 0)
+  if (!dt_property(path, spd) || (spd.length() < 0x80))
     return;
 
-  if (read(fd, &dimminfo, 0x80) != 0x80)
-  {
-    close(fd);
-    return;
-  }
+  memset(dimminfo, 0, sizeof(dimminfo));
+  memcpy(dimminfo, spd.data(), 0x80);
 
   /* Read entire SPD eeprom */
   if (dimminfo[2] >= 9) /* DDR3 & DDR4 */
@@ -904,10 +1127,12 @@ static void add_memory_bank_spd(string path, hwNode & bank)
     len = 1 << dimminfo[1];
   }
 
+  if (len > sizeof(dimminfo))
+    len = sizeof(dimminfo);
+  if (len > spd.length())
+    len = spd.length();
   if (len > 0x80)
-    read(fd, &dimminfo[0x80], len - 0x80);
-
-  close(fd);
+    memcpy(&dimminfo[0x80], spd.data() + 0x80, len - 0x80);
 
   if (dimminfo[2] >= 9) {
     int rank_offset;
@@ -1041,15 +1266,14 @@ static void add_memory_bank_spd(string path, hwNode & bank)
 
 static void add_memory_bank(string name, string path, hwNode & core)
 {
-  struct dirent **dirlist;
+  string node = path + "/" + name;
+  vector < string > children;
   string product;
-  int n;
 
   hwNode *memory = core.getChild("memory");
   if(!memory)
     memory = core.addChild(hwNode("memory", hw::memory));
 
-  pushd(path + "/" + name);
   if(name.substr(0, 7) == "ms-dimm" ||
      name.substr(0, 18) == "IBM,memory-module@")
   {
@@ -1057,45 +1281,45 @@ static void add_memory_bank(string name, string path, hwNode & core)
     bank.claim(true);
     bank.addHint("icon", string("memory"));
 
-    if(exists("serial-number"))
-      bank.setSerial(hw::strip(get_string("serial-number")));
+    if(dt_exists(node + "/serial-number"))
+      bank.setSerial(hw::strip(dt_string(node + "/serial-number")));
 
-    product = hw::strip(get_string("part-number"));
-    if(exists("fru-number"))
+    product = hw::strip(dt_string(node + "/part-number"));
+    if(dt_exists(node + "/fru-number"))
     {
-      product += " FRU# " + hw::strip(get_string("fru-number"));
+      product += " FRU# " + hw::strip(dt_string(node + "/fru-number"));
     }
     if(product != "")
       bank.setProduct(hw::strip(product));
 
     string description = "DIMM";
-    string package = hw::strip(get_string("ibm,mem-package"));
+    string package = hw::strip(dt_string(node + "/ibm,mem-package"));
     if (!package.empty())
       description = package;
-    string memtype = hw::strip(get_string("ibm,mem-type"));
+    string memtype = hw::strip(dt_string(node + "/ibm,mem-type"));
     if (!memtype.empty())
       description += " " + memtype;
-    if(exists("description"))
-      description = hw::strip(get_string("description"));
+    if(dt_exists(node + "/description"))
+      description = hw::strip(dt_string(node + "/description"));
     bank.setDescription(description);
-    if (exists("ibm,chip-id"))
-      bank.setConfig("chip-id", get_u32("ibm,chip-id"));
-
-    if(exists("ibm,loc-code"))
-      bank.setSlot(hw::strip(get_string("ibm,loc-code")));
-    unsigned long size = get_number("size") * 1024 * 1024;
-    if (exists("ibm,size"))
-      size = get_u32("ibm,size");
+    if (dt_exists(node + "/ibm,chip-id"))
+      bank.setConfig("chip-id", get_u32(node + "/ibm,chip-id"));
+
+    if(dt_exists(node + "/ibm,loc-code"))
+      bank.setSlot(hw::strip(dt_string(node + "/ibm,loc-code")));
+    unsigned long size = dt_number(node + "/size") * 1024 * 1024;
+    if (dt_exists(node + "/ibm,size"))
+      size = get_u32(node + "/ibm,size");
     if (size > 0)
       bank.setSize(size);
 
     // Parse Memory SPD data
-    if (exists("spd"))
-      add_memory_bank_spd(path + "/" + name + "/spd", bank);
+    if (dt_exists(node + "/spd"))
+      add_memory_bank_spd(node + "/spd", bank);
 
     // Parse Memory SPD data
-    if (exists("frequency"))
-      bank.setClock(get_u32("frequency"));
+    if (dt_exists(node + "/frequency"))
+      bank.setClock(get_u32(node + "/frequency"));
 
     memory->addChild(bank);
   } else if(name.substr(0, 4) == "dimm") {
@@ -1109,64 +1333,35 @@ static void add_memory_bank(string name, string path, hwNode & core)
     memory->addChild(bank);
   }
 
-  n = scandir(".", &dirlist, selectdir, alphasort);
-  popd();
-
-  if (n < 0)
-    return;
+  children = dt_entries(node);
 
-  for (int i = 0; i < n; i++)
-  {
-    add_memory_bank(dirlist[i]->d_name, path + "/" + name, core);
-    free(dirlist[i]);
-  }
-  free(dirlist);
+  for (size_t i = 0; i < children.size(); i++)
+    add_memory_bank(children[i], node, core);
 }
 
 
 static void scan_devtree_memory_powernv(hwNode & core)
 {
-  struct dirent **namelist;
-  int n;
+  vector < string > children = dt_entries(DEVICETREEVPD);
   string path = DEVICETREEVPD;
 
-  pushd(DEVICETREEVPD);
-  n = scandir(".", &namelist, selectdir, alphasort);
-  popd();
-
-  if (n < 0)
-    return;
-
-  for (int i = 0; i < n; i++)
-  {
-    add_memory_bank(namelist[i]->d_name, path, core);
-    free(namelist[i]);
-  }
-
-  free(namelist);
+  for (size_t i = 0; i < children.size(); i++)
+    add_memory_bank(children[i], path, core);
 }
 
 
 // older POWER hardware
 static void scan_devtree_memory_ibm(hwNode & core)
 {
-  struct dirent **namelist;
-  pushd(DEVICETREE);
-  int n = scandir(".", &namelist, selectdir, alphasort);
-  popd();
-
-  if (n < 0)
-    return;
+  vector < string > children = dt_entries(DEVICETREE);
 
-  for (int i = 0; i < n; i++)
+  for (size_t i = 0; i < children.size(); i++)
   {
-    if (strncmp(namelist[i]->d_name, "memory-controller@", 18) == 0)
+    if (strncmp(children[i].c_str(), "memory-controller@", 18) == 0)
     {
-      add_memory_bank(namelist[i]->d_name, DEVICETREE, core);
+      add_memory_bank(children[i], DEVICETREE, core);
     }
-    free(namelist[i]);
   }
-  free(namelist);
 }
 
 
@@ -1441,34 +1636,34 @@ bool scan_device_tree(hwNode & n)
     core = n.getChild("core");
   }
 
-  if (exists(DEVICETREE "/ibm,vendor-model"))
-	  n.setProduct(get_string(DEVICETREE "/ibm,vendor-model", n.getProduct()));
+  if (dt_exists(DEVICETREE "/ibm,vendor-model"))
+	  n.setProduct(dt_string(DEVICETREE "/ibm,vendor-model", n.getProduct()));
   else
-	  n.setProduct(get_string(DEVICETREE "/model", n.getProduct()));
+	  n.setProduct(dt_string(DEVICETREE "/model", n.getProduct()));
 
   n.addHint("icon", string("motherboard"));
 
-  n.setSerial(get_string(DEVICETREE "/serial-number", n.getSerial()));
+  n.setSerial(dt_string(DEVICETREE "/serial-number", n.getSerial()));
   if (n.getSerial() == "")
   {
-	  if (exists(DEVICETREE "/ibm,vendor-system-id"))
-		  n.setSerial(get_string(DEVICETREE "/ibm,vendor-system-id"));
+	  if (dt_exists(DEVICETREE "/ibm,vendor-system-id"))
+		  n.setSerial(dt_string(DEVICETREE "/ibm,vendor-system-id"));
 	  else
-		  n.setSerial(get_string(DEVICETREE "/system-id"));
+		  n.setSerial(dt_string(DEVICETREE "/system-id"));
   }
   fix_serial_number(n);
 
-  n.setVendor(get_string(DEVICETREE "/copyright", n.getVendor()));
+  n.setVendor(dt_string(DEVICETREE "/copyright", n.getVendor()));
   get_apple_model(n);
   get_ips_model(n);
   get_ibm_model(n);
-  if (matches(get_string(DEVICETREE "/compatible"), "^ibm,powernv"))
+  if (matches(dt_string(DEVICETREE "/compatible"), "^ibm,powernv"))
   {
-    n.setVendor(get_string(DEVICETREE "/vendor", "IBM"));
+    n.setVendor(dt_string(DEVICETREE "/vendor", "IBM"));
 
-    if (exists(DEVICETREE "/model-name"))
+    if (dt_exists(DEVICETREE "/model-name"))
       n.setProduct(n.getProduct() + " (" +
-		   hw::strip(get_string(DEVICETREE "/model-name")) + ")");
+		   hw::strip(dt_string(DEVICETREE "/model-name")) + ")");
 
     n.setDescription("PowerNV");
     if (core)
@@ -1482,26 +1677,26 @@ bool scan_device_tree(hwNode & n)
       n.addCapability("opal", "OPAL firmware");
     }
   }
-  else if(matches(get_string(DEVICETREE "/compatible"), "qemu,pseries"))
+  else if(matches(dt_string(DEVICETREE "/compatible"), "qemu,pseries"))
   {
     string product;
 
-    if ( exists(DEVICETREE "/host-serial") )
-      n.setSerial(get_string(DEVICETREE "/host-serial"));
+    if ( dt_exists(DEVICETREE "/host-serial") )
+      n.setSerial(dt_string(DEVICETREE "/host-serial"));
 
-    if ( exists( DEVICETREE "/vm,uuid") )
-      n.setConfig("uuid", get_string(DEVICETREE "/vm,uuid"));
+    if ( dt_exists( DEVICETREE "/vm,uuid") )
+      n.setConfig("uuid", dt_string(DEVICETREE "/vm,uuid"));
 
-    n.setVendor(get_string(DEVICETREE "/vendor", "IBM"));
+    n.setVendor(dt_string(DEVICETREE "/vendor", "IBM"));
 
-    if ( exists(DEVICETREE "/hypervisor/compatible") ) {
-      product = get_string(DEVICETREE "/hypervisor/compatible");
+    if ( dt_exists(DEVICETREE "/hypervisor/compatible") ) {
+      product = dt_string(DEVICETREE "/hypervisor/compatible");
       product = product.substr(0, product.size()-1);
     }
 
-    if ( exists(DEVICETREE "/host-model") ) {
+    if ( dt_exists(DEVICETREE "/host-model") ) {
       product += " Model# ";
-      product += get_string(DEVICETREE "/host-model");
+      product += dt_string(DEVICETREE "/host-model");
     }
 
     if (product != "")
@@ -1525,14 +1720,14 @@ bool scan_device_tree(hwNode & n)
       core->addHint("icon", string("board"));
       scan_devtree_root(*core);
       scan_devtree_bootrom(*core);
-      if (exists(DEVICETREE "/ibm,lpar-capable")) {
+      if (dt_exists(DEVICETREE "/ibm,lpar-capable")) {
         n.setDescription("pSeries LPAR");
-        if (exists( DEVICETREE "/ibm,partition-uuid"))
-          n.setConfig("uuid", get_string(DEVICETREE "/ibm,partition-uuid"));
+        if (dt_exists( DEVICETREE "/ibm,partition-uuid"))
+          n.setConfig("uuid", dt_string(DEVICETREE "/ibm,partition-uuid"));
         scan_devtree_cpu_power(*core);
       }
       else {
-        if (exists(DEVICETREE "/cpus"))
+        if (dt_exists(DEVICETREE "/cpus"))
           scan_devtree_cpu(*core);
       }
       scan_devtree_memory(*core);
@@ -1550,13 +1745,14 @@ void add_device_tree_info(hwNode & n, string sysfs_path)
 
   if (!exists(of_node))
     return;
+  of_node = realpath(of_node);                    // in the device tree snapshot
 
   /* read location / slot data */
-  val = hw::strip(get_string(of_node + "/ibm,loc-code", ""));
+  val = hw::strip(dt_string(of_node + "/ibm,loc-code", ""));
   if (val == "")
-    val = hw::strip(get_string(of_node + "/ibm,slot-location-code", ""));
+    val = hw::strip(dt_string(of_node + "/ibm,slot-location-code", ""));
   if (val == "")
-    val = hw::strip(get_string(of_node + "/ibm,slot-label"));
+    val = hw::strip(dt_string(of_node + "/ibm,slot-label"));
 
   if (val != "")
     n.setSlot(val);
@@ -3,11 +3,21 @@
 #include "osutils.h"
 #include "heuristics.h"
 #include "partitions.h"
+#include "blockio.h"
+#include "options.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <set>
+#include <map>
 
 //#include <linux/fs.h>
 
@@ -29,6 +39,126 @@ __ID("@(#) $Id$");
 #define BLKPBSZGET _IO(0x12,123)
 #endif
 
+#define MAXDISKPROBES 8                           // number of disks probed at the same time
+#define DISKPROBETIMEOUT 20                       // seconds allowed to probe one disk
+#define PREFETCHTIMEOUT 5                         // seconds allowed to read all the headers
+
+#define SYS_BLOCK "/sys/block"
+
+static set < string > deferred;                   // disks waiting for probe_disks()
+static pthread_mutex_t deferredlock = PTHREAD_MUTEX_INITIALIZER;
+
+void defer_probe(const hwNode & n)
+{
+  if (n.getLogicalName() == "")
+    return;
+
+  pthread_mutex_lock(&deferredlock);
+  deferred.insert(n.getLogicalName());
+  pthread_mutex_unlock(&deferredlock);
+}
+
+/*
+ * Block device attributes, as reported by the kernel under /sys/block: read
+ * all at once the first time a disk is scanned, indexed by device number, so
+ * that scanning a disk doesn't need to open it
+ */
+struct blockattrs
+{
+  unsigned long long size;
+  int rotational;
+  long logicalsectorsize;
+  long sectorsize;
+  long requests;
+  long discardgranularity;
+  string scheduler;
+};
+
+static map < dev_t, blockattrs > blockdevices;
+
+static string active_scheduler(const string & s)
+{
+  size_t start = s.find('[');
+  size_t end = s.find(']', start);
+
+  if ((start == string::npos) || (end == string::npos))
+    return hw::strip(s);
+
+  return s.substr(start + 1, end - start - 1);
+}
+
+static void collect_blockdevices()
+{
+  static bool collected = false;
+  struct dirent **namelist = NULL;
+  int count = 0;
+
+  if (collected)
+    return;
+  collected = true;
+
+  count = scandir(SYS_BLOCK, &namelist, NULL, alphasort);
+  if (count < 0)
+    return;
+
+  for (int i = 0; i < count; i++)
+  {
+    string dir = string(SYS_BLOCK"/") + namelist[i]->d_name;
+    unsigned int maj = 0, min = 0;
+
+    if ((namelist[i]->d_name[0] != '.') &&
+      (sscanf(get_string(dir + "/dev").c_str(), "%u:%u", &maj, &min) == 2))
+    {
+      blockattrs & attrs = blockdevices[makedev(maj, min)];
+
+      attrs.size = 512ULL * strtoull(get_string(dir + "/size", "0").c_str(), NULL, 10);
+      attrs.rotational = get_number(dir + "/queue/rotational", -1);
+      attrs.logicalsectorsize = get_number(dir + "/queue/logical_block_size");
+      attrs.sectorsize = get_number(dir + "/queue/physical_block_size");
+      attrs.requests = get_number(dir + "/queue/nr_requests");
+      attrs.discardgranularity = get_number(dir + "/queue/discard_granularity");
+      attrs.scheduler = active_scheduler(get_string(dir + "/queue/scheduler"));
+    }
+    free(namelist[i]);
+  }
+  free(namelist);
+}
+
+static bool scan_blockattrs(hwNode & n)
+{
+  struct stat buf;
+
+  if ((stat(n.getLogicalName().c_str(), &buf) != 0) || !S_ISBLK(buf.st_mode))
+    return false;
+
+  collect_blockdevices();
+
+  map < dev_t, blockattrs >::const_iterator i = blockdevices.find(buf.st_rdev);
+  if (i == blockdevices.end())
+    return false;
+
+  const blockattrs & attrs = i->second;
+
+  if (attrs.sectorsize)
+    n.setConfig("sectorsize", attrs.sectorsize);
+  if (attrs.logicalsectorsize)
+    n.setConfig("logicalsectorsize", attrs.logicalsectorsize);
+  if ((n.getSize() == 0) && attrs.size)
+    n.setSize(attrs.size);
+  if (attrs.rotational == 1)
+    n.addCapability("rotational", "Rotating media");
+  if (attrs.rotational == 0)
+    n.addCapability("ssd", "Solid-state (non-rotating) media");
+  if (attrs.requests)
+    n.setConfig("requests", attrs.requests);
+  if (attrs.discardgranularity)
+    n.setConfig("discardgranularity", attrs.discardgranularity);
+  if ((attrs.scheduler != "") && (attrs.scheduler != "none"))
+    n.setConfig("scheduler", attrs.scheduler);
+
+  return true;
+}
+
 bool scan_disk(hwNode & n)
 {
   long size = 0;
@@ -39,6 +169,13 @@ bool scan_disk(hwNode & n)
   if (n.getLogicalName() == "")
     return false;
 
+  if (scan_blockattrs(n))                         // no need to open the device
+  {
+    n.addHint("icon", string("disc"));
+    defer_probe(n);
+    return true;
+  }
+
   int fd = open(n.getLogicalName().c_str(), O_RDONLY | O_NONBLOCK);
 
   if (fd < 0)
@@ -76,8 +213,233 @@ bool scan_disk(hwNode & n)
   if(n.getSize()>=0)
   {
     n.addHint("icon", string("disc"));
-    scan_partitions(n);
+    defer_probe(n);
+  }
+
+  return true;
+}
+
+/*
+ * Reading partition tables and superblocks may block for a long time on
+ * failing disks or stale LUNs, so scan_disk() only marks disks and the actual
+ * probing is done here, once the tree is complete: up to MAXDISKPROBES disks
+ * are probed at the same time, each by its own thread working on a private
+ * node, as soon as its headers have been prefetched. Results are merged
+ * back into the tree when everything is done; a disk that does not answer
+ * within DISKPROBETIMEOUT seconds is left alone (its thread is abandoned) and
+ * marked as such.
+ */
+
+static pthread_mutex_t probelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probefinished = PTHREAD_COND_INITIALIZER;
+static bool timedout = false;                     // some probes are still running
+
+struct diskprobe
+{
+  hwNode * target;
+  hwNode result;
+  bool started;
+  bool done;
+  bool abandoned;
+  time_t deadline;
+
+  diskprobe(hwNode * n):
+    target(n), result("disk", hw::disk), started(false), done(false), abandoned(false), deadline(0) {}
+};
+
+static void * probe_disk(void * arg)
+{
+  diskprobe * p = (diskprobe*)arg;
+  bool abandoned = false;
+
+  scan_partitions(p->result);
+
+  pthread_mutex_lock(&probelock);
+  p->done = true;
+  abandoned = p->abandoned;
+  pthread_cond_signal(&probefinished);
+  pthread_mutex_unlock(&probelock);
+
+  if(abandoned)
+    delete p;                                     // nobody is waiting for us anymore
+
+  return NULL;
+}
+
+static void prefetch_ready()
+{
+  pthread_mutex_lock(&probelock);
+  pthread_cond_broadcast(&probefinished);         // some disk can be probed now
+  pthread_mutex_unlock(&probelock);
+}
+
+static void find_deferred(hwNode & n, vector < hwNode * > & disks)
+{
+  if(deferred.erase(n.getLogicalName()) > 0)
+  {
+    if(enabled("media") || !n.isCapable("removable"))
+      disks.push_back(&n);                        // -no-media: leave removable media alone
+  }
+
+  for(unsigned int i = 0; i < n.countChildren(); i++)
+    find_deferred(*n.getChild(i), disks);
+}
+
+static void merge_probe(hwNode & n, const hwNode & result)
+{
+  if(result.getClass() != hw::disk)
+    n.setClass(result.getClass());                // whole-disk volume
+  n.setDescription(result.getDescription());
+  n.setVendor(result.getVendor());
+  n.setVersion(result.getVersion());
+  n.setSerial(result.getSerial());
+  n.setSize(result.getSize());
+  n.setCapacity(result.getCapacity());
+  n.merge(result);
+
+  for(unsigned int i = 0; i < result.countChildren(); i++)
+    n.addChild(*((hwNode&)result).getChild(i));
+}
+
+bool probe_disks(hwNode & n)
+{
+  vector < hwNode * > disks;
+  vector < diskprobe * > probes;
+  vector < string > names;
+  pthread_attr_t attr;
+  unsigned int running = 0, pending = 0;
+  time_t prefetchdeadline = 0;
+
+  find_deferred(n, disks);
+  deferred.clear();
+  if(disks.size() == 0)
+    return false;
+
+  for(unsigned int i = 0; i < disks.size(); i++)
+  {
+    diskprobe * p = new diskprobe(disks[i]);
+
+    p->result.setLogicalName(disks[i]->getLogicalName());
+    p->result.setBusInfo(disks[i]->getBusInfo());
+    p->result.setDescription(disks[i]->getDescription());
+    p->result.setVendor(disks[i]->getVendor());
+    p->result.setVersion(disks[i]->getVersion());
+    p->result.setSerial(disks[i]->getSerial());
+    p->result.setSize(disks[i]->getSize());
+    p->result.setCapacity(disks[i]->getCapacity());
+    vector < string > capabilities = disks[i]->getCapabilitiesList();
+    for(unsigned int j = 0; j < capabilities.size(); j++)
+      p->result.addCapability(capabilities[j], disks[i]->getCapabilityDescription(capabilities[j]));
+    names.push_back(disks[i]->getLogicalName());
+    probes.push_back(p);
   }
 
+  prefetchdevices(names, prefetch_ready, PREFETCHSIZE, PREFETCHTIMEOUT);
+  prefetchdeadline = time(NULL) + PREFETCHTIMEOUT;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  pthread_mutex_lock(&probelock);
+  pending = probes.size();
+  while(pending > 0)
+  {
+    time_t now = time(NULL);
+    time_t wakeup = 0;
+    bool waiting = false;                         // for some headers to be read
+
+    for(unsigned int i = 0; (i < probes.size()) && (running < MAXDISKPROBES); i++)
+    {
+      pthread_t thread;
+      diskprobe * p = probes[i];
+
+      if(!p || p->started || p->done)
+        continue;
+      if(!prefetchready(p->target->getLogicalName()))
+      {
+        waiting = true;                           // start with the disks we already have data for
+        continue;
+      }
+
+      p->started = true;
+      p->deadline = now + (p->result.isCapable("removable")?MEDIAPROBETIMEOUT:DISKPROBETIMEOUT);
+      if(pthread_create(&thread, &attr, probe_disk, p) == 0)
+        running++;
+      else
+      {
+        pthread_mutex_unlock(&probelock);         // can't start a thread: probe synchronously
+        scan_partitions(p->result);
+        pthread_mutex_lock(&probelock);
+        p->started = false;
+        p->done = true;
+        pending--;
+      }
+    }
+    if(waiting && (running < MAXDISKPROBES))
+      wakeup = prefetchdeadline;
+
+    for(unsigned int i = 0; i < probes.size(); i++)
+    {
+      diskprobe * p = probes[i];
+
+      if(!p || !p->started)
+        continue;
+      if(p->done)
+      {
+        p->started = false;                       // collected
+        running--;
+        pending--;
+      }
+      else
+      if(now >= p->deadline)
+      {
+        p->abandoned = true;
+        timedout = true;
+        p->target->setConfig("probe", "timed out");
+        probes[i] = NULL;                         // the thread will clean up after itself
+        running--;
+        pending--;
+      }
+      else
+      if(!wakeup || (p->deadline < wakeup))
+        wakeup = p->deadline;
+    }
+
+    if(wakeup)
+    {
+      struct timespec ts;
+
+      ts.tv_sec = wakeup;
+      ts.tv_nsec = 0;
+      pthread_cond_timedwait(&probefinished, &probelock, &ts);
+    }
+  }
+  pthread_mutex_unlock(&probelock);
+  pthread_attr_destroy(&attr);
+  prefetchrelease();                              // free the headers of disks that were never opened
+
+  for(unsigned int i = 0; i < probes.size(); i++)
+    if(probes[i])
+    {
+      merge_probe(*probes[i]->target, probes[i]->result);
+      delete probes[i];
+    }
+
   return true;
 }
+
+/*
+ * Abandoned probes still use the partition/volume detectors' and the block
+ * caches' global state, so the program must not run static destructors
+ * (i.e. exit()) until they're done: use _exit() instead.
+ */
+bool probes_abandoned()
+{
+  bool result = false;
+
+  pthread_mutex_lock(&probelock);
+  result = timedout;
+  pthread_mutex_unlock(&probelock);
+
+  return result;
+}
@@ -3,5 +3,10 @@
 
 #include "hw.h"
 
+#define MEDIAPROBETIMEOUT 5                       // seconds allowed for removable media
+
 bool scan_disk(hwNode & n);
+bool probe_disks(hwNode & n);
+bool probes_abandoned();
+void defer_probe(const hwNode & n);
 #endif
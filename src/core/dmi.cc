@@ -79,8 +79,10 @@
 #include "options.h"
 #include "dmi.h"
 #include "osutils.h"
+#include "cache.h"
 
 #include <map>
+#include <set>
 #include <vector>
 #include <fstream>
 
@@ -95,6 +97,11 @@
 __ID("@(#) $Id$");
 
 #define SYSFSDMI "/sys/firmware/dmi/tables"
+#define BOOT_ID "/proc/sys/kernel/random/boot_id"
+#define DMICACHE "dmi"
+#define DMI_EP_SIZE 32                            // room for any entry point
+#define LEGACY_BIOS_START 0xE0000
+#define LEGACY_BIOS_SIZE 0x20000
 
 static int currentcpu = 0;
 
@@ -975,875 +982,1005 @@ static string dmi_handle(u16 handle)
 }
 
 
-static void dmi_table(const u8 *buf,
-int len,
-hwNode & node,
-int dmiversionmaj,
-int dmiversionmin,
-int dmiversionrev)
+/*
+ * first pass over the table: every structure in table order, indexed by
+ * handle, the memory devices grouped by the array they belong to and the
+ * structures other ones contain (a board's devices, a processor's caches,
+ * a memory controller's modules) so that references are resolved without
+ * walking the tree
+ */
+struct dmi_index
 {
-  struct dmi_header *dm;
-  hwNode *hardwarenode = NULL;
-  const u8 *data;
-  int i = 0;
-  string handle;
+  vector < struct dmi_header * > structures;
+  map < u16, struct dmi_header * > handles;
+  map < u16, vector < struct dmi_header * > > devices;  // array -> type 17
+  map < u16, struct dmi_header * > owners;        // contained -> container
+};
 
-  if (len == 0)
-// no data
-    return;
+static void dmi_own(dmi_index & index, struct dmi_header *container, u16 handle)
+{
+  if ((handle != container->handle) &&
+    (index.handles.find(handle) != index.handles.end()) &&
+    (index.owners.find(handle) == index.owners.end()))
+    index.owners[handle] = container;             // the first one to claim it
+}
 
-  data = buf;
-  while (data + sizeof(struct dmi_header) <= (u8 *) buf + len)
+static void dmi_index_table(const u8 *buf,
+int len,
+dmi_index & index)
+{
+  const u8 *data = buf;
+
+  while (data + sizeof(struct dmi_header) <= buf + len)
   {
-    u32 u, u2;
-    dm = (struct dmi_header *) data;
+    struct dmi_header *dm = (struct dmi_header *) data;
 
-/*
- * we won't read beyond allocated memory
- */
-    if (data + dm->length > (u8 *) buf + len)
+    if (data + dm->length > buf + len)
 // incomplete structure, abort decoding
       break;
 
-    handle = dmi_handle(dm->handle);
+    index.structures.push_back(dm);
+    if (index.handles.find(dm->handle) == index.handles.end())
+      index.handles[dm->handle] = dm;
+
+    data += dm->length;
+    while ((data + 1 < buf + len) && (*data || data[1]))
+      data++;
+    data += 2;
+  }
+
+// all the "System Memory" arrays end up as a single node (see type 16 in
+// dmi_table), so their devices are kept together, in table order
+  map < u16, u16 > arrays;
+  struct dmi_header *systemmemory = NULL;
+  for (size_t i = 0; i < index.structures.size(); i++)
+  {
+    struct dmi_header *dm = index.structures[i];
 
-    hardwarenode = node.getChild("core");
-    if (!hardwarenode)
+    if (dm->type != 16)
+      continue;
+    if (((u8 *) dm)[0x05] == 0x03)
     {
-      node.addChild(hwNode("core", hw::bus));
-      hardwarenode = node.getChild("core");
+      if (!systemmemory)
+        systemmemory = dm;
+      arrays[dm->handle] = systemmemory->handle;
     }
-    if (!hardwarenode)
-      hardwarenode = &node;
+    else
+      arrays[dm->handle] = dm->handle;
+  }
+  for (size_t i = 0; i < index.structures.size(); i++)
+  {
+    const u8 *data = (u8 *) index.structures[i];
+    map < u16, u16 >::const_iterator array;
+
+    if (index.structures[i]->type != 17)
+      continue;
+    array = arrays.find(data[0x05] << 8 | data[0x04]);
+    if (array != arrays.end())
+      index.devices[array->second].push_back(index.structures[i]);
+  }
+
+  for (size_t i = 0; i < index.structures.size(); i++)
+  {
+    struct dmi_header *dm = index.structures[i];
+    const u8 *data = (u8 *) dm;
 
     switch (dm->type)
     {
-      case 0:
-// BIOS Information Block
-        {
-          string release(dmi_string(dm,
-            data[0x08]));
-          hwNode newnode("firmware",
-            hw::memory,
-            dmi_string(dm,
-            data[0x04]));
-          newnode.setVersion(dmi_string(dm, data[5]));
-          if (data[0x09] != 0xFF)
-            newnode.setCapacity(64 * (data[0x09] + 1) * 1024);
-          else
-          {
-            if (dm->length < 0x1A)
-              newnode.setCapacity(16 * 1024 * 1024);
-            else
-            {
-              unsigned int unit = (data[0x19] << 8 | data[0x18]) & 0x4000 ? 1024 : 1024 * 1024;
-              newnode.setCapacity(((data[0x19] << 8 | data[0x18]) & 0x3FFF) * unit);
-            }
-          }
-          newnode.setSize(16 * (0x10000 - (data[0x07] << 8 | data[0x06])));
-          newnode.setPhysId(dm->handle);
-          newnode.setDescription(_("BIOS"));
-          newnode.addHint("icon", string("chip"));
-          newnode.claim();
-
-          dmi_bios_features(data[0x0D] << 24 | data[0x0C] << 16 | data[0x0B] << 8 |
-            data[0x0A],
-            data[0x11] << 24 | data[0x10] << 16 | data[0x0F] << 8 |
-            data[0x0E], newnode);
-
-          if (dm->length > 0x12)
-            dmi_bios_features_ext(&data[0x12], dm->length - 0x12, newnode);
-
-          if (release != "")
-            newnode.setDate(release);
-          hardwarenode->addChild(newnode);
-        }
+      case 2:                                     // contained object handles
+      case 5:                                     // memory module handles
+        if (dm->length > 0x0E)
+          for (int j = 0; (j < data[0x0E]) && (0x0F + 2 * j + 1 < dm->length); j++)
+            dmi_own(index, dm, data[0x0F + 2 * j + 1] << 8 | data[0x0F + 2 * j]);
         break;
-
-      case 1:
-// System Information Block
-        node.setHandle(handle);
-        node.setVendor(dmi_string(dm, data[0x04]));
-        node.setProduct(dmi_string(dm, data[0x05]));
-        node.setVersion(dmi_string(dm, data[0x06]));
-        node.setSerial(dmi_string(dm, data[0x07]));
-        if (dm->length >= 0x19)
-          node.setConfig("uuid", dmi_uuid(data + 0x08));
-        if (dm->length >= 0x1B)
-        {
-          node.setConfig("sku", dmi_string(dm, data[0x19]));
-	  if (dmi_string(dm, data[0x19]) != "")
-	    node.setProduct(node.getProduct() + " (" + dmi_string(dm, data[0x19]) + ")");
-          node.setConfig("family", dmi_string(dm, data[0x1A]));
-        }
+      case 4:                                     // L1, L2 and L3 cache handles
+        if (dm->length >= 0x20)
+          for (int j = 0x1A; j < 0x20; j += 2)
+            dmi_own(index, dm, data[j + 1] << 8 | data[j]);
         break;
+    }
+  }
+}
 
-      case 2:
-// Board Information Block
-        {
-          // we are the only system board on the computer so connect everything to us
-          if ((dm->length <= 0x0E) || (data[0x0E] == 0))
-          {
-            hardwarenode->setVendor(dmi_string(dm, data[0x04]));
-            hardwarenode->setProduct(dmi_string(dm, data[0x05]));
-            hardwarenode->setVersion(dmi_string(dm, data[0x06]));
-            hardwarenode->setSerial(dmi_string(dm, data[0x07]));
-            if(dm->length >= 0x0A)
-              hardwarenode->setSlot(dmi_string(dm, data[0x0A]));
-            hardwarenode->setHandle(handle);
-            hardwarenode->setDescription(_("Motherboard"));
-            hardwarenode->addHint("icon", string("motherboard"));
-          }
-          else
-          {
-            hwNode newnode("board",
-              hw::bus);
-
-            if (dm->length >= 0x0E)
-              for (int i = 0; i < data[0x0E]; i++)
-                newnode.
-                  attractHandle(dmi_handle
-                  (data[0x0F + 2 * i + 1] << 8 |
-                  data[0x0F + 2 * i]));
-
-            newnode.setVendor(dmi_string(dm, data[0x04]));
-            newnode.setProduct(dmi_string(dm, data[0x05]));
-            newnode.setVersion(dmi_string(dm, data[0x06]));
-            newnode.setSerial(dmi_string(dm, data[0x07]));
-            newnode.setSlot(dmi_string(dm, data[0x0A]));
-            newnode.setHandle(handle);
-            newnode.setPhysId(dm->handle);
-            newnode.setDescription(dmi_board_type(data[0x0D]));
-            hardwarenode->addChild(newnode);
-          }
-        }
-        break;
 
-      case 3:
-// Chassis Information Block
-//
-// special case: if the system characteristics are still unknown,
-// use values from the chassis
-        if (node.getVendor() == "")
-          node.setVendor(dmi_string(dm, data[0x04]));
-        if (node.getProduct() == "")
-          node.setProduct(dmi_string(dm, data[0x05]));
-        if (node.getVersion() == "")
-          node.setVersion(dmi_string(dm, data[0x06]));
-        if (node.getSerial() == "")
-          node.setSerial(dmi_string(dm, data[0x07]));
-        dmi_chassis(data[0x05] & 0x7F, node);
-        break;
+/*
+ * Memory Device (type 17)
+ */
+static hwNode dmi_memory_device(struct dmi_header *dm,
+const string & id,
+int dmiversionmaj,
+int dmiversionmin)
+{
+  const u8 *data = (u8 *) dm;
+  string handle = dmi_handle(dm->handle);
+  u32 u;
+
+  hwNode newnode(id,
+    hw::memory);
+  string slot = "";
+  string description = "";
+  unsigned long long size = 0;
+  unsigned long long clock = 0;
+  u16 width = 0;
+  char bits[12];
+  newnode.setDescription(_("empty memory bank"));
+  newnode.addHint("icon", string("memory"));
+  strcpy(bits, "");
+// total width
+  u = data[0x09] << 8 | data[0x08];
+  if (u != 0xFFFF)
+    width = u;
+//data width
+  u = data[0x0B] << 8 | data[0x0A];
+  if ((u != 0xFFFF) && (u != 0))
+  {
+    if ((u == width) || (width == 0))
+    {
+      snprintf(bits, sizeof(bits), "%d", u);
+      newnode.setWidth(width);
+    }
+    else
+    {
+      snprintf(bits, sizeof(bits), "%d/%d", width, u);
+      newnode.setWidth(u<width?u:width);
+    }
+  }
+  else
+  {
+    if (width != 0)
+    {
+      snprintf(bits, sizeof(bits), "%d", width);
+      newnode.setWidth(width);
+    }
+  }
+
+// size
+  u = data[0x0D] << 8 | data[0x0C];
+  if (((dmiversionmaj > 2)
+    || ((dmiversionmaj == 2) && (dmiversionmin >= 7)))
+    && u == 0x7FFF) {
+      unsigned long long extendsize = (data[0x1F] << 24) | (data[0x1E] << 16) | (data[0x1D] << 8) | data[0x1C];
+      extendsize &= 0x7FFFFFFFUL;
+      size = extendsize * 1024ULL * 1024ULL;
+  }
+  else
+  if (u != 0xFFFF)
+    size = (1024ULL * (u & 0x7FFF) * ((u & 0x8000) ? 1 : 1024ULL));
+  description += string(dmi_memory_device_form_factor(data[0x0E]));
+  slot = dmi_string(dm, data[0x10]);
+//printf("\t\tBank Locator: %s\n", dmi_string(dm, data[0x11]));
+  description += string(dmi_memory_device_type(data[0x12]));
+  u = data[0x14] << 8 | data[0x13];
+  if (u & 0x1FFE)
+    description += dmi_memory_device_detail(u);
+  if (dm->length > 0x15)
+  {
+    char buffer[80];
+    u = data[0x16] << 8 | data[0x15];
+// speed
+    clock = u * 1000000;                  // u is a frequency in MHz
+    if (u == 0)
+      strcpy(buffer, "");
+    else
+      snprintf(buffer, sizeof(buffer),
+        "%u MHz (%.1f ns)", u, (1000.0 / u));
+    description += " " + string(buffer);
+  }
+
+  newnode.setHandle(handle);
+//newnode.setPhysId(dm->handle);
+  newnode.setSlot(slot);
+  if (dm->length > 0x17)
+    newnode.setVendor(dmi_string(dm, data[0x17]));
+  if (dm->length > 0x18)
+    newnode.setSerial(dmi_string(dm, data[0x18]));
+  if (dm->length > 0x1A)
+    newnode.setProduct(dmi_string(dm, data[0x1A]));
+  newnode.setDescription(description);
+  newnode.setSize(size);
+  if(newnode.getSize()==0)
+    newnode.setDescription(newnode.getDescription() + " " + _("[empty]"));
+  newnode.setClock(clock);
+
+  return newnode;
+}
+
+
+/*
+ * attach the memory devices of an array; ids are numbered upfront (following
+ * the banks already there) so that adding thousands of banks doesn't have
+ * addChild() look for a free id one by one
+ */
+static void dmi_memory_devices(const vector < struct dmi_header * > & devices,
+hwNode & array,
+int dmiversionmaj,
+int dmiversionmin)
+{
+  size_t first = array.countChildren();
+  bool numbered = (first + devices.size() > 1) &&
+    ((first == 0) || array.getChild("bank:" + tostring(first - 1)));
+
+  for (size_t i = 0; i < devices.size(); i++)
+    array.addChild(dmi_memory_device(devices[i],
+      numbered ? "bank:" + tostring(first + i) : "bank",
+      dmiversionmaj, dmiversionmin));
+}
+
+
+/*
+ * everything the decoders need: the index, the SMBIOS version and the
+ * structures already decoded (contained ones are decoded with their
+ * container, see dmi_contained())
+ */
+struct dmi_context
+{
+  hwNode & node;
+  dmi_index index;
+  int dmiversionmaj;
+  int dmiversionmin;
+  set < struct dmi_header * > decoded;
+
+  dmi_context(hwNode & n, int maj, int min):
+    node(n), dmiversionmaj(maj), dmiversionmin(min) {}
+};
+
+typedef void (*dmi_decoder)(dmi_context & ctx, struct dmi_header *dm, hwNode * container);
+
+static void dmi_decode(dmi_context & ctx, struct dmi_header *dm, hwNode * container);
+
+static hwNode & dmi_core(dmi_context & ctx)
+{
+  hwNode *core = ctx.node.getChild("core");
+
+  if (!core)
+  {
+    ctx.node.addChild(hwNode("core", hw::bus));
+    core = ctx.node.getChild("core");
+  }
+
+  return core ? *core : ctx.node;
+}
+
+
+/*
+ * where a structure's node goes: into the structure that contains it, if
+ * any, on the motherboard otherwise
+ */
+static hwNode & dmi_parent(dmi_context & ctx, hwNode * container)
+{
+  return container ? *container : dmi_core(ctx);
+}
+
+
+/*
+ * decode the structure a container refers to, unless another one claimed it
+ * first (see dmi_index_table())
+ */
+static void dmi_contained(dmi_context & ctx, struct dmi_header *dm, u16 handle, hwNode & container)
+{
+  map < u16, struct dmi_header * >::const_iterator owner = ctx.index.owners.find(handle);
+
+  if ((owner == ctx.index.owners.end()) || (owner->second != dm))
+    return;
+
+  struct dmi_header *contained = ctx.index.handles[handle];
+  if (ctx.decoded.find(contained) == ctx.decoded.end())
+    dmi_decode(ctx, contained, &container);
+}
+
+
+/*
+ * BIOS Information (type 0)
+ */
+static void dmi_bios(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  string release(dmi_string(dm,
+    data[0x08]));
+  hwNode newnode("firmware",
+    hw::memory,
+    dmi_string(dm,
+    data[0x04]));
+  newnode.setVersion(dmi_string(dm, data[5]));
+  if (data[0x09] != 0xFF)
+    newnode.setCapacity(64 * (data[0x09] + 1) * 1024);
+  else
+  {
+    if (dm->length < 0x1A)
+      newnode.setCapacity(16 * 1024 * 1024);
+    else
+    {
+      unsigned int unit = (data[0x19] << 8 | data[0x18]) & 0x4000 ? 1024 : 1024 * 1024;
+      newnode.setCapacity(((data[0x19] << 8 | data[0x18]) & 0x3FFF) * unit);
+    }
+  }
+  newnode.setSize(16 * (0x10000 - (data[0x07] << 8 | data[0x06])));
+  newnode.setPhysId(dm->handle);
+  newnode.setDescription(_("BIOS"));
+  newnode.addHint("icon", string("chip"));
+  newnode.claim();
+
+  dmi_bios_features(data[0x0D] << 24 | data[0x0C] << 16 | data[0x0B] << 8 |
+    data[0x0A],
+    data[0x11] << 24 | data[0x10] << 16 | data[0x0F] << 8 |
+    data[0x0E], newnode);
+
+  if (dm->length > 0x12)
+    dmi_bios_features_ext(&data[0x12], dm->length - 0x12, newnode);
+
+  if (release != "")
+    newnode.setDate(release);
+  dmi_parent(ctx, container).addChild(newnode);
+}
+
+
+/*
+ * System Information (type 1)
+ */
+static void dmi_system(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  hwNode & node = ctx.node;
+
+  node.setHandle(dmi_handle(dm->handle));
+  node.setVendor(dmi_string(dm, data[0x04]));
+  node.setProduct(dmi_string(dm, data[0x05]));
+  node.setVersion(dmi_string(dm, data[0x06]));
+  node.setSerial(dmi_string(dm, data[0x07]));
+  if (dm->length >= 0x19)
+    node.setConfig("uuid", dmi_uuid(data + 0x08));
+  if (dm->length >= 0x1B)
+  {
+    node.setConfig("sku", dmi_string(dm, data[0x19]));
+    if (dmi_string(dm, data[0x19]) != "")
+      node.setProduct(node.getProduct() + " (" + dmi_string(dm, data[0x19]) + ")");
+    node.setConfig("family", dmi_string(dm, data[0x1A]));
+  }
+}
+
+
+/*
+ * Baseboard Information (type 2)
+ */
+static void dmi_board(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+
+  // we are the only system board on the computer so connect everything to us
+  if ((dm->length <= 0x0E) || (data[0x0E] == 0))
+  {
+    hwNode & hardwarenode = dmi_core(ctx);
+
+    hardwarenode.setVendor(dmi_string(dm, data[0x04]));
+    hardwarenode.setProduct(dmi_string(dm, data[0x05]));
+    hardwarenode.setVersion(dmi_string(dm, data[0x06]));
+    hardwarenode.setSerial(dmi_string(dm, data[0x07]));
+    if(dm->length >= 0x0A)
+      hardwarenode.setSlot(dmi_string(dm, data[0x0A]));
+    hardwarenode.setHandle(dmi_handle(dm->handle));
+    hardwarenode.setDescription(_("Motherboard"));
+    hardwarenode.addHint("icon", string("motherboard"));
+  }
+  else
+  {
+    hwNode newnode("board",
+      hw::bus);
+
+    for (int i = 0; (i < data[0x0E]) && (0x0F + 2 * i + 1 < dm->length); i++)
+      dmi_contained(ctx, dm, data[0x0F + 2 * i + 1] << 8 | data[0x0F + 2 * i], newnode);
+
+    newnode.setVendor(dmi_string(dm, data[0x04]));
+    newnode.setProduct(dmi_string(dm, data[0x05]));
+    newnode.setVersion(dmi_string(dm, data[0x06]));
+    newnode.setSerial(dmi_string(dm, data[0x07]));
+    newnode.setSlot(dmi_string(dm, data[0x0A]));
+    newnode.setHandle(dmi_handle(dm->handle));
+    newnode.setPhysId(dm->handle);
+    newnode.setDescription(dmi_board_type(data[0x0D]));
+    dmi_parent(ctx, container).addChild(newnode);
+  }
+}
+
+
+/*
+ * System Enclosure or Chassis (type 3)
+ *
+ * special case: if the system characteristics are still unknown,
+ * use values from the chassis
+ */
+static void dmi_enclosure(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  hwNode & node = ctx.node;
+
+  if (node.getVendor() == "")
+    node.setVendor(dmi_string(dm, data[0x04]));
+  if (node.getProduct() == "")
+    node.setProduct(dmi_string(dm, data[0x05]));
+  if (node.getVersion() == "")
+    node.setVersion(dmi_string(dm, data[0x06]));
+  if (node.getSerial() == "")
+    node.setSerial(dmi_string(dm, data[0x07]));
+  dmi_chassis(data[0x05] & 0x7F, node);
+}
 
-      case 4:
-// Processor
-        {
-          hwNode newnode("cpu",
-            hw::processor);
-
-          newnode.claim();
-          newnode.setBusInfo(cpubusinfo(currentcpu++));
-          newnode.setSlot(dmi_string(dm, data[0x04]));
-          newnode.setDescription(_("CPU"));
-          newnode.addHint("icon", string("cpu"));
-          if (dm->length >= 0x2A)
-            newnode.setProduct(dmi_processor_family(
-                (((uint16_t) data[0x29]) << 8) + data[0x28]));
-          else
-            newnode.setProduct(dmi_processor_family(data[0x06]));
-          newnode.setVersion(dmi_string(dm, data[0x10]));
-          newnode.setVendor(dmi_string(dm, data[0x07]));
-          newnode.setPhysId(dm->handle);
-          if (dm->length > 0x1A)
-          {
+
+/*
+ * Processor Information (type 4)
+ */
+static void dmi_processor(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  u32 u;
+  hwNode newnode("cpu",
+    hw::processor);
+
+  newnode.claim();
+  newnode.setBusInfo(cpubusinfo(currentcpu++));
+  newnode.setSlot(dmi_string(dm, data[0x04]));
+  newnode.setDescription(_("CPU"));
+  newnode.addHint("icon", string("cpu"));
+  if (dm->length >= 0x2A)
+    newnode.setProduct(dmi_processor_family(
+        (((uint16_t) data[0x29]) << 8) + data[0x28]));
+  else
+    newnode.setProduct(dmi_processor_family(data[0x06]));
+  newnode.setVersion(dmi_string(dm, data[0x10]));
+  newnode.setVendor(dmi_string(dm, data[0x07]));
+  newnode.setPhysId(dm->handle);
+  if (dm->length >= 0x20)
+  {
 // L1 cache
-            newnode.attractHandle(dmi_handle(data[0x1B] << 8 | data[0x1A]));
+    dmi_contained(ctx, dm, data[0x1B] << 8 | data[0x1A], newnode);
 // L2 cache
-            newnode.attractHandle(dmi_handle(data[0x1D] << 8 | data[0x1C]));
+    dmi_contained(ctx, dm, data[0x1D] << 8 | data[0x1C], newnode);
 // L3 cache
-            newnode.attractHandle(dmi_handle(data[0x1F] << 8 | data[0x1E]));
-          }
-          if (dm->length > 0x20)
-          {
-            newnode.setSerial(dmi_string(dm, data[0x20]));
-            if (dmi_string(dm, data[0x22]) != "")
-              newnode.setProduct(newnode.getProduct() + " (" +
-                string(dmi_string(dm, data[0x22])) + ")");
-          }
+    dmi_contained(ctx, dm, data[0x1F] << 8 | data[0x1E], newnode);
+  }
+  if (dm->length > 0x20)
+  {
+    newnode.setSerial(dmi_string(dm, data[0x20]));
+    if (dmi_string(dm, data[0x22]) != "")
+      newnode.setProduct(newnode.getProduct() + " (" +
+        string(dmi_string(dm, data[0x22])) + ")");
+  }
 
 // CPU socket populated ?
-          if (data[0x18] & 0x40)
-          {
-	// external clock
-          	u = data[0x13] << 8 | data[0x12];
-          	newnode.setClock(u * 1000000);
-	// maximum speed
-          	u = data[0x15] << 8 | data[0x14];
-          	newnode.setCapacity(u * 1000000);
-	// current speed
-          	u = data[0x17] << 8 | data[0x16];
-          	newnode.setSize(u * 1000000);
-
-          	if (newnode.getCapacity() < newnode.getSize())
-            	newnode.setCapacity(0);
-
-	// CPU enabled/disabled by BIOS?
-          	u = data[0x18] & 0x07;
-          	if ((u == 2) || (u == 3) || (u == 4))
-            	newnode.disable();
-          }
-          else
-          {
-            newnode.setBusInfo("");	// blank businfo to make sure further detections can't confuse this empty CPU slot with a real CPU
-            newnode.setDescription(newnode.getDescription() + " " + _("[empty]"));
-            newnode.disable();
-          }
-
-          if (dm->length >= 0x28)
-          {
-            if (data[0x23] != 0)
-            {
-              if (data[0x23] == 0xFF)
-                newnode.setConfig("cores", data[0x2B] << 8 | data[0x2A]);
-              else
-                newnode.setConfig("cores", data[0x23]);
-            }
-            if (data[0x24] != 0)
-            {
-              if (data[0x24] == 0xFF)
-                newnode.setConfig("enabledcores", data[0x2D] << 8 | data[0x2C]);
-              else
-                newnode.setConfig("enabledcores", data[0x24]);
-            }
-            if (data[0x25] != 0)
-            {
-              if (data[0x25] == 0xFF)
-                newnode.setConfig("threads", data[0x2F] << 8 | data[0x2E]);
-              else
-                newnode.setConfig("threads", data[0x25]);
-            }
-            if (data[0x26] & 0x4)
-              newnode.addCapability("lm", _("64-bit capable"));
-          }
-
-          newnode.setHandle(handle);
-
-          hardwarenode->addChild(newnode);
-        }
-        break;
+  if (data[0x18] & 0x40)
+  {
+// external clock
+    u = data[0x13] << 8 | data[0x12];
+    newnode.setClock(u * 1000000);
+// maximum speed
+    u = data[0x15] << 8 | data[0x14];
+    newnode.setCapacity(u * 1000000);
+// current speed
+    u = data[0x17] << 8 | data[0x16];
+    newnode.setSize(u * 1000000);
+
+    if (newnode.getCapacity() < newnode.getSize())
+      newnode.setCapacity(0);
+
+// CPU enabled/disabled by BIOS?
+    u = data[0x18] & 0x07;
+    if ((u == 2) || (u == 3) || (u == 4))
+      newnode.disable();
+  }
+  else
+  {
+    newnode.setBusInfo("");	// blank businfo to make sure further detections can't confuse this empty CPU slot with a real CPU
+    newnode.setDescription(newnode.getDescription() + " " + _("[empty]"));
+    newnode.disable();
+  }
 
-      case 5:
-// Memory Controller (obsolete in DMI 2.1+)
-// therefore ignore the entry if the DMI version is recent enough
-        if ((dmiversionmaj < 2)
-          || ((dmiversionmaj == 2) && (dmiversionmin < 1)))
-        {
-          unsigned long long size = 0;
-          hwNode newnode("memory",
-            hw::memory);
-
-          newnode.setHandle(handle);
-          newnode.setPhysId(dm->handle);
-
-          size = data[0x0E] * (1 << data[0x08]) * 1024 * 1024;
-          newnode.setCapacity(size);
-
-// loop through the controller's slots and link them to us
-          for (i = 0; i < data[0x0E]; i++)
-          {
-            u16 slothandle = data[0x0F + 2 * i + 1] << 8 | data[0x0F + 2 * i];
-            newnode.attractHandle(dmi_handle(slothandle));
-          }
-
-          newnode.setProduct(dmi_decode_ram(data[0x0C] << 8 | data[0x0B]) +
-            _(" Memory Controller"));
-
-          hardwarenode->addChild(newnode);
-        }
-        break;
+  if (dm->length >= 0x28)
+  {
+    if (data[0x23] != 0)
+    {
+      if (data[0x23] == 0xFF)
+        newnode.setConfig("cores", data[0x2B] << 8 | data[0x2A]);
+      else
+        newnode.setConfig("cores", data[0x23]);
+    }
+    if (data[0x24] != 0)
+    {
+      if (data[0x24] == 0xFF)
+        newnode.setConfig("enabledcores", data[0x2D] << 8 | data[0x2C]);
+      else
+        newnode.setConfig("enabledcores", data[0x24]);
+    }
+    if (data[0x25] != 0)
+    {
+      if (data[0x25] == 0xFF)
+        newnode.setConfig("threads", data[0x2F] << 8 | data[0x2E]);
+      else
+        newnode.setConfig("threads", data[0x25]);
+    }
+    if (data[0x26] & 0x4)
+      newnode.addCapability("lm", _("64-bit capable"));
+  }
 
-      case 6:
-// Memory Bank (obsolete in DMI 2.1+)
-// therefore ignore the entry if the DMI version is recent enough
-        if ((dmiversionmaj < 2)
-          || ((dmiversionmaj == 2) && (dmiversionmin < 1)))
-        {
-          hwNode newnode("bank",
-            hw::memory);
-          unsigned long long clock = 0;
-          unsigned long long capacity = 0;
-          unsigned long long size = 0;
-
-          newnode.setDescription(_("empty memory bank"));
-          newnode.setSlot(dmi_string(dm, data[0x04]).c_str());
-          if (data[6])
-            clock = 1000000000 / data[0x06];         // convert value from ns to Hz
-          newnode.setClock(clock);
-          newnode.setDescription(dmi_decode_ram(data[0x08] << 8 | data[0x07]));
-          newnode.addHint("icon", string("memory"));
+  newnode.setHandle(dmi_handle(dm->handle));
+
+  dmi_parent(ctx, container).addChild(newnode);
+}
+
+
+/*
+ * Memory Controller Information (type 5)
+ *
+ * obsolete in DMI 2.1+, therefore ignored if the DMI version is recent
+ * enough
+ */
+static void dmi_memory_controller(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  unsigned long long size = 0;
+
+  if ((ctx.dmiversionmaj > 2)
+    || ((ctx.dmiversionmaj == 2) && (ctx.dmiversionmin >= 1)))
+    return;
+
+  hwNode newnode("memory",
+    hw::memory);
+
+  newnode.setHandle(dmi_handle(dm->handle));
+  newnode.setPhysId(dm->handle);
+
+  size = data[0x0E] * (1 << data[0x08]) * 1024 * 1024;
+  newnode.setCapacity(size);
+
+// loop through the controller's slots and decode them here
+  for (int i = 0; (i < data[0x0E]) && (0x0F + 2 * i + 1 < dm->length); i++)
+    dmi_contained(ctx, dm, data[0x0F + 2 * i + 1] << 8 | data[0x0F + 2 * i], newnode);
+
+  newnode.setProduct(dmi_decode_ram(data[0x0C] << 8 | data[0x0B]) +
+    _(" Memory Controller"));
+
+  dmi_parent(ctx, container).addChild(newnode);
+}
+
+
+/*
+ * Memory Module Information (type 6)
+ *
+ * obsolete in DMI 2.1+, therefore ignored if the DMI version is recent
+ * enough
+ */
+static void dmi_memory_module(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+
+  if ((ctx.dmiversionmaj > 2)
+    || ((ctx.dmiversionmaj == 2) && (ctx.dmiversionmin >= 1)))
+    return;
+
+  hwNode newnode("bank",
+    hw::memory);
+  unsigned long long clock = 0;
+  unsigned long long capacity = 0;
+  unsigned long long size = 0;
+
+  newnode.setDescription(_("empty memory bank"));
+  newnode.setSlot(dmi_string(dm, data[0x04]).c_str());
+  if (data[6])
+    clock = 1000000000 / data[0x06];              // convert value from ns to Hz
+  newnode.setClock(clock);
+  newnode.setDescription(dmi_decode_ram(data[0x08] << 8 | data[0x07]));
+  newnode.addHint("icon", string("memory"));
 // installed size
-          switch (data[0x09] & 0x7F)
-          {
-            case 0x7D:
-            case 0x7E:
-            case 0x7F:
-              break;
-            default:
-              size = (1 << (data[0x09] & 0x7F)) << 20;
-          }
-          if (data[0x09] & 0x80)
-            size *= 2;
+  switch (data[0x09] & 0x7F)
+  {
+    case 0x7D:
+    case 0x7E:
+    case 0x7F:
+      break;
+    default:
+      size = (1 << (data[0x09] & 0x7F)) << 20;
+  }
+  if (data[0x09] & 0x80)
+    size *= 2;
 // enabled size
-          switch (data[0x0A] & 0x7F)
-          {
-            case 0x7D:
-            case 0x7E:
-            case 0x7F:
-              break;
-            default:
-              capacity = (1 << (data[0x0A] & 0x7F)) << 20;
-          }
-          if (data[0x0A] & 0x80)
-            capacity *= 2;
-
-          newnode.setCapacity(capacity);
-          newnode.setSize(size);
-          if(newnode.getSize()==0)
-            newnode.setDescription(newnode.getDescription() + " " + _("[empty]"));
-          if ((data[0x0B] & 4) == 0)
-          {
-            if (data[0x0B] & (1 << 0))
+  switch (data[0x0A] & 0x7F)
+  {
+    case 0x7D:
+    case 0x7E:
+    case 0x7F:
+      break;
+    default:
+      capacity = (1 << (data[0x0A] & 0x7F)) << 20;
+  }
+  if (data[0x0A] & 0x80)
+    capacity *= 2;
+
+  newnode.setCapacity(capacity);
+  newnode.setSize(size);
+  if(newnode.getSize()==0)
+    newnode.setDescription(newnode.getDescription() + " " + _("[empty]"));
+  if ((data[0x0B] & 4) == 0)
+  {
+    if (data[0x0B] & (1 << 0))
 // bank has uncorrectable errors (BIOS disabled)
-              newnode.disable();
-          }
+      newnode.disable();
+  }
 
-          newnode.setHandle(handle);
+  newnode.setHandle(dmi_handle(dm->handle));
 
-          hardwarenode->addChild(newnode);
-        }
-        break;
-      case 7:
-// Cache
-        {
-          hwNode newnode("cache",
-            hw::memory);
-	  int level;
-
-          newnode.setSlot(dmi_string(dm, data[0x04]));
-          u = data[0x06] << 8 | data[0x05];
-          level = 1 + (u & 7);
-
-          if (dm->length > 0x11)
-            dmi_cache_describe(newnode, u, data[0x0E] << 8 | data[0x0D],
-              data[0x11]);
-          else
-            dmi_cache_describe(newnode, u, data[0x0E] << 8 | data[0x0D]);
-
-          if (!(u & (1 << 7)))
-            newnode.disable();
-
-          newnode.setConfig("level", level);
-          if ((data[0x08] << 8 | data[0x07]) == 0xFFFF)
-            newnode.setCapacity(dmi_cache_size_long(data[0x16] << 24 | data[0x15] << 16 | data[0x14] << 8 | data[0x13]));
-          else
-            newnode.setCapacity(dmi_cache_size(data[0x08] << 8 | data[0x07]));
-
-          if ((data[0x0A] << 8 | data[0x09]) == 0xFFFF)
-            newnode.setSize(dmi_cache_size_long(data[0x1A] << 24 | data[0x19] << 16 | data[0x18] << 8 | data[0x17]));
-          else
-            newnode.setSize(dmi_cache_size(data[0x0A] << 8 | data[0x09]));
-
-          if ((dm->length > 0x0F) && (data[0x0F] != 0))
-          {
-            // convert from ns to Hz
-            newnode.setClock(1000000000 / data[0x0F]);
-          }
-
-          newnode.setHandle(handle);
-          newnode.setPhysId(dm->handle);
-          newnode.claim();
-          if(newnode.getSize()!=0)
-            hardwarenode->addChild(newnode);
-        }
-        break;
-      case 8:
-//printf("\tPort Connector\n");
-//printf("\t\tInternal Designator: %s\n",
-//dmi_string(dm, data[4]).c_str());
-//printf("\t\tInternal Connector Type: %s\n",
-//dmi_port_connector_type(data[5]));
-//printf("\t\tExternal Designator: %s\n",
-//dmi_string(dm, data[6]).c_str());
-//printf("\t\tExternal Connector Type: %s\n",
-//dmi_port_connector_type(data[7]));
-//printf("\t\tPort Type: %s\n", dmi_port_type(data[8]));
-        break;
-      case 9:
-#if 0
-        {
-          hwNode newnode("cardslot",
-            hw::bus);
-          newnode.setHandle(handle);
-          newnode.setSlot(dmi_string(dm, data[0x04]));
-          printf("\t\tType: %s%s%s\n",
-            dmi_bus_width(data[0x06]),
-            dmi_card_size(data[0x08]), dmi_bus_name(data[0x05]));
-          if (data[0x07] == 3)
-            printf("\t\tStatus: Available.\n");
-          if (data[0x07] == 4)
-            printf("\t\tStatus: In use.\n");
-          if (data[0x0B] & 0xFE)
-            dmi_card_props(data[0x0B]);
-//hardwarenode->addChild(newnode);
-        }
-#endif
-        break;
-      case 10:
-#if 0
-        printf("\tOn Board Devices Information\n");
-        for (u = 2; u * 2 + 1 < dm->length; u++)
-        {
-          printf("\t\tDescription: %s : %s\n",
-            dmi_string(dm, data[1 + 2 * u]).c_str(),
-            (data[2 * u]) & 0x80 ? "Enabled" : "Disabled");
-          printf("\t\tType: %s\n", dmi_onboard_type(data[2 * u]));
-        }
-#endif
+  dmi_parent(ctx, container).addChild(newnode);
+}
 
-        break;
-      case 11:
-// OEM Data
-        break;
-      case 12:
-// Configuration Information
-        break;
-      case 13:
-#if 0
-        printf("\tBIOS Language Information\n");
-        printf("\t\tInstallable Languages: %u\n", data[0x04]);
-        for (u = 1; u <= data[0x04]; u++)
-        {
-          printf("\t\t\t%s\n", dmi_string(dm, u).c_str());
-        }
-        printf("\t\tCurrently Installed Language: %s\n",
-          dmi_string(dm, data[0x15]).c_str());
-#endif
-        break;
-      case 14:
-// Group Associations
-        break;
-      case 15:
-// Event Log
-        break;
-      case 16:
-// Physical Memory Array
-        {
-          string id = "memory";
-          string description = "";
-          bool claim = false, memory_icon = false;
-          switch (data[0x05])
-          {
-            case 0x03:
-              description = _("System Memory");
-              claim = true;
-              memory_icon = true;
-              break;
-            case 0x04:
-              id = "videomemory";
-              description = _("Video Memory");
-              break;
-            case 0x05:
-              id = "flash";
-              description = _("Flash Memory");
-              break;
-            case 0x06:
-              id = "nvram";
-              description = _("NVRAM");
-              break;
-            case 0x07:
-              id = "cache";
-              description = _("Cache Memory");
-              memory_icon = true;
-              break;
-            default:
-              description = _("Generic Memory");
-              memory_icon = true;
-          }
-          if (id == "memory" && hardwarenode->getChild("memory"))
-          {
-            // we don't want multiple "System memory" nodes,
-            // so just ignore this one
-            break;
-          }
-          hwNode newnode(id, hw::memory);
-          newnode.setHandle(handle);
-          newnode.setPhysId(dm->handle);
-          newnode.setDescription(description);
-          newnode.setSlot(dmi_memory_array_location(data[0x04]));
-          if (memory_icon)
-            newnode.addHint("icon", string("memory"));
-          if (claim)
-            newnode.claim();
-          switch (data[0x06])
-          {
-            case 0x04:
-              newnode.addCapability("parity", _("Parity error correction"));
-              newnode.setConfig("errordetection", "parity");
-              break;
-            case 0x05:
-              newnode.addCapability("ecc", _("Single-bit error-correcting code (ECC)"));
-              newnode.setConfig("errordetection", "ecc");
-              break;
-            case 0x06:
-              newnode.addCapability("ecc", _("Multi-bit error-correcting code (ECC)"));
-              newnode.setConfig("errordetection", "multi-bit-ecc");
-              break;
-            case 0x07:
-              newnode.addCapability("crc", _("CRC error correction"));
-              newnode.setConfig("errordetection", "crc");
-              break;
-          }
-          u2 = data[0x0A] << 24 | data[0x09] << 16 | data[0x08] << 8 | data[0x07];
-          if (u2 != 0x80000000)                   // magic value for "unknown"
-            newnode.setCapacity(u2 * 1024);
-          else if (dm->length >= 0x17)
-          {
-            uint64_t capacity = (((uint64_t) data[0x16]) << 56) +
-                                (((uint64_t) data[0x15]) << 48) +
-                                (((uint64_t) data[0x14]) << 40) +
-                                (((uint64_t) data[0x13]) << 32) +
-                                (((uint64_t) data[0x12]) << 24) +
-                                (((uint64_t) data[0x11]) << 16) +
-                                (((uint64_t) data[0x10]) << 8) +
-                                data[0x0F];
-            newnode.setCapacity(capacity);
-          }
-          hardwarenode->addChild(newnode);
-        }
-        break;
-      case 17:
-// Memory Device
-        {
-          hwNode newnode("bank",
-            hw::memory);
-          string slot = "";
-          string description = "";
-          unsigned long long size = 0;
-          unsigned long long clock = 0;
-          u16 width = 0;
-          char bits[12];
-          string arrayhandle;
-          newnode.setDescription(_("empty memory bank"));
-          newnode.addHint("icon", string("memory"));
-          arrayhandle = dmi_handle(data[0x05] << 8 | data[0x04]);
-          strcpy(bits, "");
-// total width
-          u = data[0x09] << 8 | data[0x08];
-          if (u != 0xFFFF)
-            width = u;
-//data width
-          u = data[0x0B] << 8 | data[0x0A];
-          if ((u != 0xFFFF) && (u != 0))
-          {
-            if ((u == width) || (width == 0))
-            {
-              snprintf(bits, sizeof(bits), "%d", u);
-              newnode.setWidth(width);
-            }
-            else
-            {
-              snprintf(bits, sizeof(bits), "%d/%d", width, u);
-              newnode.setWidth(u<width?u:width);
-            }
-          }
-          else
-          {
-            if (width != 0)
-            {
-              snprintf(bits, sizeof(bits), "%d", width);
-              newnode.setWidth(width);
-            }
-          }
 
-// size
-          u = data[0x0D] << 8 | data[0x0C];
-          if (((dmiversionmaj > 2)
-            || ((dmiversionmaj == 2) && (dmiversionmin >= 7)))
-            && u == 0x7FFF) {
-              unsigned long long extendsize = (data[0x1F] << 24) | (data[0x1E] << 16) | (data[0x1D] << 8) | data[0x1C];
-              extendsize &= 0x7FFFFFFFUL;
-              size = extendsize * 1024ULL * 1024ULL;
-          }
-          else
-          if (u != 0xFFFF)
-            size = (1024ULL * (u & 0x7FFF) * ((u & 0x8000) ? 1 : 1024ULL));
-          description += string(dmi_memory_device_form_factor(data[0x0E]));
-          slot = dmi_string(dm, data[0x10]);
-//printf("\t\tBank Locator: %s\n", dmi_string(dm, data[0x11]));
-          description += string(dmi_memory_device_type(data[0x12]));
-          u = data[0x14] << 8 | data[0x13];
-          if (u & 0x1FFE)
-            description += dmi_memory_device_detail(u);
-          if (dm->length > 0x15)
-          {
-            char buffer[80];
-            u = data[0x16] << 8 | data[0x15];
-// speed
-            clock = u * 1000000;                  // u is a frequency in MHz
-            if (u == 0)
-              strcpy(buffer, "");
-            else
-              snprintf(buffer, sizeof(buffer),
-                "%u MHz (%.1f ns)", u, (1000.0 / u));
-            description += " " + string(buffer);
-          }
-
-          newnode.setHandle(handle);
-//newnode.setPhysId(dm->handle);
-          newnode.setSlot(slot);
-          if (dm->length > 0x17)
-            newnode.setVendor(dmi_string(dm, data[0x17]));
-          if (dm->length > 0x18)
-            newnode.setSerial(dmi_string(dm, data[0x18]));
-          if (dm->length > 0x1A)
-            newnode.setProduct(dmi_string(dm, data[0x1A]));
-          newnode.setDescription(description);
-          newnode.setSize(size);
-          if(newnode.getSize()==0)
-            newnode.setDescription(newnode.getDescription() + " " + _("[empty]"));
-          newnode.setClock(clock);
-          hwNode *memoryarray = hardwarenode->findChildByHandle(arrayhandle);
-          if (!memoryarray)
-            memoryarray = hardwarenode->getChild("memory");
-          if (!memoryarray)
-          {
-            hwNode ramnode("memory",
-              hw::memory);
-            ramnode.addHint("icon", string("memory"));
-            hardwarenode->addChild(ramnode);
-            memoryarray = hardwarenode->getChild("memory");
-          }
-          memoryarray->addChild(newnode);
-        }
-        break;
-      case 18:
-// 32-bit Memory Error Information
-        break;
-      case 19:
-// Memory Array Mapped Address
-        {
-          hwNode newnode("range",
-            hw::address);
-          uint64_t start = 0, end = 0;
-          string arrayhandle = dmi_handle(data[0x0D] << 8 | data[0x0C]);
-          start = data[0x07] << 24 | data[0x06] << 16 | data[0x05] << 8 | data[0x04];
-          if (start == 0xFFFFFFFF)
-            start = uint64_t(data[0x16]) << 56 | uint64_t(data[0x15]) << 48 |
-                    uint64_t(data[0x14]) << 40 | uint64_t(data[0x13]) << 32 |
-                    uint64_t(data[0x12]) << 24 | uint64_t(data[0x11]) << 16 |
-                    uint64_t(data[0x10]) << 8 | uint64_t(data[0x0F]);
-          end = data[0x0B] << 24 | data[0x0A] << 16 | data[0x09] << 8 | data[0x08];
-          if (end == 0xFFFFFFFF)
-            end = uint64_t(data[0x1E]) << 56 | uint64_t(data[0x1D]) << 48 |
-                    uint64_t(data[0x1C]) << 40 | uint64_t(data[0x1B]) << 32 |
-                    uint64_t(data[0x1A]) << 24 | uint64_t(data[0x19]) << 16 |
-                    uint64_t(data[0x18]) << 8 | uint64_t(data[0x17]);
-          if (end - start < 512)                  // memory range is smaller than 512KB
-          {
-// consider that values were expressed in megabytes
-            start *= 1024;
-            end *= 1024;
-          }
-
-          newnode.setStart(start * 1024);         // values are in KB
-          if (end != start)
-                                                  // values are in KB
-              newnode.setSize((end - start + 1) * 1024);
-          newnode.setHandle(handle);
-#if 0
-          hwNode *memoryarray = hardwarenode->findChildByHandle(arrayhandle);
-          if (memoryarray)
-            memoryarray->setPhysId(newnode.getStart());
-#endif
-        }
-        break;
-      case 20:
-// Memory Device Mapped Address
-        {
-          hwNode newnode("range",
-            hw::address);
-          unsigned long long start = 0, end = 0;
-          string devicehandle = dmi_handle(data[0x0D] << 8 | data[0x0C]);
-          start = data[0x07] << 24 | data[0x06] << 16 | data[0x05] << 8 | data[0x04];
-          if (start == 0xFFFFFFFF)
-            start = uint64_t(data[0x16]) << 56 | uint64_t(data[0x15]) << 48 |
-                    uint64_t(data[0x14]) << 40 | uint64_t(data[0x13]) << 32 |
-                    uint64_t(data[0x12]) << 24 | uint64_t(data[0x11]) << 16 |
-                    uint64_t(data[0x10]) << 8 | uint64_t(data[0x0F]);
-          end = data[0x0B] << 24 | data[0x0A] << 16 | data[0x09] << 8 | data[0x08];
-          if (end == 0xFFFFFFFF)
-            end = uint64_t(data[0x1E]) << 56 | uint64_t(data[0x1D]) << 48 |
-                    uint64_t(data[0x1C]) << 40 | uint64_t(data[0x1B]) << 32 |
-                    uint64_t(data[0x1A]) << 24 | uint64_t(data[0x19]) << 16 |
-                    uint64_t(data[0x18]) << 8 | uint64_t(data[0x17]);
-          if (end - start < 512)                  // memory range is smaller than 512KB
-          {
-// consider that values were expressed in megabytes
-            start *= 1024;
-            end *= 1024;
-          }
-
-          newnode.setStart(start * 1024);         // values are in KB
-          if (end != start)
-                                                  // values are in KB
-              newnode.setSize((end - start + 1) * 1024);
-          newnode.setHandle(handle);
-#if 0
-          hwNode *memorydevice = hardwarenode->findChildByHandle(devicehandle);
-          if (memorydevice && (newnode.getSize() != 0)
-            && (newnode.getSize() <= memorydevice->getSize()))
-            memorydevice->setPhysId(newnode.getStart());
-#endif
-        }
-        break;
-      case 21:
-// Built-In Pointing Device
-        break;
-      case 22:
-// Portable Battery
-        if (dm->length < 0x10)
-          break;
-        else
-        {
-          hwNode batt("battery", hw::power);
-
-          batt.addHint("icon", string("battery"));
-          batt.claim();
-          batt.setHandle(handle);
-          batt.setVendor(dmi_string(dm, data[0x05]));
+/*
+ * Cache Information (type 7)
+ */
+static void dmi_cache(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  hwNode newnode("cache",
+    hw::memory);
+  int level;
+  u32 u;
+
+  newnode.setSlot(dmi_string(dm, data[0x04]));
+  u = data[0x06] << 8 | data[0x05];
+  level = 1 + (u & 7);
+
+  if (dm->length > 0x11)
+    dmi_cache_describe(newnode, u, data[0x0E] << 8 | data[0x0D],
+      data[0x11]);
+  else
+    dmi_cache_describe(newnode, u, data[0x0E] << 8 | data[0x0D]);
+
+  if (!(u & (1 << 7)))
+    newnode.disable();
+
+  newnode.setConfig("level", level);
+  if ((data[0x08] << 8 | data[0x07]) == 0xFFFF)
+    newnode.setCapacity(dmi_cache_size_long(data[0x16] << 24 | data[0x15] << 16 | data[0x14] << 8 | data[0x13]));
+  else
+    newnode.setCapacity(dmi_cache_size(data[0x08] << 8 | data[0x07]));
+
+  if ((data[0x0A] << 8 | data[0x09]) == 0xFFFF)
+    newnode.setSize(dmi_cache_size_long(data[0x1A] << 24 | data[0x19] << 16 | data[0x18] << 8 | data[0x17]));
+  else
+    newnode.setSize(dmi_cache_size(data[0x0A] << 8 | data[0x09]));
+
+  if ((dm->length > 0x0F) && (data[0x0F] != 0))
+  {
+    // convert from ns to Hz
+    newnode.setClock(1000000000 / data[0x0F]);
+  }
+
+  newnode.setHandle(dmi_handle(dm->handle));
+  newnode.setPhysId(dm->handle);
+  newnode.claim();
+  if(newnode.getSize()!=0)
+    dmi_parent(ctx, container).addChild(newnode);
+}
+
+
+/*
+ * Physical Memory Array (type 16), decoded with its memory devices
+ */
+static void dmi_memory_array(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  hwNode & hardwarenode = dmi_core(ctx);
+  string id = "memory";
+  string description = "";
+  bool claim = false, memory_icon = false;
+  u32 u2;
+
+  switch (data[0x05])
+  {
+    case 0x03:
+      description = _("System Memory");
+      claim = true;
+      memory_icon = true;
+      break;
+    case 0x04:
+      id = "videomemory";
+      description = _("Video Memory");
+      break;
+    case 0x05:
+      id = "flash";
+      description = _("Flash Memory");
+      break;
+    case 0x06:
+      id = "nvram";
+      description = _("NVRAM");
+      break;
+    case 0x07:
+      id = "cache";
+      description = _("Cache Memory");
+      memory_icon = true;
+      break;
+    default:
+      description = _("Generic Memory");
+      memory_icon = true;
+  }
+  if (id == "memory" && hardwarenode.getChild("memory"))
+  {
+    // we don't want multiple "System memory" nodes,
+    // so just ignore this one (its banks were merged with
+    // the first one's)
+    dmi_memory_devices(ctx.index.devices[dm->handle],
+      *hardwarenode.getChild("memory"), ctx.dmiversionmaj, ctx.dmiversionmin);
+    return;
+  }
+  hwNode newnode(id, hw::memory);
+  newnode.setHandle(dmi_handle(dm->handle));
+  newnode.setPhysId(dm->handle);
+  newnode.setDescription(description);
+  newnode.setSlot(dmi_memory_array_location(data[0x04]));
+  if (memory_icon)
+    newnode.addHint("icon", string("memory"));
+  if (claim)
+    newnode.claim();
+  switch (data[0x06])
+  {
+    case 0x04:
+      newnode.addCapability("parity", _("Parity error correction"));
+      newnode.setConfig("errordetection", "parity");
+      break;
+    case 0x05:
+      newnode.addCapability("ecc", _("Single-bit error-correcting code (ECC)"));
+      newnode.setConfig("errordetection", "ecc");
+      break;
+    case 0x06:
+      newnode.addCapability("ecc", _("Multi-bit error-correcting code (ECC)"));
+      newnode.setConfig("errordetection", "multi-bit-ecc");
+      break;
+    case 0x07:
+      newnode.addCapability("crc", _("CRC error correction"));
+      newnode.setConfig("errordetection", "crc");
+      break;
+  }
+  u2 = data[0x0A] << 24 | data[0x09] << 16 | data[0x08] << 8 | data[0x07];
+  if (u2 != 0x80000000)                           // magic value for "unknown"
+    newnode.setCapacity(u2 * 1024);
+  else if (dm->length >= 0x17)
+  {
+    uint64_t capacity = (((uint64_t) data[0x16]) << 56) +
+                        (((uint64_t) data[0x15]) << 48) +
+                        (((uint64_t) data[0x14]) << 40) +
+                        (((uint64_t) data[0x13]) << 32) +
+                        (((uint64_t) data[0x12]) << 24) +
+                        (((uint64_t) data[0x11]) << 16) +
+                        (((uint64_t) data[0x10]) << 8) +
+                        data[0x0F];
+    newnode.setCapacity(capacity);
+  }
+  dmi_memory_devices(ctx.index.devices[dm->handle], newnode,
+    ctx.dmiversionmaj, ctx.dmiversionmin);
+  dmi_parent(ctx, container).addChild(newnode);
+}
+
+
+/*
+ * Memory Device (type 17) that doesn't belong to a memory array
+ */
+static void dmi_orphan_memory_device(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  u16 arrayhandle = data[0x05] << 8 | data[0x04];
+  map < u16, struct dmi_header * >::const_iterator array = ctx.index.handles.find(arrayhandle);
+  if ((array != ctx.index.handles.end()) && (array->second->type == 16))
+    return;                                       // decoded with its memory array
+
+  hwNode & hardwarenode = dmi_core(ctx);
+  hwNode *memoryarray = hardwarenode.getChild("memory");
+  if (!memoryarray)
+  {
+    hwNode ramnode("memory",
+      hw::memory);
+    ramnode.addHint("icon", string("memory"));
+    hardwarenode.addChild(ramnode);
+    memoryarray = hardwarenode.getChild("memory");
+  }
+  memoryarray->addChild(dmi_memory_device(dm, "bank",
+    ctx.dmiversionmaj, ctx.dmiversionmin));
+}
+
+
+/*
+ * Portable Battery (type 22)
+ */
+static void dmi_battery(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+
+  if (dm->length < 0x10)
+    return;
+
+  hwNode batt("battery", hw::power);
+
+  batt.addHint("icon", string("battery"));
+  batt.claim();
+  batt.setHandle(dmi_handle(dm->handle));
+  batt.setVendor(dmi_string(dm, data[0x05]));
                                                   // name
-          batt.setProduct(dmi_string(dm, data[0x08]));
+  batt.setProduct(dmi_string(dm, data[0x08]));
                                                   // location
-          batt.setSlot(dmi_string(dm, data[0x04]));
-          if(data[0x06] || dm->length<0x1A)       // manufacture date
-            batt.setVersion(dmi_string(dm, data[0x06]));
-          if(data[0x07] || dm->length<0x1A)
-            batt.setSerial(dmi_string(dm, data[0x07]));
-          batt.setConfig("voltage", dmi_battery_voltage(data[0x0C] + 256*data[0x0D]));
-          if(dm->length<0x1A)
-            batt.setCapacity(dmi_battery_capacity(data[0x0A] + 256*data[0x0B], 1));
-          else
-            batt.setCapacity(dmi_battery_capacity(data[0x0A] + 256*data[0x0B], data[0x15]));
-          if(data[0x09]!=0x02 || dm->length<0x1A)
-            batt.setDescription(dmi_battery_chemistry(data[0x09]));
-
-          node.addChild(batt);
-        }
-        break;
-      case 23:
-// System Reset
-        break;
-      case 24:
-// Hardware Security
-        if (dm->length < 0x05)
-          break;
-        node.setConfig("power-on_password",
-          dmi_hardware_security_status(data[0x04]>>6));
-        node.setConfig("keyboard_password",
-          dmi_hardware_security_status((data[0x04]>>4)&0x3));
-        node.setConfig("administrator_password",
-          dmi_hardware_security_status((data[0x04]>>2)&0x3));
-        node.setConfig("frontpanel_password",
-          dmi_hardware_security_status(data[0x04]&0x3));
-        break;
-      case 25:
-// System Power Controls
-        break;
-      case 26:
-// Voltage Sensor
-        break;
-      case 27:
-// Cooling Device
-        break;
-      case 28:
-// Temperature Sensor
-        break;
-      case 29:
-// Current Sensor
-        break;
-      case 30:
-// Out-of-Band Remote Access
-        if (dm->length < 0x06)
-          break;
-        else
-        {
-          hwNode oob("remoteaccess", hw::system);
-
-          oob.setVendor(dmi_string(dm, data[0x04]));
-          if(data[0x05] & 0x2) oob.addCapability("outbound", _("make outbound connections"));
-          if(data[0x05] & 0x1) oob.addCapability("inbound", _("receive inbound connections"));
-          node.addChild(oob);
-        }
-        break;
-      case 31:
-// Boot Integrity Services Entry Point
-        break;
-      case 32:
-// System Boot Information
-        if (dm->length < 0x0B)
-          break;
-        node.setConfig("boot", dmi_bootinfo(data[0x0A]));
-        break;
-      case 33:
-// 64-bit Memory Error Information
-        break;
-      case 34:
-// Management Device
-        break;
-      case 35:
-// Management Device Component
-        break;
-      case 36:
-// Management Device Threshold Data
-        break;
-      case 37:
-// Memory Channel
-        break;
-      case 38:
-// IPMI Device
-        break;
-      case 39:
-// Power Supply
-        if (dm->length < 0x15)
-          break;
-        else
-        {
-          hwNode power("power", hw::power);
-
-          power.setDescription(dmi_string(dm, data[0x06]));
-          power.setVendor(dmi_string(dm, data[0x07]));
-          power.setSerial(dmi_string(dm, data[0x08]));
-          power.setProduct(dmi_string(dm, data[0x0A]));
-          power.setVersion(dmi_string(dm, data[0x0B]));
-          power.setCapacity(data[0x0C] + 256*data[0x0D]);
-          node.addChild(power);
-        }
-        break;
-      case 126:
-// Inactive
-        break;
-      case 127:
-// End-of-Table
-        break;
-      default:
-        break;
-    }
-    data += dm->length;
-    while (*data || data[1])
-      data++;
-    data += 2;
-    i++;
+  batt.setSlot(dmi_string(dm, data[0x04]));
+  if(data[0x06] || dm->length<0x1A)               // manufacture date
+    batt.setVersion(dmi_string(dm, data[0x06]));
+  if(data[0x07] || dm->length<0x1A)
+    batt.setSerial(dmi_string(dm, data[0x07]));
+  batt.setConfig("voltage", dmi_battery_voltage(data[0x0C] + 256*data[0x0D]));
+  if(dm->length<0x1A)
+    batt.setCapacity(dmi_battery_capacity(data[0x0A] + 256*data[0x0B], 1));
+  else
+    batt.setCapacity(dmi_battery_capacity(data[0x0A] + 256*data[0x0B], data[0x15]));
+  if(data[0x09]!=0x02 || dm->length<0x1A)
+    batt.setDescription(dmi_battery_chemistry(data[0x09]));
+
+  (container ? *container : ctx.node).addChild(batt);
+}
+
+
+/*
+ * Hardware Security (type 24)
+ */
+static void dmi_security(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+  hwNode & node = ctx.node;
+
+  if (dm->length < 0x05)
+    return;
+  node.setConfig("power-on_password",
+    dmi_hardware_security_status(data[0x04]>>6));
+  node.setConfig("keyboard_password",
+    dmi_hardware_security_status((data[0x04]>>4)&0x3));
+  node.setConfig("administrator_password",
+    dmi_hardware_security_status((data[0x04]>>2)&0x3));
+  node.setConfig("frontpanel_password",
+    dmi_hardware_security_status(data[0x04]&0x3));
+}
+
+
+/*
+ * Out-of-Band Remote Access (type 30)
+ */
+static void dmi_remote_access(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+
+  if (dm->length < 0x06)
+    return;
+
+  hwNode oob("remoteaccess", hw::system);
+
+  oob.setVendor(dmi_string(dm, data[0x04]));
+  if(data[0x05] & 0x2) oob.addCapability("outbound", _("make outbound connections"));
+  if(data[0x05] & 0x1) oob.addCapability("inbound", _("receive inbound connections"));
+  (container ? *container : ctx.node).addChild(oob);
+}
+
+
+/*
+ * System Boot Information (type 32)
+ */
+static void dmi_boot(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+
+  if (dm->length < 0x0B)
+    return;
+  ctx.node.setConfig("boot", dmi_bootinfo(data[0x0A]));
+}
+
+
+/*
+ * System Power Supply (type 39)
+ */
+static void dmi_power_supply(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  const u8 *data = (u8 *) dm;
+
+  if (dm->length < 0x15)
+    return;
+
+  hwNode power("power", hw::power);
+
+  power.setDescription(dmi_string(dm, data[0x06]));
+  power.setVendor(dmi_string(dm, data[0x07]));
+  power.setSerial(dmi_string(dm, data[0x08]));
+  power.setProduct(dmi_string(dm, data[0x0A]));
+  power.setVersion(dmi_string(dm, data[0x0B]));
+  power.setCapacity(data[0x0C] + 256*data[0x0D]);
+  (container ? *container : ctx.node).addChild(power);
+}
+
+
+/*
+ * decoders, by structure type (NULL for the ones we ignore)
+ */
+static const dmi_decoder dmi_decoders[] =
+{
+  dmi_bios,                                       // 0
+  dmi_system,                                     // 1
+  dmi_board,                                      // 2
+  dmi_enclosure,                                  // 3
+  dmi_processor,                                  // 4
+  dmi_memory_controller,                          // 5
+  dmi_memory_module,                              // 6
+  dmi_cache,                                      // 7
+  NULL,                                           // 8: Port Connector
+  NULL,                                           // 9: System Slots
+  NULL,                                           // 10: On Board Devices
+  NULL,                                           // 11: OEM Strings
+  NULL,                                           // 12: System Configuration Options
+  NULL,                                           // 13: BIOS Language
+  NULL,                                           // 14: Group Associations
+  NULL,                                           // 15: System Event Log
+  dmi_memory_array,                               // 16
+  dmi_orphan_memory_device,                       // 17
+  NULL,                                           // 18: 32-bit Memory Error
+  NULL,                                           // 19: Memory Array Mapped Address
+  NULL,                                           // 20: Memory Device Mapped Address
+  NULL,                                           // 21: Built-in Pointing Device
+  dmi_battery,                                    // 22
+  NULL,                                           // 23: System Reset
+  dmi_security,                                   // 24
+  NULL,                                           // 25: System Power Controls
+  NULL,                                           // 26: Voltage Probe
+  NULL,                                           // 27: Cooling Device
+  NULL,                                           // 28: Temperature Probe
+  NULL,                                           // 29: Electrical Current Probe
+  dmi_remote_access,                              // 30
+  NULL,                                           // 31: Boot Integrity Services
+  dmi_boot,                                       // 32
+  NULL,                                           // 33: 64-bit Memory Error
+  NULL,                                           // 34: Management Device
+  NULL,                                           // 35: Management Device Component
+  NULL,                                           // 36: Management Device Threshold Data
+  NULL,                                           // 37: Memory Channel
+  NULL,                                           // 38: IPMI Device
+  dmi_power_supply,                               // 39
+};
+
+static void dmi_decode(dmi_context & ctx, struct dmi_header *dm, hwNode * container)
+{
+  ctx.decoded.insert(dm);
+
+  if ((dm->type < sizeof(dmi_decoders) / sizeof(dmi_decoders[0])) && dmi_decoders[dm->type])
+    dmi_decoders[dm->type](ctx, dm, container);
+}
+
+
+static void dmi_table(const u8 *buf,
+int len,
+hwNode & node,
+int dmiversionmaj,
+int dmiversionmin,
+int dmiversionrev)
+{
+  dmi_context ctx(node, dmiversionmaj, dmiversionmin);
+
+  if (len == 0)
+// no data
+    return;
+
+  dmi_index_table(buf, len, ctx.index);
+  if (!ctx.index.structures.empty())
+    dmi_core(ctx);
+
+// structures contained in another one are decoded with it...
+  for (size_t s = 0; s < ctx.index.structures.size(); s++)
+  {
+    struct dmi_header *dm = ctx.index.structures[s];
+
+    if ((ctx.index.owners.find(dm->handle) == ctx.index.owners.end()) ||
+      (ctx.index.handles[dm->handle] != dm))
+      if (ctx.decoded.find(dm) == ctx.decoded.end())
+        dmi_decode(ctx, dm, NULL);
   }
+// ...unless it didn't decode them (or they contain each other)
+  for (size_t s = 0; s < ctx.index.structures.size(); s++)
+    if (ctx.decoded.find(ctx.index.structures[s]) == ctx.decoded.end())
+      dmi_decode(ctx, ctx.index.structures[s], NULL);
 }
 
 
@@ -1912,6 +2049,48 @@ static bool smbios_entry_point(const u8 *buf, size_t len,
 }
 
 
+/*
+ * SMBIOS tables only change across reboots: the entry point and the table
+ * found last time are kept in a single file, keyed by the boot id, so that
+ * they can be decoded in place instead of being looked for again
+ */
+static bool scan_dmi_cache(hwNode & n, const u8 *ep, size_t ep_len)
+{
+  size_t len = 0;
+  const u8 *blob = (const u8 *) mapcache(DMICACHE, hw::strip(get_string(BOOT_ID)), len);
+  uint32_t table_len = 0;
+  uint64_t table_base = 0;
+  u16 dmimaj = 0, dmimin = 0, dmirev = 0;
+  bool result = false;
+
+  if (!blob)
+    return false;
+
+// when the firmware's entry point is known, it must be the cached one
+  if ((len > DMI_EP_SIZE) &&
+      (!ep || ((ep_len <= DMI_EP_SIZE) && (memcmp(ep, blob, ep_len) == 0))) &&
+      smbios_entry_point(blob, DMI_EP_SIZE, n,
+        dmimaj, dmimin, dmirev, table_len, table_base))
+  {
+    dmi_table(blob + DMI_EP_SIZE, len - DMI_EP_SIZE, n, dmimaj, dmimin, dmirev);
+    result = true;
+  }
+  unmapcache(blob, len);
+
+  return result;
+}
+
+
+static void save_dmi_cache(const u8 *ep, size_t ep_len, const u8 *table, size_t len)
+{
+  vector < u8 > blob(DMI_EP_SIZE + len, 0);
+
+  memcpy(blob.data(), ep, ep_len < DMI_EP_SIZE ? ep_len : DMI_EP_SIZE);
+  memcpy(blob.data() + DMI_EP_SIZE, table, len);
+  savecache(DMICACHE, hw::strip(get_string(BOOT_ID)), blob.data(), blob.size());
+}
+
+
 static bool scan_dmi_sysfs(hwNode & n)
 {
   if (access(SYSFSDMI "/smbios_entry_point", R_OK)!=0 || access(SYSFSDMI "/DMI", R_OK)!=0)
@@ -1934,6 +2113,8 @@ static bool scan_dmi_sysfs(hwNode & n)
   if (!smbios_entry_point(ep_buf.data(), ep_len, n,
         dmimaj, dmimin, dmirev, table_len, table_base))
     return false;
+  if (scan_dmi_cache(n, ep_buf.data(), ep_len))
+    return true;
 
   ifstream dmi_stream(SYSFSDMI "/DMI",
       ifstream::in | ifstream::binary | ifstream::ate);
@@ -1944,15 +2125,19 @@ static bool scan_dmi_sysfs(hwNode & n)
   if (!dmi_stream)
     return false;
   dmi_table(dmi_buf.data(), dmi_len, n, dmimaj, dmimin, dmirev);
+  save_dmi_cache(ep_buf.data(), ep_len, dmi_buf.data(), dmi_len);
 
   return true;
 }
 
 
 #if defined(__i386__) || defined(__x86_64__) || defined(__ia64__)
+/*
+ * SMBIOS3 (64-bit entry point) is preferred, as the kernel does
+ */
 long get_efi_systab_smbios()
 {
-  long result = 0;
+  long result = 0, result3 = 0;
   vector < string > sysvars;
 
   if (loadfile("/sys/firmware/efi/systab", sysvars) || loadfile("/proc/efi/systab", sysvars))
@@ -1966,70 +2151,120 @@ long get_efi_systab_smbios()
     {
       sscanf(variable[1].c_str(), "%lx", &result);
     }
+    if ((variable[0] == "SMBIOS3") && (variable.size() == 2))
+    {
+      sscanf(variable[1].c_str(), "%lx", &result3);
+    }
   }
 
-  return result;
+  return result3 > 0 ? result3 : result;
+}
+
+
+static bool read_devmem(int fd, uint64_t address, void *buf, size_t len)
+{
+  u32 mmoffset = address % getpagesize();
+  void *mmp = mmap(0, mmoffset + len, PROT_READ, MAP_SHARED, fd, address - mmoffset);
+
+  if (mmp == MAP_FAILED)
+    return false;
+
+  memcpy(buf, (u8 *) mmp + mmoffset, len);
+  munmap(mmp, mmoffset + len);
+
+  return true;
 }
 
 
+/*
+ * look for an entry point anchor on a paragraph boundary of the legacy BIOS
+ * area, mapped once; memchr() skips quickly over everything that can't be
+ * the start of "_SM_" or "_SM3_"
+ */
+static bool scan_legacy_bios(int fd, hwNode & n, u8 *ep,
+    u16 & dmimaj, u16 & dmimin, u16 & dmirev,
+    uint32_t & table_len, uint64_t & table_base)
+{
+  void *mmp = mmap(0, LEGACY_BIOS_SIZE, PROT_READ, MAP_SHARED, fd, LEGACY_BIOS_START);
+  const u8 *start = (const u8 *) mmp;
+  const u8 *end = start + LEGACY_BIOS_SIZE;
+  const u8 *p = start;
+  bool found = false;
+
+  if (mmp == MAP_FAILED)
+    return false;
+
+  while (!found && (p < end) && ((p = (const u8 *) memchr(p, '_', end - p)) != NULL))
+  {
+    size_t offset = p - start;
+
+    if ((offset & 0xF) == 0 && (memcmp(p, "_SM", 3) == 0))
+    {
+      size_t len = end - p;
+
+      memset(ep, 0, DMI_EP_SIZE);
+      memcpy(ep, p, len < DMI_EP_SIZE ? len : DMI_EP_SIZE);
+      found = smbios_entry_point(ep, len < DMI_EP_SIZE ? len : DMI_EP_SIZE, n,
+        dmimaj, dmimin, dmirev, table_len, table_base);
+    }
+    p = start + (offset | 0xF) + 1;               // next paragraph
+  }
+  munmap(mmp, LEGACY_BIOS_SIZE);
+
+  return found;
+}
+
+
+/*
+ * the entry point is taken from (in order of preference) the kernel, the
+ * EFI system table or the legacy BIOS area; only the table itself is then
+ * read from /dev/mem
+ */
 static bool scan_dmi_devmem(hwNode & n)
 {
-  unsigned char buf[31];
+  u8 ep[DMI_EP_SIZE];
   int fd = open("/dev/mem",
     O_RDONLY);
   long fp = get_efi_systab_smbios();
-  u32 mmoffset = 0;
-  void *mmp = NULL;
-  bool efi = true;
+  bool found = false;
+  uint32_t len = 0;
+  uint64_t base = 0;
   u16 dmimaj = 0, dmimin = 0, dmirev = 0;
 
   if (fd == -1)
     return false;
 
-  if (fp <= 0)
-  {
-    efi = false;
-    fp = 0xE0000L;                                /* default value for non-EFI capable platforms */
-  }
+  memset(ep, 0, sizeof(ep));
+  found = (get_string(SYSFSDMI "/smbios_entry_point").copy((char *) ep, sizeof(ep)) > 0) &&
+    smbios_entry_point(ep, sizeof(ep), n, dmimaj, dmimin, dmirev, len, base);
 
-  fp -= 16;
-  while (efi || (fp < 0xFFFE0))
+  if (!found && (fp > 0))                         // EFI: no need to search the memory
   {
-    fp += 16;
-    mmoffset = fp % getpagesize();
-    mmp = mmap(0, mmoffset + 0x20, PROT_READ, MAP_SHARED, fd, fp - mmoffset);
-    memset(buf, 0, sizeof(buf));
-    if (mmp != MAP_FAILED)
-    {
-      memcpy(buf, (u8 *) mmp + mmoffset, sizeof(buf));
-      munmap(mmp, mmoffset + 0x20);
-    }
-    if (mmp == MAP_FAILED)
+    if (!read_devmem(fd, fp, ep, sizeof(ep)))
     {
       close(fd);
       return false;
     }
-    uint32_t len;
-    uint64_t base;
-    if (smbios_entry_point(buf, sizeof(buf), n, dmimaj, dmimin, dmirev, len, base))
+    found = smbios_entry_point(ep, sizeof(ep), n, dmimaj, dmimin, dmirev, len, base);
+  }
+  else if (!found)
+  {
+    found = scan_legacy_bios(fd, n, ep, dmimaj, dmimin, dmirev, len, base);
+  }
+
+  if (found)
+  {
+    u8 *dmi_buf = (u8 *)malloc(len);
+
+    if (!dmi_buf || !read_devmem(fd, base, dmi_buf, len))
     {
-      u8 *dmi_buf = (u8 *)malloc(len);
-      mmoffset = base % getpagesize();
-      mmp = mmap(0, mmoffset + len, PROT_READ, MAP_SHARED, fd, base - mmoffset);
-      if (mmp == MAP_FAILED)
-      {
-        free(dmi_buf);
-        return false;
-      }
-      memcpy(dmi_buf, (u8 *) mmp + mmoffset, len);
-      munmap(mmp, mmoffset + len);
-      dmi_table(dmi_buf, len, n, dmimaj, dmimin, dmirev);
       free(dmi_buf);
-      break;
+      close(fd);
+      return false;
     }
-
-    if (efi)
-      break;                                    // we don't need to search the memory for EFI systems
+    dmi_table(dmi_buf, len, n, dmimaj, dmimin, dmirev);
+    save_dmi_cache(ep, sizeof(ep), dmi_buf, len);
+    free(dmi_buf);
   }
   close(fd);
 
@@ -2042,6 +2277,8 @@ bool scan_dmi(hwNode & n)
 {
   if (scan_dmi_sysfs(n))
     return true;
+  if (scan_dmi_cache(n, NULL, 0))
+    return true;
 #if defined(__i386__) || defined(__x86_64__) || defined(__ia64__)
   if (scan_dmi_devmem(n))
     return true;
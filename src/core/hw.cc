@@ -10,6 +10,7 @@
 #include <cstring>
 #include <vector>
 #include <map>
+#include <set>
 #include <sstream>
 #include <stdlib.h>
 #include <stdio.h>
@@ -24,6 +25,87 @@ using namespace hw;
 
 __ID("@(#) $Id$");
 
+/*
+ * capability lists are shared (copy-on-write) between nodes that have the
+ * same ones, like the CPUs of many-core systems
+ */
+struct capset_i
+{
+  vector < string > features;
+  map < string, string > descriptions;
+
+  int refcount;
+};
+
+class capset
+{
+  public:
+
+    capset()
+    {
+      This = new capset_i;
+      This->refcount = 1;
+    }
+
+    capset(const capset & c)
+    {
+      This = c.This;
+      This->refcount++;
+    }
+
+    ~capset()
+    {
+      release();
+    }
+
+    capset & operator =(const capset & c)
+    {
+      if (c.This == This)
+        return *this;
+
+      c.This->refcount++;
+      release();
+      This = c.This;
+
+      return *this;
+    }
+
+    const capset_i & get() const
+    {
+      return *This;
+    }
+
+    capset_i & set()                              // detach before changing
+    {
+      if (This->refcount > 1)
+      {
+        capset_i * copy = new capset_i(*This);
+
+        copy->refcount = 1;
+        This->refcount--;
+        This = copy;
+      }
+
+      return *This;
+    }
+
+    const void * id() const
+    {
+      return This;
+    }
+
+  private:
+
+    void release()
+    {
+      This->refcount--;
+      if (This->refcount <= 0)
+        delete This;
+    }
+
+    capset_i * This;
+};
+
 struct hwNode_i
 {
   hwClass deviceclass;
@@ -38,9 +120,8 @@ struct hwNode_i
   unsigned int width;
   vector < hwNode > children;
   vector < string > attracted;
-  vector < string > features;
+  capset capabilities;
   vector < string > logicalnames;
-  map < string, string > features_descriptions;
   vector < resource > resources;
   map < string, string > config;
   map < string, value > hints;
@@ -669,8 +750,9 @@ hwNode *hwNode::getChild(const string & id)
       path = id.substr(pos + 1);
   }
 
+  baseid = cleanupId(baseid);
   for (unsigned int i = 0; i < This->children.size(); i++)
-    if (This->children[i].getId() == cleanupId(baseid))
+    if (This->children[i].getId() == baseid)
   {
     if (path == "")
       return &(This->children[i]);
@@ -889,14 +971,24 @@ bool hwNode::isCapable(const string & feature) const
   if (!This)
     return false;
 
-  for (unsigned int i = 0; i < This->features.size(); i++)
-    if (This->features[i] == featureid)
+  const vector < string > & features = This->capabilities.get().features;
+  for (unsigned int i = 0; i < features.size(); i++)
+    if (features[i] == featureid)
       return true;
 
   return false;
 }
 
 
+static void describe(capset & capabilities, const string & featureid, const string & description)
+{
+  map < string, string >::const_iterator i = capabilities.get().descriptions.find(featureid);
+
+  if ((i == capabilities.get().descriptions.end()) || (i->second != description))
+    capabilities.set().descriptions[featureid] = description;
+}
+
+
 void hwNode::addCapability(const string & feature,
 const string & description)
 {
@@ -906,7 +998,7 @@ const string & description)
     return;
 
   if (description != "")
-    This->features_descriptions[cleanupId(feature)] = strip(description);
+    describe(This->capabilities, cleanupId(feature), strip(description));
 
   while (features.length() > 0)
   {
@@ -915,14 +1007,14 @@ const string & description)
     if (pos == string::npos)
     {
       if (!isCapable(cleanupId(features)))
-        This->features.push_back(cleanupId(features));
+        This->capabilities.set().features.push_back(cleanupId(features));
       features = "";
     }
     else
     {
       string featureid = cleanupId(features.substr(0, pos));
       if (!isCapable(featureid))
-        This->features.push_back(featureid);
+        This->capabilities.set().features.push_back(featureid);
       features = features.substr(pos + 1);
     }
   }
@@ -938,7 +1030,7 @@ const string & description)
   if (!isCapable(feature))
     return;
 
-  This->features_descriptions[cleanupId(feature)] = strip(description);
+  describe(This->capabilities, cleanupId(feature), strip(description));
 }
 
 
@@ -949,8 +1041,9 @@ string hwNode::getCapabilities() const
   if (!This)
     return "";
 
-  for (unsigned int i = 0; i < This->features.size(); i++)
-    result += This->features[i] + " ";
+  const vector < string > & features = This->capabilities.get().features;
+  for (unsigned int i = 0; i < features.size(); i++)
+    result += features[i] + " ";
 
   return strip(result);
 }
@@ -963,10 +1056,7 @@ vector < string > hwNode::getCapabilitiesList() const
   if (!This)
     return result;
 
-  for (unsigned int i = 0; i < This->features.size(); i++)
-    result.push_back(This->features[i]);
-
-  return result;
+  return This->capabilities.get().features;
 }
 
 
@@ -980,11 +1070,11 @@ string hwNode::getCapabilityDescription(const string & feature) const
   if (!This)
     return "";
 
-  if (This->features_descriptions.find(featureid) ==
-    This->features_descriptions.end())
+  map < string, string >::const_iterator i = This->capabilities.get().descriptions.find(featureid);
+  if (i == This->capabilities.get().descriptions.end())
     return "";
 
-  return This->features_descriptions[featureid];
+  return i->second;
 }
 
 
@@ -1208,19 +1298,27 @@ void hwNode::assignPhysIds()
   if (!This)
     return;
 
+  set < string > physids;                         // already in use
+  long nextid = 0, nextbridgeid = 0x100;
+
   for (unsigned int i = 0; i < This->children.size(); i++)
-  {
-    long curid = 0;
+    if (This->children[i].getPhysId() != "")
+      physids.insert(This->children[i].getPhysId());
 
-    if (This->children[i].getClass() == hw::bridge)
-      curid = 0x100;
+  for (unsigned int i = 0; i < This->children.size(); i++)
+  {
+    long & curid = (This->children[i].getClass() == hw::bridge)?nextbridgeid:nextid;
 
     if (This->children[i].getPhysId() == "")
     {
-      while (getChildByPhysId(curid))
-        curid++;
+      char buffer[20];
 
-      This->children[i].setPhysId(curid);
+      do
+        snprintf(buffer, sizeof(buffer), "%lx", curid++);
+      while (physids.find(buffer) != physids.end());
+
+      This->children[i].setPhysId(buffer);
+      physids.insert(buffer);
     }
 
     This->children[i].assignPhysIds();
@@ -1291,11 +1389,19 @@ void hwNode::merge(const hwNode & node)
   if (This->physid == "")
     This->physid = node.getPhysId();
 
-  for (unsigned int i = 0; i < node.This->features.size(); i++)
-    addCapability(node.This->features[i]);
-  for (map < string, string >::iterator i = node.This->features_descriptions.begin();
-    i != node.This->features_descriptions.end(); i++)
-  describeCapability(i->first, i->second);
+  if (This->capabilities.get().features.empty() &&
+    This->capabilities.get().descriptions.empty())
+    This->capabilities = node.This->capabilities;
+  else
+  {
+    const capset_i & capabilities = node.This->capabilities.get();
+
+    for (unsigned int i = 0; i < capabilities.features.size(); i++)
+      addCapability(capabilities.features[i]);
+    for (map < string, string >::const_iterator i = capabilities.descriptions.begin();
+      i != capabilities.descriptions.end(); i++)
+    describeCapability(i->first, i->second);
+  }
 
   for (map < string, string >::iterator i = node.This->config.begin();
     i != node.This->config.end(); i++)
@@ -1389,10 +1495,99 @@ vector < string > hwNode::getHints() const
   return result;
 }
 
+static map < string, capset > capsetpool;         // interned capability lists, by contents
+
+/*
+ * make this node's capabilities point to the same list as every other
+ * (interned) node with identical capabilities, so that scanners can drop
+ * their private copy as soon as they're done adding capabilities
+ */
+void hwNode::internCapabilities()
+{
+  if (!This)
+    return;
+
+  const capset_i & capabilities = This->capabilities.get();
+  if (capabilities.features.empty())
+    return;
+
+  string key = "";
+
+  for (unsigned int i = 0; i < capabilities.features.size(); i++)
+    key += capabilities.features[i] + "\n";
+  for (map < string, string >::const_iterator i = capabilities.descriptions.begin();
+    i != capabilities.descriptions.end(); i++)
+  key += "\t" + i->first + "=" + i->second + "\n";
+
+  map < string, capset >::iterator i = capsetpool.find(key);
+  if (i == capsetpool.end())
+    capsetpool.insert(pair < string, capset > (key, This->capabilities));
+  else
+    This->capabilities = i->second;
+}
+
+/*
+ * same for the whole tree, once the scan is over
+ */
+void hwNode::shareCapabilities()
+{
+  vector < hwNode * > nodes(1, this);
+
+  while (!nodes.empty())
+  {
+    hwNode * node = nodes.back();
+
+    nodes.pop_back();
+    node->internCapabilities();
+
+    for (unsigned int i = 0; i < node->countChildren(); i++)
+      nodes.push_back(node->getChild(i));
+  }
+}
+
+
+static map < const void *, unsigned int > capsetusers;
+static map < const void *, string > capsets;      // -capsets: lists already written out
+
+void hwNode::countCapsets() const
+{
+  if (!This)
+    return;
+
+  if (visible(getClassName()) && !This->capabilities.get().features.empty())
+    capsetusers[This->capabilities.id()]++;
+  for (unsigned int i = 0; i < This->children.size(); i++)
+    This->children[i].countCapsets();
+}
+
+/*
+ * with -capsets, capability lists shared by several nodes are only written
+ * out once and referenced by id afterwards
+ */
+static bool capsetref(const capset & capabilities, string & id)
+{
+  id = "";
+  if (!::enabled("output:capsets") || (capsetusers[capabilities.id()] < 2))
+    return false;
+
+  map < const void *, string >::const_iterator i = capsets.find(capabilities.id());
+  if (i != capsets.end())
+  {
+    id = i->second;
+    return true;
+  }
+
+  id = "capset" + hw::asString(capsets.size());
+  capsets[capabilities.id()] = id;
+  return false;
+}
+
+
 string hwNode::asJSON(unsigned level)
 {
   vector < string > config;
   vector < string > resources;
+  string capsetid = "";
   ostringstream out;
 
   if(!This) return "";
@@ -1400,6 +1595,14 @@ string hwNode::asJSON(unsigned level)
   config = getConfigKeys();
   resources = getResources("\" value=\"");
 
+  if (level == 0)
+  {
+    capsets.clear();
+    capsetusers.clear();
+    if (::enabled("output:capsets"))
+      countCapsets();
+  }
+
   if (::enabled("output:list") && level == 0)
   {
     out << "[" << endl;
@@ -1608,6 +1811,13 @@ string hwNode::asJSON(unsigned level)
     config.clear();
 
     splitlines(getCapabilities(), config, ' ');
+    if ((config.size() > 0) && capsetref(This->capabilities, capsetid))
+    {
+      out << "," << endl;
+      out << spaces(2*level+2);
+      out << "\"capset\" : \"" << capsetid << "\"";
+    }
+    else
     if (config.size() > 0)
     {
       out << "," << endl;
@@ -1631,6 +1841,12 @@ string hwNode::asJSON(unsigned level)
       }
       out << endl << spaces(2*level+2);
       out << "}";
+      if (capsetid != "")
+      {
+        out << "," << endl;
+        out << spaces(2*level+2);
+        out << "\"capset\" : \"" << capsetid << "\"";
+      }
     }
     config.clear();
 
@@ -1698,6 +1914,7 @@ string hwNode::asXML(unsigned level)
 {
   vector < string > config;
   vector < string > resources;
+  string capsetid = "";
   ostringstream out;
 
   if(!This) return "";
@@ -1705,6 +1922,14 @@ string hwNode::asXML(unsigned level)
   config = getConfigKeys();
   resources = getResources("\" value=\"");
 
+  if (level == 0)
+  {
+    capsets.clear();
+    capsetusers.clear();
+    if (::enabled("output:capsets"))
+      countCapsets();
+  }
+
   if (level == 0)
   {
     struct utsname un;
@@ -1972,10 +2197,19 @@ string hwNode::asXML(unsigned level)
     config.clear();
 
     splitlines(getCapabilities(), config, ' ');
+    if ((config.size() > 0) && capsetref(This->capabilities, capsetid))
+    {
+      out << spaces(2*level+1);
+      out << "<capabilities ref=\"" << capsetid << "\" />" << endl;
+    }
+    else
     if (config.size() > 0)
     {
       out << spaces(2*level+1);
-      out << "<capabilities>" << endl;
+      if (capsetid != "")
+        out << "<capabilities id=\"" << capsetid << "\">" << endl;
+      else
+        out << "<capabilities>" << endl;
       for (unsigned int j = 0; j < config.size(); j++)
       {
         out << spaces(2*level+2);
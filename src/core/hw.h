@@ -223,6 +223,8 @@ class hwNode
     void merge(const hwNode & node);
 
     void fixInconsistencies();
+    void internCapabilities();
+    void shareCapabilities();
 
     string asXML(unsigned level = 0);
     string asJSON(unsigned level = 0);
@@ -235,6 +237,7 @@ class hwNode
 
     bool attractsHandle(const string & handle) const;
     bool attractsNode(const hwNode & node) const;
+    void countCapsets() const;
 
     struct hwNode_i * This;
 };
@@ -39,6 +39,7 @@
 #include "display.h"
 #include "parisc.h"
 #include "cpufreq.h"
+#include "topology.h"
 #include "ideraid.h"
 #include "mounts.h"
 #include "virtio.h"
@@ -51,9 +52,13 @@
 #include "smp.h"
 #include "abi.h"
 #include "s390.h"
+#include "disk.h"
+#include "osutils.h"
 
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 __ID("@(#) $Id$");
 
@@ -155,6 +160,8 @@ bool scan_system(hwNode & system)
     status("S/390 devices");
     if (enabled("s390"))
       scan_s390_devices(computer);
+    status("Disks");
+    probe_disks(computer);
     if (enabled("mounts"))
       scan_mounts(computer);
     status("Network interfaces");
@@ -166,6 +173,9 @@ bool scan_system(hwNode & system)
     status("Display");
     if (enabled("display"))
       scan_display(computer);
+    status("CPU topology");
+    if (enabled("topology"))
+      scan_topology(computer);
     status("CPUFreq");
     if (enabled("cpufreq"))
       scan_cpufreq(computer);
@@ -178,6 +188,7 @@ bool scan_system(hwNode & system)
       computer.setDescription("Computer");
     computer.assignPhysIds();
     computer.fixInconsistencies();
+    computer.shareCapabilities();
 
     system = computer;
   }
@@ -186,3 +197,44 @@ bool scan_system(hwNode & system)
 
   return true;
 }
+
+/*
+ * Run the partition/volume detectors on disk images (raw files) instead of
+ * scanning the system: each image is reported as a disk.
+ */
+bool scan_images(hwNode & system, const vector < string > & images)
+{
+  hwNode computer(::enabled("output:sanitize")?"computer":"images",
+    hw::system);
+
+  computer.setDescription("Disk images");
+  for(unsigned int i = 0; i < images.size(); i++)
+  {
+    hwNode image("disk", hw::disk);
+    struct stat buf;
+
+    if((stat(images[i].c_str(), &buf) != 0) || !S_ISREG(buf.st_mode))
+    {
+      fprintf(stderr, "%s: not a disk image\n", images[i].c_str());
+      continue;
+    }
+
+    image.setDescription("Disk image");
+    image.setLogicalName(realpath(images[i]));
+    image.setSize(buf.st_size);
+    image.setPhysId(i);
+    scan_disk(image);
+    computer.addChild(image);
+  }
+
+  status("Disks");
+  probe_disks(computer);
+  status("");
+
+  computer.claim(true);                           // everything found in images is accounted for
+  computer.fixInconsistencies();
+
+  system = computer;
+
+  return computer.countChildren() > 0;
+}
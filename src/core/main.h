@@ -4,4 +4,5 @@
 #include "hw.h"
 
 bool scan_system(hwNode & system);
+bool scan_images(hwNode & system, const vector < string > & images);
 #endif
@@ -18,15 +18,48 @@
 
 #include "version.h"
 #include "config.h"
-#include "sysfs.h"
+#include "osutils.h"
 #include "mem.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
 
 __ID("@(#) $Id$");
 
+#define SYS_DEVICES_MEMORY "/sys/devices/system/memory"
+#define SYS_DEVICES_NODE "/sys/devices/system/node"
+#define MAXHOTPLUGREADS 8                         // concurrent sysfs reads
+
+struct memory_block
+{
+  unsigned long index;
+  int node;
+  bool online;
+};
+
+struct memory_node
+{
+  unsigned long long online;
+  unsigned long long offline;
+};
+
+/*
+ * kernel hotplug memory blocks, summed up (overall and per NUMA node)
+ */
+struct memory_blocks
+{
+  unsigned long long blocksize;
+  unsigned long long online;
+  unsigned long long offline;
+  map < int, memory_node > nodes;
+};
+
 static unsigned long long get_kcore_size()
 {
   struct stat buf;
@@ -54,28 +87,155 @@ static unsigned long long get_sysconf_size()
 }
 
 
-static unsigned long long get_hotplug_size()
+/*
+ * N for all the "memoryN" entries of a directory
+ */
+static vector < unsigned long > memory_block_indexes(const string & path)
 {
-  vector < sysfs::entry > entries = sysfs::entries_by_bus("memory");
+  vector < unsigned long > result;
+  DIR *dir = opendir(path.c_str());
+  struct dirent *entry = NULL;
 
-  if (entries.empty())
-    return 0;
+  if (!dir)
+    return result;
 
-  unsigned long long memblocksize =
-    sysfs::entry::byPath("/system/memory").hex_attr("block_size_bytes");
-  if (memblocksize == 0)
-    return 0;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    unsigned long index = 0;
+    char dummy;
 
-  unsigned long long totalsize = 0;
-  for (vector < sysfs::entry >::iterator it = entries.begin();
-      it != entries.end(); ++it)
+    if (sscanf(entry->d_name, "memory%lu%c", &index, &dummy) == 1)
+      result.push_back(index);
+  }
+  closedir(dir);
+
+  return result;
+}
+
+
+static void read_block_state(size_t i, void *data)
+{
+  memory_block & block = (*(vector < memory_block > *) data)[i];
+  char path[80];
+  char state[4];
+  ssize_t count = 0;
+
+  snprintf(path, sizeof(path), SYS_DEVICES_MEMORY "/memory%lu/online", block.index);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+
+  count = pread(fd, state, sizeof(state), 0);
+  block.online = (count > 0) && (state[0] == '1') &&
+    ((count == 1) || (state[1] == '\n'));
+  close(fd);
+}
+
+
+/*
+ * Terabyte hosts have tens of thousands of memory blocks: list them in one
+ * pass, find which NUMA node they belong to from the nodes' links to them
+ * (one pass per node) and only read their "online" attribute, in parallel.
+ */
+static bool get_memory_blocks(memory_blocks & blocks)
+{
+  vector < unsigned long > indexes = memory_block_indexes(SYS_DEVICES_MEMORY);
+  vector < memory_block > list(indexes.size());
+  struct dirent **namelist = NULL;
+  int n = 0;
+
+  blocks.blocksize = strtoull(hw::strip(get_string(SYS_DEVICES_MEMORY "/block_size_bytes")).c_str(), NULL, 16);
+  blocks.online = blocks.offline = 0;
+  blocks.nodes.clear();
+  if (indexes.empty() || (blocks.blocksize == 0))
+    return false;
+
+  sort(indexes.begin(), indexes.end());
+  for (size_t i = 0; i < indexes.size(); i++)
   {
-    const sysfs::entry & e = *it;
-    if (e.string_attr("online") != "1")
-      continue;
-    totalsize += memblocksize;
+    list[i].index = indexes[i];
+    list[i].node = -1;
+    list[i].online = false;
   }
-  return totalsize;
+
+  n = scandir(SYS_DEVICES_NODE, &namelist, NULL, NULL);
+  for (int i = 0; i < n; i++)
+  {
+    int node = 0;
+    char dummy;
+
+    if (sscanf(namelist[i]->d_name, "node%d%c", &node, &dummy) == 1)
+    {
+      vector < unsigned long > members =
+        memory_block_indexes(string(SYS_DEVICES_NODE "/") + namelist[i]->d_name);
+
+      for (size_t j = 0; j < members.size(); j++)
+      {
+        vector < unsigned long >::iterator it =
+          lower_bound(indexes.begin(), indexes.end(), members[j]);
+
+        if ((it != indexes.end()) && (*it == members[j]))
+          list[it - indexes.begin()].node = node;
+      }
+    }
+    free(namelist[i]);
+  }
+  if (n >= 0)
+    free(namelist);
+
+  parallelize(list.size(), read_block_state, &list, MAXHOTPLUGREADS);
+
+  for (size_t i = 0; i < list.size(); i++)
+  {
+    unsigned long long & total = list[i].online ? blocks.online : blocks.offline;
+
+    total += blocks.blocksize;
+    if (list[i].node >= 0)
+    {
+      memory_node & node = blocks.nodes[list[i].node];
+
+      if (list[i].online)
+        node.online += blocks.blocksize;
+      else
+        node.offline += blocks.blocksize;
+    }
+  }
+
+  return true;
+}
+
+
+/*
+ * without memory hotplug support, the nodes' meminfo still tells us how
+ * much memory each NUMA node has
+ */
+static bool get_node_memory(memory_blocks & blocks)
+{
+  struct dirent **namelist = NULL;
+  int n = scandir(SYS_DEVICES_NODE, &namelist, NULL, NULL);
+
+  blocks.nodes.clear();
+  for (int i = 0; i < n; i++)
+  {
+    int node = 0;
+    char dummy;
+    vector < string > meminfo;
+
+    if ((sscanf(namelist[i]->d_name, "node%d%c", &node, &dummy) == 1) &&
+      loadfile(string(SYS_DEVICES_NODE "/") + namelist[i]->d_name + "/meminfo", meminfo))
+      for (size_t l = 0; l < meminfo.size(); l++)
+      {
+        unsigned long long kb = 0;
+
+        if (sscanf(meminfo[l].c_str(), "Node %*d MemTotal: %llu kB", &kb) == 1)
+          blocks.nodes[node].online = kb * 1024;
+      }
+    free(namelist[i]);
+  }
+  if (n >= 0)
+    free(namelist);
+
+  return !blocks.nodes.empty();
 }
 
 
@@ -121,10 +281,14 @@ bool scan_memory(hwNode & n)
   unsigned long long logicalmem = 0;
   unsigned long long kcore = 0;
   unsigned long long hotplug_size = 0;
+  memory_blocks blocks;
 
   logicalmem = get_sysconf_size();
   kcore = get_kcore_size();
-  hotplug_size = get_hotplug_size();
+  if (get_memory_blocks(blocks))
+    hotplug_size = blocks.online;
+  else
+    get_node_memory(blocks);
   count_memorybanks_size(n);
   claim_memory(n);
 
@@ -153,6 +317,23 @@ bool scan_memory(hwNode & n)
     if (memory->getDescription() == "")
       memory->setDescription(_("System memory"));
 
+    if (hotplug_size > 0)
+    {
+      memory->setConfig("online", kilobytes(blocks.online));
+      if (blocks.offline > 0)
+        memory->setConfig("offline", kilobytes(blocks.offline));
+    }
+    if (blocks.nodes.size() > 1)
+      for (map < int, memory_node >::iterator it = blocks.nodes.begin();
+          it != blocks.nodes.end(); ++it)
+      {
+        string numa = "numa" + tostring(it->first);
+
+        memory->setConfig(numa + ".online", kilobytes(it->second.online));
+        if (it->second.offline > 0)
+          memory->setConfig(numa + ".offline", kilobytes(it->second.offline));
+      }
+
     if (memory->getSize() > logicalmem)           // we already have a value
       return true;
 
@@ -21,6 +21,8 @@
 #include "sysfs.h"
 #include "options.h"
 #include "heuristics.h"
+#include "cache.h"
+#include "oui.h"
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <netinet/in.h>
@@ -30,11 +32,18 @@
 #include <net/if.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <string>
+#include <map>
+#include <set>
 #include <sys/types.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/genetlink.h>
 using namespace std;
 
 __ID("@(#) $Id$");
@@ -170,6 +179,15 @@ struct ethtool_value
 #define ETHTOOL_GMODULEEEPROM   0x00000043        /* Get plug-in module eeprom */
 #define ETHTOOL_GLINKSETTINGS   0x0000004c        /* Get link mode settings. */
 
+/* ethtool netlink interface (Linux 5.6+) */
+#define ETHTOOL_GENL_NAME "ethtool"
+#define ETHTOOL_GENL_VERSION 1
+#define ETHTOOL_MSG_LINKSTATE_GET 5
+#define ETHTOOL_MSG_LINKSTATE_GET_REPLY 6
+#define ETHTOOL_A_HEADER_DEV_INDEX 1
+#define ETHTOOL_A_LINKSTATE_HEADER 1
+#define ETHTOOL_A_LINKSTATE_LINK 2
+
 /* Indicates what features are supported by the interface. */
 #define SUPPORTED_10baseT_Half          (1 << 0)
 #define SUPPORTED_10baseT_Full          (1 << 1)
@@ -381,27 +399,400 @@ static void scan_ip(hwNode & interface)
 }
 
 
-static bool isVirtual(const string & MAC)
+/*
+ * Interfaces, flags, hardware and IPv4 addresses are fetched from the kernel
+ * with a couple of netlink dumps instead of several ioctls per interface;
+ * the ioctls are still used when netlink isn't available.
+ */
+#define NETLINK_BUFSIZE 32768
+#define SYS_CLASS_NET "/sys/class/net"
+
+struct netlink_link
+{
+  string name;
+  unsigned int flags;
+  unsigned short type;
+  unsigned char hwaddr[32];
+  string ip;
+  string remoteip;
+  int link;                                       // -1: unknown
+
+  netlink_link(): flags(0), type(0), link(-1) { memset(hwaddr, 0, sizeof(hwaddr)); }
+};
+
+typedef map < int, netlink_link > netlink_links;   // indexed by ifindex
+
+static bool netlink_dump(int protocol, struct nlmsghdr * request,
+  void (*parse)(struct nlmsghdr *, void *), void * data)
+{
+  struct sockaddr_nl kernel;
+  static uint32_t seq = 0;
+  bool done = false, result = false;
+  char * buffer = NULL;
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+
+  if (fd < 0)
+    return false;
+
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  request->nlmsg_flags |= NLM_F_REQUEST;
+  request->nlmsg_seq = ++seq;
+  if (sendto(fd, request, request->nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  buffer = new char[NETLINK_BUFSIZE];
+  while (!done)
+  {
+    ssize_t len = recv(fd, buffer, NETLINK_BUFSIZE, 0);
+
+    if (len <= 0)
+      break;
+
+    for (struct nlmsghdr * h = (struct nlmsghdr *)buffer; NLMSG_OK(h, (size_t)len); h = NLMSG_NEXT(h, len))
+    {
+      if (h->nlmsg_seq != request->nlmsg_seq)
+        continue;
+      if (h->nlmsg_type == NLMSG_DONE)
+      {
+        done = result = true;
+        break;
+      }
+      if (h->nlmsg_type == NLMSG_ERROR)
+      {
+        done = true;
+        break;
+      }
+      parse(h, data);
+      if (!(h->nlmsg_flags & NLM_F_MULTI))
+        done = result = true;
+    }
+  }
+
+  delete[] buffer;
+  close(fd);
+  return result;
+}
+
+static void parse_link(struct nlmsghdr * h, void * data)
+{
+  netlink_links & links = *(netlink_links *)data;
+  struct ifinfomsg * ifi = (struct ifinfomsg *)NLMSG_DATA(h);
+  int len = IFLA_PAYLOAD(h);
+
+  if (h->nlmsg_type != RTM_NEWLINK)
+    return;
+
+  netlink_link & l = links[ifi->ifi_index];
+  l.flags = ifi->ifi_flags;
+  l.type = ifi->ifi_type;
+
+  for (struct rtattr * a = IFLA_RTA(ifi); RTA_OK(a, len); a = RTA_NEXT(a, len))
+    switch (a->rta_type)
+    {
+      case IFLA_IFNAME:
+        l.name = string((char *)RTA_DATA(a), strnlen((char *)RTA_DATA(a), RTA_PAYLOAD(a)));
+        break;
+      case IFLA_ADDRESS:
+        memcpy(l.hwaddr, RTA_DATA(a), min((size_t)RTA_PAYLOAD(a), sizeof(l.hwaddr)));
+        break;
+    }
+}
+
+static void parse_addr(struct nlmsghdr * h, void * data)
+{
+  netlink_links & links = *(netlink_links *)data;
+  struct ifaddrmsg * ifa = (struct ifaddrmsg *)NLMSG_DATA(h);
+  int len = IFA_PAYLOAD(h);
+  struct in_addr local, address;
+  bool haslocal = false, hasaddress = false;
+
+  if ((h->nlmsg_type != RTM_NEWADDR) || (ifa->ifa_family != AF_INET) ||
+    (ifa->ifa_flags & IFA_F_SECONDARY) || (links.find(ifa->ifa_index) == links.end()))
+    return;
+
+  netlink_link & l = links[ifa->ifa_index];
+  if (l.ip != "")
+    return;                                       // only report the primary address
+
+  for (struct rtattr * a = IFA_RTA(ifa); RTA_OK(a, len); a = RTA_NEXT(a, len))
+  {
+    if ((a->rta_type == IFA_LOCAL) && (RTA_PAYLOAD(a) >= sizeof(local)))
+    {
+      memcpy(&local, RTA_DATA(a), sizeof(local));
+      haslocal = true;
+    }
+    if ((a->rta_type == IFA_ADDRESS) && (RTA_PAYLOAD(a) >= sizeof(address)))
+    {
+      memcpy(&address, RTA_DATA(a), sizeof(address));
+      hasaddress = true;
+    }
+  }
+
+  if (!haslocal && hasaddress)
+  {
+    local = address;
+    haslocal = true;
+  }
+  if (haslocal)
+    l.ip = inet_ntoa(local);
+  if (haslocal && hasaddress && (local.s_addr != address.s_addr))
+    l.remoteip = inet_ntoa(address);              // point-to-point peer
+}
+
+static void parse_family(struct nlmsghdr * h, void * data)
+{
+  struct genlmsghdr * g = (struct genlmsghdr *)NLMSG_DATA(h);
+  struct rtattr * a = (struct rtattr *)((char *)g + GENL_HDRLEN);
+  int len = h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+  for (; RTA_OK(a, len); a = RTA_NEXT(a, len))
+    if ((a->rta_type == CTRL_ATTR_FAMILY_ID) && (RTA_PAYLOAD(a) >= sizeof(uint16_t)))
+      memcpy(data, RTA_DATA(a), sizeof(uint16_t));
+}
+
+static void parse_linkstate(struct nlmsghdr * h, void * data)
+{
+  netlink_links & links = *(netlink_links *)data;
+  struct genlmsghdr * g = (struct genlmsghdr *)NLMSG_DATA(h);
+  struct rtattr * a = (struct rtattr *)((char *)g + GENL_HDRLEN);
+  int len = h->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+  int index = 0, link = -1;
+
+  if (g->cmd != ETHTOOL_MSG_LINKSTATE_GET_REPLY)
+    return;
+
+  for (; RTA_OK(a, len); a = RTA_NEXT(a, len))
+  {
+    if (a->rta_type == (NLA_F_NESTED | ETHTOOL_A_LINKSTATE_HEADER) ||
+      a->rta_type == ETHTOOL_A_LINKSTATE_HEADER)
+    {
+      struct rtattr * h = (struct rtattr *)RTA_DATA(a);
+      int hlen = RTA_PAYLOAD(a);
+
+      for (; RTA_OK(h, hlen); h = RTA_NEXT(h, hlen))
+        if ((h->rta_type == ETHTOOL_A_HEADER_DEV_INDEX) && (RTA_PAYLOAD(h) >= sizeof(uint32_t)))
+          index = *(uint32_t *)RTA_DATA(h);
+    }
+    if ((a->rta_type == ETHTOOL_A_LINKSTATE_LINK) && (RTA_PAYLOAD(a) >= 1))
+      link = *(uint8_t *)RTA_DATA(a);
+  }
+
+  if ((link >= 0) && (links.find(index) != links.end()))
+    links[index].link = link;
+}
+
+// ethtool link state of all the interfaces at once
+static bool load_linkstates(netlink_links & links)
+{
+  struct
+  {
+    struct nlmsghdr h;
+    struct genlmsghdr g;
+    char attrs[64];
+  } request;
+  uint16_t family = 0;
+  struct rtattr * a = (struct rtattr *)request.attrs;
+
+  memset(&request, 0, sizeof(request));
+  request.h.nlmsg_type = GENL_ID_CTRL;
+  request.g.cmd = CTRL_CMD_GETFAMILY;
+  request.g.version = 1;
+  a->rta_type = CTRL_ATTR_FAMILY_NAME;
+  a->rta_len = RTA_LENGTH(sizeof(ETHTOOL_GENL_NAME));
+  memcpy(RTA_DATA(a), ETHTOOL_GENL_NAME, sizeof(ETHTOOL_GENL_NAME));
+  request.h.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN) + RTA_ALIGN(a->rta_len);
+  if (!netlink_dump(NETLINK_GENERIC, &request.h, parse_family, &family) || !family)
+    return false;
+
+  memset(&request, 0, sizeof(request));
+  request.h.nlmsg_type = family;
+  request.h.nlmsg_flags = NLM_F_DUMP;
+  request.h.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+  request.g.cmd = ETHTOOL_MSG_LINKSTATE_GET;
+  request.g.version = ETHTOOL_GENL_VERSION;
+  return netlink_dump(NETLINK_GENERIC, &request.h, parse_linkstate, &links);
+}
+
+static bool load_links(netlink_links & links)
 {
-  if (MAC.length() < 8)
+  struct
+  {
+    struct nlmsghdr h;
+    struct rtgenmsg g;
+  } request;
+
+  links.clear();
+
+  memset(&request, 0, sizeof(request));
+  request.h.nlmsg_len = NLMSG_LENGTH(sizeof(request.g));
+  request.h.nlmsg_type = RTM_GETLINK;
+  request.h.nlmsg_flags = NLM_F_DUMP;
+  request.g.rtgen_family = AF_UNSPEC;
+  if (!netlink_dump(NETLINK_ROUTE, &request.h, parse_link, &links))
+  {
+    links.clear();
     return false;
+  }
+
+  request.h.nlmsg_type = RTM_GETADDR;
+  request.g.rtgen_family = AF_INET;
+  netlink_dump(NETLINK_ROUTE, &request.h, parse_addr, &links);
+
+  return true;
+}
+
+
+static void set_flags(hwNode & interface, unsigned int flags)
+{
+#ifdef IFF_PORTSEL
+  if (flags & IFF_PORTSEL)
+  {
+    if (flags & IFF_AUTOMEDIA)
+      interface.setConfig("automedia", "yes");
+  }
+#endif
+
+  if (flags & IFF_UP)
+    interface.enable();
+  else
+    interface.disable();
+  if (flags & IFF_BROADCAST)
+    interface.setConfig("broadcast", "yes");
+  if (flags & IFF_DEBUG)
+    interface.setConfig("debug", "yes");
+  if (flags & IFF_LOOPBACK)
+    interface.setConfig("loopback", "yes");
+  if (flags & IFF_POINTOPOINT)
+    interface.setConfig("point-to-point", "yes");
+  if (flags & IFF_PROMISC)
+    interface.setConfig("promiscuous", "yes");
+  if (flags & IFF_SLAVE)
+    interface.setConfig("slave", "yes");
+  if (flags & IFF_MASTER)
+    interface.setConfig("master", "yes");
+  if (flags & IFF_MULTICAST)
+    interface.setConfig("multicast", "yes");
+}
+
+
+static void set_hwaddr(hwNode & interface, const unsigned char * mac, unsigned family)
+{
+  string hwaddr = getmac(mac, family);
+  interface.addCapability(hwname(family));
+  if (family >= 256)
+    interface.addCapability("logical", _("Logical interface"));
+  else
+    interface.addCapability("physical", _("Physical interface"));
+  interface.setDescription(string(hwname(family)) +
+    " interface");
+  interface.setSerial(hwaddr);
+
+  if ((hwaddr == "") || (maclen(family) != 6))
+    return;
+
+  string vendor = "";
+  if (oui_lookup(mac, vendor) && (interface.getVendor() == ""))
+    interface.setVendor(vendor);
+  if (oui_virtual(mac))
+    interface.addCapability("logical", _("Logical interface"));
+}
+
+
+/*
+ * Classify interfaces from sysfs, so that expensive probes (ethtool, module
+ * EEPROM) are only done when they can return something:
+ * - virtual interfaces (veth, bridges, tunnels...) have no backing device
+ * - switchdev representors share their PF's device but have no PHY/module
+ */
+enum
+{
+  NET_PHYSICAL,
+  NET_REPRESENTOR,
+  NET_VIRTUAL
+};
 
-  string manufacturer = uppercase(MAC.substr(0, 8));
+static int classify(const string & interface)
+{
+  string dir = string(SYS_CLASS_NET"/") + interface;
 
-  if ((manufacturer == "00:05:69") ||
-    (manufacturer == "00:0C:29") || (manufacturer == "00:50:56"))
-    return true;	// VMware
-  if (manufacturer == "00:1C:42")
-    return true;	// Parallels
-  if (manufacturer == "0A:00:27")
-    return true;	// VirtualBox
+  if (exists(dir + "/device"))
+  {
+    if ((hw::strip(get_string(dir + "/phys_switch_id")) != "") &&
+      matches(hw::strip(get_string(dir + "/phys_port_name")), "^pf[0-9]+"))
+      return NET_REPRESENTOR;
+    return NET_PHYSICAL;
+  }
+
+  if (shortname(dirname(dirname(realpath(dir)))) == "virtual")
+    return NET_VIRTUAL;
 
-  return false;
+  return NET_PHYSICAL;
 }
 
 
+/*
+ * Transceiver modules (SFP...) are read over slow I2C buses: all the modules
+ * are read at the same time (MAXMODULEREADS at most) and we don't wait more
+ * than MODULETIMEOUT seconds for them. The decoded identity is cached,
+ * keyed by interface and module serial number, so that only the serial
+ * number needs to be read next time.
+ */
+#define MAXMODULEREADS 16
+#define MODULETIMEOUT 3                           // seconds
+#define MODULECACHE "modules"
+#define SFF_8472_SERIAL 68                        // vendor serial number (16 bytes)
+
+typedef map < string, string > moduleinfo;
+
+static bool read_eeprom(int fd, const string & interface, struct ethtool_eeprom & eeeprom, u32 offset, u32 len)
+{
+  struct ifreq ifr;
+
+  eeeprom.cmd = ETHTOOL_GMODULEEEPROM;
+  eeeprom.offset = offset;
+  eeeprom.len = len;
+  if (eeeprom.len > MAX_EEPROM_SIZE)
+    eeeprom.len = MAX_EEPROM_SIZE;
+  memset(&ifr, 0, sizeof(ifr));
+  strcpy(ifr.ifr_name, interface.c_str());
+  ifr.ifr_data = (caddr_t) &eeeprom;
+  return ioctl(fd, SIOCETHTOOL, &ifr) == 0;
+}
+
+static string encode_module(const moduleinfo & info)
+{
+  string result = "";
+
+  for (moduleinfo::const_iterator i = info.begin(); i != info.end(); i++)
+  {
+    if (result != "")
+      result += "\t";
+    result += i->first + "=" + i->second;
+  }
+
+  return result;
+}
+
+static void decode_module(const string & s, moduleinfo & info)
+{
+  vector < string > fields;
+
+  splitlines(s, fields, '\t');
+  for (size_t i = 0; i < fields.size(); i++)
+  {
+    size_t equal = fields[i].find('=');
+
+    if (equal != string::npos)
+      info[fields[i].substr(0, equal)] = fields[i].substr(equal + 1);
+  }
+}
+
 // Get data for connected transceiver module.
-static void scan_module(hwNode & interface, int fd)
+static bool read_module(int fd, const string & interface, const moduleinfo & cache, moduleinfo & info, string & key, bool & cached)
 {
   struct ifreq ifr;
   struct ethtool_modinfo emodinfo;
@@ -409,84 +800,279 @@ static void scan_module(hwNode & interface, int fd)
 
   emodinfo.cmd = ETHTOOL_GMODULEINFO;
   memset(&ifr, 0, sizeof(ifr));
-  strcpy(ifr.ifr_name, interface.getLogicalName().c_str());
+  strcpy(ifr.ifr_name, interface.c_str());
   ifr.ifr_data = (caddr_t) &emodinfo;
   // Skip interface if module info not supported.
   if (ioctl(fd, SIOCETHTOOL, &ifr) != 0)
-    return;
-
-  eeeprom.cmd = ETHTOOL_GMODULEEEPROM;
-  eeeprom.offset = 0;
-  eeeprom.len = emodinfo.eeprom_len;
-  if (eeeprom.len > MAX_EEPROM_SIZE)
-    eeeprom.len = MAX_EEPROM_SIZE;
-  memset(&ifr, 0, sizeof(ifr));
-  strcpy(ifr.ifr_name, interface.getLogicalName().c_str());
-  ifr.ifr_data = (caddr_t) &eeeprom;
-  if (ioctl(fd, SIOCETHTOOL, &ifr) != 0)
-    return;
+    return false;
 
   switch (emodinfo.type)
   {
     /* SFF 8472 eeprom layout starts with same data as SFF 8079. */
     case ETH_MODULE_SFF_8079:
     case ETH_MODULE_SFF_8472:
-      if ((eeeprom.data[0] == SFF_8024_ID_SOLDERED || eeeprom.data[0] == SFF_8024_ID_SFP) &&
-          eeeprom.data[1] == SFF_8024_EXT_ID_DEFINED_BY_2WIRE_ID)
+      break;
+    default:
+      return false;                               // nothing we know how to decode
+  }
+
+  key = "";
+  cached = false;
+  if (read_eeprom(fd, interface, eeeprom, SFF_8472_SERIAL, 16))
+  {
+    string serial = hw::strip(string((const char*)eeeprom.data, 16));
+
+    if (serial != "")
+    {
+      key = interface + " " + serial;
+      moduleinfo::const_iterator entry = cache.find(key);
+
+      if (entry != cache.end())
       {
-        char buffer[32];
-        /* Get part number (padded with space). String is stripped inside setConfig. */
-        interface.setConfig("module", string((const char*)&eeeprom.data[40], 16));
-        int wavelength = eeeprom.data[60] << 8 | eeeprom.data[61];
-        /* Skip wavelength for SFP+ cables, they use byte 60 for other data. */
-        if ((eeeprom.data[8] & 0x0C) == 0 && wavelength > 0)
-        {
-          snprintf(buffer, sizeof(buffer), "%dnm", wavelength);
-          interface.setConfig("wavelength", buffer);
-        }
-        int max_length = 0;
-        int length;
-        length = eeeprom.data[14] * 1000; /* SMF, km */
-        if (length > max_length) max_length = length;
-        length = eeeprom.data[15] * 100; /* SMF, meter */
-        if (length > max_length) max_length = length;
-        length = eeeprom.data[16] * 10; /* 50um (OM2), meter */
-        if (length > max_length) max_length = length;
-        length = eeeprom.data[17] * 10; /* 62.5um (OM1), meter */
-        if (length > max_length) max_length = length;
-        length = eeeprom.data[18]; /* Copper, meter */
-        if (length > max_length) max_length = length;
-        length = eeeprom.data[19] * 10; /* OM3, meter */
-        if (length > max_length) max_length = length;
-        if (max_length > 0)
-        {
-          snprintf(buffer, sizeof(buffer), "%dm", max_length);
-          interface.setConfig("maxlength", buffer);
-        }
-        switch (eeeprom.data[2])
-        {
-          case SFF_8024_CONNECTOR_SC:
-            interface.setConfig("connector", "SC");
-            break;
-          case SFF_8024_CONNECTOR_LC:
-            interface.setConfig("connector", "LC");
-            break;
-          case SFF_8024_CONNECTOR_OPTICAL_PIGTAIL:
-            interface.setConfig("connector", "optical pigtail");
-            break;
-          case SFF_8024_CONNECTOR_COPPER_PIGTAIL:
-            interface.setConfig("connector", "copper pigtail");
-            break;
-          case SFF_8024_CONNECTOR_RJ45:
-            interface.setConfig("connector", "RJ45");
-            break;
-          case SFF_8024_CONNECTOR_NON_SEPARABLE:
-            interface.setConfig("connector", "non separable");
-            break;
-        }
+        decode_module(entry->second, info);
+        cached = true;                            // nothing new to remember
+        return true;
       }
+    }
+  }
+
+  if (!read_eeprom(fd, interface, eeeprom, 0, emodinfo.eeprom_len))
+    return false;
+
+  if ((eeeprom.data[0] == SFF_8024_ID_SOLDERED || eeeprom.data[0] == SFF_8024_ID_SFP) &&
+      eeeprom.data[1] == SFF_8024_EXT_ID_DEFINED_BY_2WIRE_ID)
+  {
+    char buffer[32];
+    /* Get part number (padded with space). */
+    info["module"] = hw::strip(string((const char*)&eeeprom.data[40], 16));
+    int wavelength = eeeprom.data[60] << 8 | eeeprom.data[61];
+    /* Skip wavelength for SFP+ cables, they use byte 60 for other data. */
+    if ((eeeprom.data[8] & 0x0C) == 0 && wavelength > 0)
+    {
+      snprintf(buffer, sizeof(buffer), "%dnm", wavelength);
+      info["wavelength"] = buffer;
+    }
+    int max_length = 0;
+    int length;
+    length = eeeprom.data[14] * 1000; /* SMF, km */
+    if (length > max_length) max_length = length;
+    length = eeeprom.data[15] * 100; /* SMF, meter */
+    if (length > max_length) max_length = length;
+    length = eeeprom.data[16] * 10; /* 50um (OM2), meter */
+    if (length > max_length) max_length = length;
+    length = eeeprom.data[17] * 10; /* 62.5um (OM1), meter */
+    if (length > max_length) max_length = length;
+    length = eeeprom.data[18]; /* Copper, meter */
+    if (length > max_length) max_length = length;
+    length = eeeprom.data[19] * 10; /* OM3, meter */
+    if (length > max_length) max_length = length;
+    if (max_length > 0)
+    {
+      snprintf(buffer, sizeof(buffer), "%dm", max_length);
+      info["maxlength"] = buffer;
+    }
+    switch (eeeprom.data[2])
+    {
+      case SFF_8024_CONNECTOR_SC:
+        info["connector"] = "SC";
+        break;
+      case SFF_8024_CONNECTOR_LC:
+        info["connector"] = "LC";
+        break;
+      case SFF_8024_CONNECTOR_OPTICAL_PIGTAIL:
+        info["connector"] = "optical pigtail";
+        break;
+      case SFF_8024_CONNECTOR_COPPER_PIGTAIL:
+        info["connector"] = "copper pigtail";
+        break;
+      case SFF_8024_CONNECTOR_RJ45:
+        info["connector"] = "RJ45";
+        break;
+      case SFF_8024_CONNECTOR_NON_SEPARABLE:
+        info["connector"] = "non separable";
+        break;
+    }
+  }
+
+  return true;
+}
+
+struct modulejob
+{
+  string interface;
+  moduleinfo info;
+  string key;                                     // cache entry, if any
+  bool cached;                                    // already in the cache
+  bool found;
+  bool done;
+};
+
+struct modulereads
+{
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  vector < modulejob > jobs;
+  moduleinfo cache;
+  size_t next;
+  size_t done;
+  unsigned int refs;                              // main thread + workers
+  bool abandoned;
+};
+
+static void release(modulereads * r)
+{
+  bool last = false;
+
+  pthread_mutex_lock(&r->lock);
+  last = (--r->refs == 0);
+  pthread_mutex_unlock(&r->lock);
+
+  if (last)
+  {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->finished);
+    delete r;
+  }
+}
+
+static void * module_worker(void * arg)
+{
+  modulereads * r = (modulereads *)arg;
+  int fd = socket(PF_INET, SOCK_DGRAM, 0);
+
+  for (;;)
+  {
+    size_t i = 0;
+    moduleinfo info;
+    string key = "";
+    bool found = false, cached = false;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->abandoned || (r->next >= r->jobs.size()))
+    {
+      pthread_mutex_unlock(&r->lock);
+      break;
+    }
+    i = r->next++;
+    string interface = r->jobs[i].interface;
+    pthread_mutex_unlock(&r->lock);
+
+    if (fd >= 0)
+      found = read_module(fd, interface, r->cache, info, key, cached);
+
+    pthread_mutex_lock(&r->lock);
+    r->jobs[i].info = info;
+    r->jobs[i].key = key;
+    r->jobs[i].cached = cached;
+    r->jobs[i].found = found;
+    r->jobs[i].done = true;
+    r->done++;
+    pthread_cond_signal(&r->finished);
+    pthread_mutex_unlock(&r->lock);
+  }
+
+  if (fd >= 0)
+    close(fd);
+  release(r);
+  return NULL;
+}
+
+static void scan_modules(const vector < string > & interfaces, map < string, moduleinfo > & modules)
+{
+  modulereads * r = new modulereads;
+  pthread_attr_t attr;
+  struct timespec deadline;
+  moduleinfo cache;
+
+  modules.clear();
+  if (interfaces.empty())
+  {
+    delete r;
+    return;
+  }
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->finished, NULL);
+  loadcache(MODULECACHE, r->cache);
+  r->jobs.resize(interfaces.size());
+  for (size_t i = 0; i < interfaces.size(); i++)
+  {
+    r->jobs[i].interface = interfaces[i];
+    r->jobs[i].found = r->jobs[i].done = r->jobs[i].cached = false;
+  }
+  r->next = r->done = 0;
+  r->refs = 1;
+  r->abandoned = false;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (size_t i = 0; (i < interfaces.size()) && (i < MAXMODULEREADS); i++)
+  {
+    pthread_t thread;
+
+    pthread_mutex_lock(&r->lock);
+    r->refs++;
+    pthread_mutex_unlock(&r->lock);
+    if (pthread_create(&thread, &attr, module_worker, r) != 0)
+    {
+      pthread_mutex_lock(&r->lock);
+      r->refs--;
+      pthread_mutex_unlock(&r->lock);
       break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += MODULETIMEOUT;
+
+  pthread_mutex_lock(&r->lock);
+  if (r->refs == 1)                               // no thread could be started
+  {
+    pthread_mutex_unlock(&r->lock);
+    r->refs++;
+    module_worker(r);
+    pthread_mutex_lock(&r->lock);
   }
+  while ((r->done < r->jobs.size()) &&
+    (pthread_cond_timedwait(&r->finished, &r->lock, &deadline) == 0))
+    ;
+  r->abandoned = true;                            // don't wait for slow modules
+  for (size_t i = 0; i < r->jobs.size(); i++)     // only keep the modules we've seen
+  {
+    const modulejob & job = r->jobs[i];
+
+    if (!job.done)                                // timed out: keep what we knew
+    {
+      string prefix = job.interface + " ";
+
+      for (moduleinfo::const_iterator c = r->cache.lower_bound(prefix);
+          (c != r->cache.end()) && (c->first.compare(0, prefix.length(), prefix) == 0); c++)
+        cache[c->first] = c->second;
+      continue;
+    }
+    if (!job.found)
+      continue;
+    modules[job.interface] = job.info;
+    if (job.key != "")
+      cache[job.key] = job.cached?r->cache.find(job.key)->second:encode_module(job.info);
+  }
+  bool updated = (cache != r->cache);
+  pthread_mutex_unlock(&r->lock);
+  if (updated)
+    savecache(MODULECACHE, cache);
+
+  release(r);
+}
+
+
+static void logicalnames(hwNode & n, set < string > & names)
+{
+  vector < string > l = n.getLogicalNames();
+
+  names.insert(l.begin(), l.end());
+  for (unsigned int i = 0; i < n.countChildren(); i++)
+    logicalnames(*n.getChild(i), names);
 }
 
 
@@ -702,11 +1288,50 @@ static void scan_modes(hwNode & interface, int fd)
 bool scan_network(hwNode & n)
 {
   vector < string > interfaces;
+  netlink_links links;
+  map < string, netlink_link * > byname;
+  bool linkstates = false;
   char buffer[2 * IFNAMSIZ + 1];
 
+  if (load_links(links))
+  {
+    vector < string > ordered;
+    set < string > listed;
+
+    linkstates = load_linkstates(links);
+    for (netlink_links::iterator l = links.begin(); l != links.end(); l++)
+      byname[l->second.name] = &l->second;
+
+    load_interfaces(ordered);                     // keep the /proc/net/dev order
+    for (unsigned int i = 0; i < ordered.size(); i++)
+      if ((byname.find(ordered[i]) != byname.end()) && listed.insert(ordered[i]).second)
+        interfaces.push_back(ordered[i]);
+    for (netlink_links::iterator l = links.begin(); l != links.end(); l++)
+      if (listed.find(l->second.name) == listed.end())
+        interfaces.push_back(l->second.name);     // appeared in the meantime
+  }
+  else
   if (!load_interfaces(interfaces))
     return false;
 
+  vector < int > kinds(interfaces.size(), NET_PHYSICAL);
+  vector < string > physical;
+  map < string, moduleinfo > modules;
+
+  for (unsigned int i = 0; i < interfaces.size(); i++)
+  {
+    if (!netfilter(interfaces[i].c_str()))
+      kinds[i] = -1;                              // filtered out
+    else
+      kinds[i] = classify(interfaces[i]);
+    if (kinds[i] == NET_PHYSICAL)
+      physical.push_back(interfaces[i]);
+  }
+  scan_modules(physical, modules);
+
+  set < string > known;                           // logical names already in the tree
+  logicalnames(n, known);
+
   int fd = socket(PF_INET, SOCK_DGRAM, 0);
 
   if (fd >= 0)
@@ -720,6 +1345,13 @@ bool scan_network(hwNode & n)
       hwNode *existing;
       hwNode interface("network",
         hw::network);
+      netlink_link * l = byname.count(interfaces[i])?byname[interfaces[i]]:NULL;
+      int kind = kinds[i];
+
+      if (kind < 0)
+        continue;
+      if ((kind == NET_VIRTUAL) && !known.count(interfaces[i]))
+        continue;                                 // would be ignored anyway
 
       interface.setLogicalName(interfaces[i]);
       interface.claim();
@@ -731,59 +1363,29 @@ bool scan_network(hwNode & n)
       interface.setModalias(sysfs::entry::byClass("net", interface.getLogicalName()).leaf().modalias());
 
 //scan_mii(fd, interface);
-      scan_ip(interface);
-
-      memset(&ifr, 0, sizeof(ifr));
-      strcpy(ifr.ifr_name, interfaces[i].c_str());
-      if (ioctl(fd, SIOCGIFFLAGS, &ifr) == 0)
+      if (l)
       {
-#ifdef IFF_PORTSEL
-        if (ifr.ifr_flags & IFF_PORTSEL)
-        {
-          if (ifr.ifr_flags & IFF_AUTOMEDIA)
-            interface.setConfig("automedia", "yes");
-        }
-#endif
-
-        if (ifr.ifr_flags & IFF_UP)
-          interface.enable();
-        else
-          interface.disable();
-        if (ifr.ifr_flags & IFF_BROADCAST)
-          interface.setConfig("broadcast", "yes");
-        if (ifr.ifr_flags & IFF_DEBUG)
-          interface.setConfig("debug", "yes");
-        if (ifr.ifr_flags & IFF_LOOPBACK)
-          interface.setConfig("loopback", "yes");
-        if (ifr.ifr_flags & IFF_POINTOPOINT)
-          interface.setConfig("point-to-point", "yes");
-        if (ifr.ifr_flags & IFF_PROMISC)
-          interface.setConfig("promiscuous", "yes");
-        if (ifr.ifr_flags & IFF_SLAVE)
-          interface.setConfig("slave", "yes");
-        if (ifr.ifr_flags & IFF_MASTER)
-          interface.setConfig("master", "yes");
-        if (ifr.ifr_flags & IFF_MULTICAST)
-          interface.setConfig("multicast", "yes");
+        set_flags(interface, l->flags);
+        if (l->ip != "")
+          interface.setConfig("ip", ::enabled("output:sanitize")?REMOVED:l->ip);
+        if ((l->remoteip != "") && (l->flags & IFF_POINTOPOINT))
+          interface.setConfig("remoteip", l->remoteip);
+        set_hwaddr(interface, l->hwaddr, l->type);
       }
-
-      memset(&ifr, 0, sizeof(ifr));
-      strcpy(ifr.ifr_name, interfaces[i].c_str());
-// get MAC address
-      if (ioctl(fd, SIOCGIFHWADDR, &ifr) == 0)
+      else
       {
-        string hwaddr = getmac((unsigned char *) ifr.ifr_hwaddr.sa_data, ifr.ifr_hwaddr.sa_family);
-        interface.addCapability(hwname(ifr.ifr_hwaddr.sa_family));
-        if (ifr.ifr_hwaddr.sa_family >= 256)
-          interface.addCapability("logical", _("Logical interface"));
-        else
-          interface.addCapability("physical", _("Physical interface"));
-        interface.setDescription(string(hwname(ifr.ifr_hwaddr.sa_family)) +
-          " interface");
-        interface.setSerial(hwaddr);
+        scan_ip(interface);
+
+        memset(&ifr, 0, sizeof(ifr));
+        strcpy(ifr.ifr_name, interfaces[i].c_str());
+        if (ioctl(fd, SIOCGIFFLAGS, &ifr) == 0)
+          set_flags(interface, ifr.ifr_flags);
 
-        if (isVirtual(interface.getSerial()))
-          interface.addCapability("logical", _("Logical interface"));
+        memset(&ifr, 0, sizeof(ifr));
+        strcpy(ifr.ifr_name, interfaces[i].c_str());
+// get MAC address
+        if (ioctl(fd, SIOCGIFHWADDR, &ifr) == 0)
+          set_hwaddr(interface, (unsigned char *) ifr.ifr_hwaddr.sa_data, ifr.ifr_hwaddr.sa_family);
       }
 
 // check for wireless extensions
@@ -798,17 +1400,34 @@ bool scan_network(hwNode & n)
         interface.addHint("bus.icon", string("radio"));
       }
 
-      edata.cmd = ETHTOOL_GLINK;
-      memset(&ifr, 0, sizeof(ifr));
-      strcpy(ifr.ifr_name, interfaces[i].c_str());
-      ifr.ifr_data = (caddr_t) &edata;
-      if (ioctl(fd, SIOCETHTOOL, &ifr) == 0)
+      if (l && linkstates)
       {
-        interface.setConfig("link", edata.data ? "yes":"no");
+        if (l->link >= 0)
+          interface.setConfig("link", l->link ? "yes":"no");
       }
+      else
+      {
+        edata.cmd = ETHTOOL_GLINK;
+        memset(&ifr, 0, sizeof(ifr));
+        strcpy(ifr.ifr_name, interfaces[i].c_str());
+        ifr.ifr_data = (caddr_t) &edata;
+        if (ioctl(fd, SIOCETHTOOL, &ifr) == 0)
+        {
+          interface.setConfig("link", edata.data ? "yes":"no");
+        }
+      }
+
+      if (kind == NET_PHYSICAL)
+      {
+        scan_modes(interface, fd);
+        if (modules.find(interfaces[i]) != modules.end())
+        {
+          const moduleinfo & module = modules[interfaces[i]];
 
-      scan_modes(interface, fd);
-      scan_module(interface, fd);
+          for (moduleinfo::const_iterator m = module.begin(); m != module.end(); m++)
+            interface.setConfig(m->first, m->second);
+        }
+      }
 
       drvinfo.cmd = ETHTOOL_GDRVINFO;
       memset(&ifr, 0, sizeof(ifr));
@@ -823,7 +1442,7 @@ bool scan_network(hwNode & n)
           interface.setBusInfo(guessBusInfo(drvinfo.bus_info));
       }
 
-      if(sysfs::entry::byClass("net", interface.getLogicalName()).isvirtual())
+      if(kind == NET_VIRTUAL)
         interface.addCapability("logical", _("Logical interface"));
 
       existing = n.findChildByBusInfo(interface.getBusInfo());
@@ -841,7 +1460,7 @@ bool scan_network(hwNode & n)
       }
       else
       {
-        existing = n.findChildByLogicalName(interface.getLogicalName());
+        existing = known.count(interface.getLogicalName())?n.findChildByLogicalName(interface.getLogicalName()):NULL;
         if (existing)
         {
           existing->merge(interface);
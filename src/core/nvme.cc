@@ -2,28 +2,265 @@
 #include "hw.h"
 #include "sysfs.h"
 #include "osutils.h"
+#include "options.h"
 #include "nvme.h"
 #include "disk.h"
 #include "heuristics.h"
 
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <dirent.h>
 #include <vector>
+#include <map>
 #include <iostream>
 
 __ID("@(#) $Id$");
 
 using namespace std;
 
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_IDENTIFY_NAMESPACE 0x00
+#define NVME_IDENTIFY_CONTROLLER 0x01
+#define NVME_IDENTIFY_SIZE 4096
+#define NVME_TIMEOUT 5000                         // ms
+
+#define SYS_CLASS_NVMESUBSYS "/sys/class/nvme-subsystem"
+
+struct nvme_passthru                              // from linux/nvme_ioctl.h
+{
+  uint8_t opcode;
+  uint8_t flags;
+  uint16_t rsvd1;
+  uint32_t nsid;
+  uint32_t cdw2;
+  uint32_t cdw3;
+  uint64_t metadata;
+  uint64_t addr;
+  uint32_t metadata_len;
+  uint32_t data_len;
+  uint32_t cdw10;
+  uint32_t cdw11;
+  uint32_t cdw12;
+  uint32_t cdw13;
+  uint32_t cdw14;
+  uint32_t cdw15;
+  uint32_t timeout_ms;
+  uint32_t result;
+};
+
+#ifndef NVME_IOCTL_ADMIN_CMD
+#define NVME_IOCTL_ADMIN_CMD _IOWR('N', 0x41, struct nvme_passthru)
+#endif
+
+static bool nvme_identify(int fd, uint32_t nsid, uint8_t cns, uint8_t * buffer)
+{
+  struct nvme_passthru cmd;
+
+  memset(&cmd, 0, sizeof(cmd));
+  memset(buffer, 0, NVME_IDENTIFY_SIZE);
+  cmd.opcode = NVME_ADMIN_IDENTIFY;
+  cmd.nsid = nsid;
+  cmd.addr = (uint64_t)(uintptr_t)buffer;
+  cmd.data_len = NVME_IDENTIFY_SIZE;
+  cmd.cdw10 = cns;
+  cmd.timeout_ms = NVME_TIMEOUT;
+
+  return ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd) == 0;
+}
+
+static string nvme_string(const uint8_t * s, size_t length)
+{
+  return hw::strip(string((const char*)s, strnlen((const char*)s, length)));
+}
+
+/*
+ * Identify Controller: model, serial, firmware slots, namespace sharing
+ */
+static bool identify_controller(int fd, hwNode & device)
+{
+  uint8_t id[NVME_IDENTIFY_SIZE];
+
+  if ((fd < 0) || !nvme_identify(fd, 0, NVME_IDENTIFY_CONTROLLER, id))
+    return false;
+
+  uint32_t version = le_long(id + 80);
+  uint8_t cmic = id[76];
+  uint8_t frmw = id[260];
+  unsigned long long tnvmcap = le_longlong(id + 280);
+
+  if (device.getProduct() == "")
+    device.setProduct(nvme_string(id + 24, 40));
+  if (device.getSerial() == "")
+    device.setSerial(nvme_string(id + 4, 20));
+  if (device.getVersion() == "")
+    device.setVersion(nvme_string(id + 64, 8));
+  if (version)
+    device.setConfig("nvmespec", tostring(version >> 16) + "." + tostring((version >> 8) & 0xff));
+  if ((frmw >> 1) & 0x7)
+    device.setConfig("firmwareslots", (frmw >> 1) & 0x7);
+  if (frmw & 1)
+    device.addCapability("firmware-readonly", "First firmware slot is read-only");
+  if (cmic & 2)
+    device.addCapability("multicontroller", "Subsystem may have several controllers");
+  if (tnvmcap && !le_longlong(id + 288))
+    device.setCapacity(tnvmcap);
+  device.setConfig("namespaces", le_long(id + 516));
+
+  return true;
+}
+
+/*
+ * Identify Namespace: size, LBA formats and sharing, without opening the
+ * block device
+ */
+static bool identify_namespace(int fd, uint32_t nsid, hwNode & ns)
+{
+  uint8_t id[NVME_IDENTIFY_SIZE];
+
+  if ((fd < 0) || (nsid == 0) || !nvme_identify(fd, nsid, NVME_IDENTIFY_NAMESPACE, id))
+    return false;
+
+  unsigned long long nsze = le_longlong(id);
+  unsigned int nlbaf = id[25] + 1;
+  unsigned int flbas = id[26] & 0xf;
+  uint8_t nmic = id[30];
+  string formats = "";
+
+  if (nsze == 0)
+    return false;                                 // inactive namespace
+
+  if (nlbaf > 16)
+    nlbaf = 16;
+  for (unsigned int i = 0; i < nlbaf; i++)
+  {
+    uint8_t lbads = id[128 + 4*i + 2];
+
+    if ((lbads < 9) || (lbads > 31))
+      continue;
+    if (formats != "")
+      formats += ",";
+    formats += tostring(1ULL << lbads);
+  }
+  if (formats != "")
+    ns.setConfig("lbaformats", formats);
+
+  uint8_t lbads = id[128 + 4*flbas + 2];
+  if ((lbads >= 9) && (lbads <= 31))
+  {
+    ns.setConfig("logicalsectorsize", 1ULL << lbads);
+    ns.setSize(nsze << lbads);
+  }
+  if (nmic & 1)
+    ns.addCapability("shared", "Namespace may be attached to several controllers");
+
+  return true;
+}
+
+/*
+ * NVMe topology: subsystems, their controllers and (with native multipath)
+ * the shared namespaces (/dev/nvme<subsystem>n<nsid>) their paths belong to.
+ * Namespaces are reported under their subsystem, which is attached to the
+ * first of its controllers; each path (nvme<controller>c<path>n<nsid>) is
+ * recorded on both the namespace and the controller it goes through.
+ */
+struct nvme_subsystem
+{
+  string name;
+  vector < string > controllers;
+  map < unsigned long, string > namespaces;       // nsid -> head
+  string owner;                                   // controller the subsystem is reported under
+  vector < hwNode > disks;
+  map < string, size_t > index;                   // logical name -> disk
+};
+
+static void add_path(hwNode & node, const string & path)
+{
+  string paths = node.getConfig("paths");
+
+  node.setConfig("paths", (paths == "") ? path : paths + "," + path);
+}
+
+static string controllerlist(const vector < string > & controllers)
+{
+  string result = "";
+
+  for (size_t i = 0; i < controllers.size(); i++)
+    result += (i ? "," : "") + controllers[i];
+
+  return result;
+}
+
+static void nvme_topology(map < string, nvme_subsystem > & subsystems,
+  map < string, string > & controllers)
+{
+  struct dirent **namelist = NULL;
+  int count = scandir(SYS_CLASS_NVMESUBSYS, &namelist, NULL, alphasort);
+
+  if (count < 0)
+    return;
+
+  for (int i = 0; i < count; i++)
+  {
+    if (namelist[i]->d_name[0] == '.')
+    {
+      free(namelist[i]);
+      continue;
+    }
+
+    string dir = string(SYS_CLASS_NVMESUBSYS"/") + namelist[i]->d_name;
+    nvme_subsystem & subsys = subsystems[namelist[i]->d_name];
+    struct dirent **entries = NULL;
+    int m = scandir(dir.c_str(), &entries, NULL, alphasort);
+
+    subsys.name = namelist[i]->d_name;
+    for (int j = 0; j < m; j++)
+    {
+      unsigned int instance, nsid;
+      char dummy;
+      const char * name = entries[j]->d_name;
+
+      if (sscanf(name, "nvme%un%u%c", &instance, &nsid, &dummy) == 2)
+        subsys.namespaces[get_number(dir + "/" + name + "/nsid", nsid)] = name;
+      else
+      if (sscanf(name, "nvme%u%c", &instance, &dummy) == 1)
+      {
+        subsys.controllers.push_back(name);
+        controllers[name] = subsys.name;
+      }
+      free(entries[j]);
+    }
+    if (m >= 0)
+      free(entries);
+    free(namelist[i]);
+  }
+  free(namelist);
+}
+
 bool scan_nvme(hwNode & n)
 {
   vector < sysfs::entry > entries = sysfs::entries_by_class("nvme");
+  map < string, nvme_subsystem > subsystems;
+  map < string, string > controllers;             // controller -> subsystem
 
   if (entries.empty())
     return false;
 
+  nvme_topology(subsystems, controllers);
+
   for (vector < sysfs::entry >::iterator it = entries.begin();
       it != entries.end(); ++it)
   {
     const sysfs::entry & e = *it;
+    nvme_subsystem * subsys = NULL;
+
+    if (controllers.find(e.name()) != controllers.end())
+      subsys = &subsystems[controllers[e.name()]];
 
     hwNode *device = n.findChildByBusInfo(e.leaf().businfo());
     if(!device) {
@@ -38,31 +275,85 @@ bool scan_nvme(hwNode & n)
     device->setVersion(e.string_attr("firmware_rev"));
     device->setConfig("nqn",e.string_attr("subsysnqn"));
     device->setConfig("state",e.string_attr("state"));
+    if (subsys)
+    {
+      device->setConfig("subsystem", subsys->name);
+      if (subsys->owner == "")
+        subsys->owner = device->getLogicalName();
+    }
     device->setModalias(e.modalias());
 
+    int fd = -1;
+    if (exists("/dev/"+e.name()))
+      fd = open(("/dev/"+e.name()).c_str(), O_RDONLY);
+    identify_controller(fd, *device);
+
     vector < sysfs::entry > namespaces = e.devices();
     for(vector < sysfs::entry >::iterator i = namespaces.begin(); i != namespaces.end(); ++i)
     {
       const sysfs::entry & n = *i;
+      unsigned long nsid = strtoul(n.string_attr("nsid").c_str(), NULL, 10);
+      string logicalname = n.name();
+
+      // with native NVMe multipath, nvme<controller>c<path>n<nsid> are just
+      // paths to the subsystem's shared nvme<subsystem>n<nsid>
+      if (subsys && (subsys->namespaces.find(nsid) != subsys->namespaces.end()))
+      {
+        logicalname = subsys->namespaces[nsid];
+        add_path(*device, n.name());
+      }
+      if (subsys && (subsys->index.find(logicalname) != subsys->index.end()))
+      {                                           // already found through another path
+        add_path(subsys->disks[subsys->index[logicalname]], n.name());
+        continue;
+      }
 
       hwNode ns("namespace", hw::disk);
       ns.claim();
       ns.setBusInfo(guessBusInfo(n.name()));
       ns.setPhysId(n.string_attr("nsid"));
       ns.setDescription("NVMe disk");
-      // try to guess correct logical name when native NVMe multipath is enabled for NVMe devices
-      if(!exists("/dev/"+n.name()) &&
-		      uppercase(hw::strip(get_string("/sys/module/nvme_core/parameters/multipath")))=="Y" &&
-		      matches(n.name(), "^nvme[0-9]+c[0-9]+n[0-9]+$")) {
-	      size_t indexc = n.name().find("c");
-	      size_t indexn = n.name().find("n", indexc);
-	      ns.setLogicalName(n.name().erase(indexc, indexn - indexc));
-      } else
-	      ns.setLogicalName(n.name());
+      ns.setLogicalName(logicalname);
       ns.setConfig("wwid",n.string_attr("wwid"));
-      scan_disk(ns);
-      device->addChild(ns);
+      if (identify_namespace(fd, nsid, ns) &&
+          !enabled("nvme-partitions"))
+        ns.addHint("icon", string("disc"));      // no need to open the namespace
+      else
+        scan_disk(ns);
+      if (subsys)
+      {
+        if (logicalname != n.name())
+          add_path(ns, n.name());
+        subsys->index[logicalname] = subsys->disks.size();
+        subsys->disks.push_back(ns);
+      }
+      else
+        device->addChild(ns);
     }
+
+    if (fd >= 0)
+      close(fd);
+  }
+
+  for (map < string, nvme_subsystem >::iterator it = subsystems.begin();
+      it != subsystems.end(); ++it)
+  {
+    nvme_subsystem & subsys = it->second;
+    hwNode *owner = (subsys.owner != "") ? n.findChildByLogicalName(subsys.owner) : NULL;
+
+    if (!owner)
+      continue;
+
+    hwNode node("subsystem", hw::storage);
+
+    node.claim();
+    node.setDescription("NVMe subsystem");
+    node.setConfig("subsystem", subsys.name);
+    node.setConfig("nqn", hw::strip(get_string(string(SYS_CLASS_NVMESUBSYS"/") + subsys.name + "/subsysnqn")));
+    node.setConfig("controllers", controllerlist(subsys.controllers));
+    for (size_t i = 0; i < subsys.disks.size(); i++)
+      node.addChild(subsys.disks[i]);
+    owner->addChild(node);
   }
 
   return true;
@@ -15,6 +15,7 @@
 #include <map>
 
 #include <stdlib.h>
+#include <fnmatch.h>
 
 using namespace std;
 
@@ -22,6 +23,7 @@ __ID("@(#) $Id$");
 
 static set < string > disabled_tests;
 static set < string > visible_classes;
+static vector < string > net_filters;
 static map < string, string > aliases;
 
 void alias(const char * aname, const char * cname)
@@ -106,6 +108,21 @@ char *argv[])
 
       remove_option_argument(i, argc, argv);
     }
+    else if (option == "-net-filter")
+    {
+      vector < string > patterns;
+
+      if (i + 1 >= argc)
+        return false;                             // -net-filter requires an argument
+
+      splitlines(argv[i + 1], patterns, ',');
+
+      for (unsigned int j = 0; j < patterns.size(); j++)
+        if (patterns[j] != "")
+          net_filters.push_back(patterns[j]);
+
+      remove_option_argument(i, argc, argv);
+    }
     else
       i++;
   }
@@ -147,3 +164,32 @@ bool visible(const char *c)
     return true;
   return visible_classes.find(getcname(c)) != visible_classes.end();
 }
+
+
+/*
+ * -net-filter patterns are shell wildcards; a pattern starting with '!'
+ * excludes the interfaces it matches, the others restrict the scan to the
+ * interfaces they match
+ */
+bool netfilter(const char *interface)
+{
+  bool restricted = false;
+  bool included = false;
+
+  for (unsigned int i = 0; i < net_filters.size(); i++)
+  {
+    if (net_filters[i][0] == '!')
+    {
+      if (fnmatch(net_filters[i].c_str() + 1, interface, 0) == 0)
+        return false;
+    }
+    else
+    {
+      restricted = true;
+      if (fnmatch(net_filters[i].c_str(), interface, 0) == 0)
+        included = true;
+    }
+  }
+
+  return !restricted || included;
+}
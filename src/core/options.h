@@ -12,5 +12,6 @@ void enable(const char * option);
 void disable(const char * option);
 
 bool visible(const char * c);
+bool netfilter(const char * interface);
 
 #endif
@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <wchar.h>
 #include <sys/utsname.h>
+#include <pthread.h>
 #ifndef MINOR
 #include <linux/kdev_t.h>
 #endif
@@ -879,3 +880,52 @@ string platform()
   else
     return string(u.machine);
 }
+
+struct parallel_job
+{
+  void (*work)(size_t, void *);
+  void * data;
+  size_t count;
+  size_t next;
+};
+
+static void * parallel_worker(void * arg)
+{
+  parallel_job * job = (parallel_job*)arg;
+  size_t i = 0;
+
+  while((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+    job->work(i, job->data);
+
+  return NULL;
+}
+
+/*
+ * Call work(i, data) for every i in [0, count) using at most maxthreads
+ * threads (including the caller's), and wait for all of them. Work items
+ * must not rely on the current directory (pushd/popd aren't thread-safe).
+ */
+void parallelize(size_t count, void (*work)(size_t, void *), void * data, unsigned int maxthreads)
+{
+  parallel_job job;
+  vector < pthread_t > threads;
+
+  job.work = work;
+  job.data = data;
+  job.count = count;
+  job.next = 0;
+
+  for(unsigned int i = 1; (i < maxthreads) && (i < count); i++)
+  {
+    pthread_t thread;
+
+    if(pthread_create(&thread, NULL, parallel_worker, &job) != 0)
+      break;                                      // we'll just have less help
+    threads.push_back(thread);
+  }
+
+  parallel_worker(&job);
+
+  for(unsigned int i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+}
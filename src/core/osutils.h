@@ -63,4 +63,6 @@ int open_dev(dev_t dev, int dev_type, const std::string & name="");
 
 std::string platform();
 std::string operating_system();
+
+void parallelize(size_t count, void (*work)(size_t, void *), void * data, unsigned int maxthreads = 8);
 #endif
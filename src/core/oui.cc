@@ -0,0 +1,309 @@
+/*
+ * oui.cc
+ *
+ * MAC address vendor lookup from the IEEE registries (oui.txt) and
+ * Wireshark's manuf.txt, which also lists MA-M (28-bit) and MA-S (36-bit)
+ * assignments.
+ *
+ * The files are mapped once and indexed by prefix length, so that each
+ * lookup is just a few binary searches (longest prefix first).
+ */
+
+#include "version.h"
+#include "config.h"
+#include "oui.h"
+#include "osutils.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <list>
+#include <algorithm>
+
+__ID("@(#) $Id$");
+
+using namespace std;
+
+#define MANUF_PATH DATADIR"/manuf.txt:/usr/share/lshw/manuf.txt:/usr/local/share/manuf.txt:/usr/share/manuf.txt:/etc/manuf.txt:/usr/share/wireshark/manuf"
+#define OUI_PATH DATADIR"/oui.txt:/usr/share/lshw/oui.txt:/usr/local/share/oui.txt:/usr/share/oui.txt:/etc/oui.txt:/usr/share/hwdata/oui.txt:/usr/share/misc/oui.txt"
+
+#define OUI_TIERS 3
+
+static const unsigned int tierbits[OUI_TIERS] = { 36, 28, 24 };  // MA-S, MA-M, MA-L
+
+struct oui_entry
+{
+  uint64_t prefix;
+  const char * name;                              // points into the mapped file
+  size_t length;
+
+  bool operator <(const oui_entry & e) const
+  {
+    return prefix < e.prefix;
+  }
+};
+
+static vector < oui_entry > tiers[OUI_TIERS];
+static list < string > buffers;                   // compressed files, once inflated
+static bool loaded = false;
+
+/*
+ * used when no database is installed (and for locally administered
+ * addresses, which aren't registered)
+ */
+static const struct
+{
+  uint32_t oui;
+  const char * vendor;
+} builtin[] =
+{
+  { 0x000569, "VMware, Inc." },
+  { 0x000C29, "VMware, Inc." },
+  { 0x005056, "VMware, Inc." },
+  { 0x001C42, "Parallels, Inc." },
+  { 0x0A0027, "VirtualBox" },
+  { 0, NULL }
+};
+
+static const char * hypervisors[] =
+{
+  "VMware",
+  "Parallels",
+  "VirtualBox",
+  NULL
+};
+
+static int hexdigit(char c)
+{
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+  if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F'))
+    return c - 'A' + 10;
+  return -1;
+}
+
+static const char * skipspaces(const char * p, const char * end)
+{
+  while ((p < end) && ((*p == ' ') || (*p == '\t')))
+    p++;
+  return p;
+}
+
+static void add_entry(uint64_t address, unsigned int bits, const char * name, const char * end)
+{
+  name = skipspaces(name, end);
+  while ((end > name) && ((unsigned char)end[-1] <= ' '))
+    end--;
+  if (end <= name)
+    return;
+
+  for (unsigned int t = 0; t < OUI_TIERS; t++)
+    if (tierbits[t] == bits)
+    {
+      oui_entry e;
+
+      e.prefix = address >> (48 - bits);
+      e.name = name;
+      e.length = end - name;
+      tiers[t].push_back(e);
+    }
+}
+
+/*
+ * manuf.txt: "00:1B:C5:00:10:00/36<TAB>OpenRBco<TAB>OpenRB.com, Direct SIA"
+ * (3 bytes and no mask for MA-L)
+ */
+static bool parse_manuf(const char * p, const char * end)
+{
+  uint64_t address = 0;
+  unsigned int bytes = 0;
+  unsigned int bits = 0;
+
+  while ((bytes < 6) && (p + 1 < end) && (hexdigit(p[0]) >= 0) && (hexdigit(p[1]) >= 0))
+  {
+    address = (address << 8) | (hexdigit(p[0]) << 4) | hexdigit(p[1]);
+    bytes++;
+    p += 2;
+    if ((p < end) && (*p == ':'))
+      p++;
+    else
+      break;
+  }
+  if ((bytes != 3) && (bytes != 6))
+    return false;
+  address <<= 8 * (6 - bytes);
+  bits = 8 * bytes;
+
+  if ((p < end) && (*p == '/'))
+    for (bits = 0, p++; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+      bits = 10 * bits + (*p - '0');
+  if ((p >= end) || (*p != '\t'))
+    return false;
+
+  const char * name = ++p;                        // short name
+  const char * tab = (const char *)memchr(p, '\t', end - p);
+  if (tab)                                        // prefer the full name
+    add_entry(address, bits, tab + 1, end);
+  else
+    add_entry(address, bits, name, end);
+
+  return true;
+}
+
+/*
+ * oui.txt: "E043DB     (base 16)<TAB><TAB>Shenzhen ViewAt Technology Co.,Ltd."
+ */
+static bool parse_oui(const char * p, const char * end)
+{
+  uint64_t address = 0;
+  const char * base16 = "(base 16)";
+
+  if (end - p < 6)
+    return false;
+  for (int i = 0; i < 6; i++)
+  {
+    if (hexdigit(p[i]) < 0)
+      return false;
+    address = (address << 4) | hexdigit(p[i]);
+  }
+  p = skipspaces(p + 6, end);
+  if ((size_t)(end - p) < strlen(base16) || (strncmp(p, base16, strlen(base16)) != 0))
+    return false;
+
+  add_entry(address << 24, 24, p + strlen(base16), end);
+  return true;
+}
+
+static const char * mapfile(const string & name, size_t & size)
+{
+  struct stat buf;
+  int fd = open(name.c_str(), O_RDONLY);
+
+  size = 0;
+  if (fd >= 0)
+  {
+    void * data = MAP_FAILED;
+
+    if ((fstat(fd, &buf) == 0) && (buf.st_size > 0))
+      data = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data != MAP_FAILED)
+    {
+      size = buf.st_size;
+      return (const char *)data;
+    }
+  }
+
+  vector < string > lines;                        // maybe compressed
+  if (!loadfile(name, lines) || lines.empty())
+    return NULL;
+
+  buffers.push_back("");
+  for (size_t i = 0; i < lines.size(); i++)
+    buffers.back() += lines[i] + "\n";
+  size = buffers.back().length();
+  return buffers.back().data();
+}
+
+static bool load_file(const char * path, bool (*parse)(const char *, const char *))
+{
+  vector < string > filenames;
+
+  splitlines(path, filenames, ':');
+  for (size_t i = 0; i < filenames.size(); i++)
+  {
+    size_t size = 0;
+    const char * data = mapfile(filenames[i], size);
+    const char * end = data + size;
+
+    if (!data)
+      continue;
+
+    for (const char * line = data; line < end; )
+    {
+      const char * eol = (const char *)memchr(line, '\n', end - line);
+
+      if (!eol)
+        eol = end;
+      if (*line != '#')
+        parse(line, eol);
+      line = eol + 1;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+static bool same_prefix(const oui_entry & a, const oui_entry & b)
+{
+  return a.prefix == b.prefix;
+}
+
+static bool load_ouidb()
+{
+  load_file(MANUF_PATH, parse_manuf);
+  load_file(OUI_PATH, parse_oui);                 // only fills the gaps
+
+  for (unsigned int t = 0; t < OUI_TIERS; t++)
+  {
+    stable_sort(tiers[t].begin(), tiers[t].end());
+    tiers[t].erase(unique(tiers[t].begin(), tiers[t].end(), same_prefix), tiers[t].end());
+  }
+
+  return true;
+}
+
+bool oui_lookup(const unsigned char * mac, string & vendor)
+{
+  uint64_t address = 0;
+
+  if (!loaded)
+    loaded = load_ouidb();
+
+  for (int i = 0; i < 6; i++)
+    address = (address << 8) | mac[i];
+
+  if (!(mac[0] & 0x02))                           // globally administered only
+    for (unsigned int t = 0; t < OUI_TIERS; t++)
+    {
+      oui_entry key;
+
+      key.prefix = address >> (48 - tierbits[t]);
+      vector < oui_entry >::const_iterator e = lower_bound(tiers[t].begin(), tiers[t].end(), key);
+      if ((e != tiers[t].end()) && (e->prefix == key.prefix))
+      {
+        vendor = string(e->name, e->length);
+        return true;
+      }
+    }
+
+  for (int i = 0; builtin[i].vendor; i++)
+    if (builtin[i].oui == (address >> 24))
+    {
+      vendor = builtin[i].vendor;
+      return true;
+    }
+
+  return false;
+}
+
+bool oui_virtual(const unsigned char * mac)
+{
+  string vendor = "";
+
+  if (!oui_lookup(mac, vendor))
+    return false;
+
+  for (int i = 0; hypervisors[i]; i++)
+    if (vendor.compare(0, strlen(hypervisors[i]), hypervisors[i]) == 0)
+      return true;
+
+  return false;
+}
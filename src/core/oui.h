@@ -0,0 +1,9 @@
+#ifndef _OUI_H_
+#define _OUI_H_
+
+#include <string>
+
+bool oui_lookup(const unsigned char * mac, std::string & vendor);
+bool oui_virtual(const unsigned char * mac);
+
+#endif
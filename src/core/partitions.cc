@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <pthread.h>
 
 __ID("@(#) $Id$");
 
@@ -112,6 +113,7 @@ struct efipartition
 
 #define EFI_PMBR_OSTYPE_EFI 0xee
 #define GPT_HEADER_SIGNATURE 0x5452415020494645LL /* "EFI PART" */
+#define GPT_MAX_TABLE_SIZE (1024*1024)            /* sanity limit for the partition entry array */
 
 struct dospartition
 {
@@ -291,7 +293,7 @@ static struct systypes dos_sys_types[] =
   { 0, NULL, NULL, NULL }
 };
 
-static unsigned int lastlogicalpart = 5;
+static __thread unsigned int lastlogicalpart = 5; // per thread: disks are probed concurrently
 
 static string partitionname(string disk, unsigned int n)
 {
@@ -359,7 +361,7 @@ static bool is_extended(unsigned char type)
 
 static bool read_dospartition(source & s, unsigned short i, dospartition & p)
 {
-  static unsigned char buffer[BLOCKSIZE];
+  unsigned char buffer[BLOCKSIZE];
   unsigned char flags = 0;
 
   if(readlogicalblocks(s, buffer, 0, 1)!=1)       // read the first sector
@@ -504,12 +506,128 @@ hwNode & partition)
 }
 
 
-#define UNUSED_ENTRY_GUID \
-((efi_guid_t) \
-{ \
-  0x00000000, 0x0000, 0x0000, 0x00, 00, \
-  { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } \
-})
+static const uint8_t unused_entry[16] = { 0 };   // type GUID of unused GPT entries
+
+/*
+ * well-known partition types, with their GUIDs as stored on disk (the first
+ * three fields are little-endian) so that entries can be matched in place
+ */
+static const struct gpt_type
+{
+  uint8_t guid[16];
+  const char * description;
+  const char * vendor;
+  const char * capabilities;                      // space-separated
+} gpt_types[] =
+{
+  { { 0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11, 0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b },
+    "System partition", "EFI", "boot" },          // C12A7328-F81F-11D2-BA4B-00A0C93EC93B
+  { { 0x41, 0xee, 0x4d, 0x02, 0xe7, 0x33, 0xd3, 0x11, 0x9d, 0x69, 0x00, 0x08, 0xc7, 0x81, 0xf3, 0x9f },
+    "MBR partition scheme", "EFI", "nofs" },      // 024DEE41-33E7-11D3-9D69-0008C781F39F
+  { { 0x48, 0x61, 0x68, 0x21, 0x49, 0x64, 0x6f, 0x6e, 0x74, 0x4e, 0x65, 0x65, 0x64, 0x45, 0x46, 0x49 },
+    "BIOS Boot partition", "EFI", "nofs" },       // 21686148-6449-6E6F-744E-656564454649
+  { { 0x6d, 0xfd, 0x57, 0x06, 0xab, 0xa4, 0xc4, 0x43, 0x84, 0xe5, 0x09, 0x33, 0xc8, 0x4b, 0x4f, 0x4f },
+    "swap partition", "Linux", "nofs" },          // 0657FD6D-A4AB-43C4-84E5-0933C84B4F4F
+  { { 0x0f, 0x88, 0x9d, 0xa1, 0xfc, 0x05, 0x3b, 0x4d, 0xa0, 0x06, 0x74, 0x3f, 0x0f, 0x84, 0x91, 0x1e },
+    "RAID partition", "Linux", "multi" },         // A19D880F-05FC-4D3B-A006-743F0F84911E
+  { { 0x79, 0xd3, 0xd6, 0xe6, 0x07, 0xf5, 0xc2, 0x44, 0xa2, 0x3c, 0x23, 0x8f, 0x2a, 0x3d, 0xf9, 0x28 },
+    "LVM Physical Volume", "Linux", "multi" },    // E6D6D379-F507-44C2-A23C-238F2A3DF928
+  { { 0x39, 0x33, 0xa6, 0x8d, 0x07, 0x00, 0xc0, 0x60, 0xc4, 0x36, 0x08, 0x3a, 0xc8, 0x23, 0x09, 0x08 },
+    "reserved partition", "Linux", "nofs" },      // 8DA63339-0007-60C0-C436-083AC8230908
+  { { 0x1e, 0x4c, 0x89, 0x75, 0xeb, 0x3a, 0xd3, 0x11, 0xb7, 0xc1, 0x7b, 0x03, 0xa0, 0x00, 0x00, 0x00 },
+    "data partition", "HP-UX", "" },              // 75894C1E-3AEB-11D3-B7C1-7B03A0000000
+  { { 0x28, 0xe7, 0xa1, 0xe2, 0xe3, 0x32, 0xd6, 0x11, 0xa6, 0x82, 0x7b, 0x03, 0xa0, 0x00, 0x00, 0x00 },
+    "service partition", "HP-UX", "nofs boot" },  // E2A1E728-32E3-11D6-A682-7B03A0000000
+  { { 0x00, 0x53, 0x46, 0x48, 0x00, 0x00, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "Apple HFS+ partition", "Mac OS X", "" },     // 48465300-0000-11AA-AA11-00306543ECAC
+  { { 0xef, 0x57, 0x34, 0x7c, 0x00, 0x00, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "Apple APFS partition", "Mac OS X", "" },     // 7C3457EF-0000-11AA-AA11-00306543ECAC
+  { { 0xc3, 0x8c, 0x89, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "OS X ZFS partition or Solaris /usr partition", "Solaris", "" }, // 6A898CC3-1DD2-11B2-99A6-080020736631
+  { { 0x44, 0x49, 0x41, 0x52, 0x00, 0x00, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "RAID partition", "Mac OS X", "multi" },      // 52414944-0000-11AA-AA11-00306543ECAC
+  { { 0x44, 0x49, 0x41, 0x52, 0x4f, 0x5f, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "RAID partition (offline)", "Mac OS X", "multi offline" }, // 52414944-5F4F-11AA-AA11-00306543ECAC
+  { { 0x65, 0x62, 0x61, 0x4c, 0x00, 0x6c, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "Apple label", "Mac OS X", "nofs" },          // 4C616265-6C00-11AA-AA11-00306543ECAC
+  { { 0x6f, 0x63, 0x65, 0x52, 0x65, 0x76, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "recovery partition", "Apple TV", "nofs" },   // 5265636F-7665-11AA-AA11-00306543ECAC
+  { { 0x72, 0x6f, 0x74, 0x53, 0x67, 0x61, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "Apple Core Storage (File Vault)", "Mac OS X", "encrypted" }, // 53746F72-6167-11AA-AA11-00306543ECAC
+  { { 0x74, 0x6f, 0x6f, 0x42, 0x00, 0x00, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "boot partition", "Mac OS X", "boot" },       // 426F6F74-0000-11AA-AA11-00306543ECAC
+  { { 0x00, 0x53, 0x46, 0x55, 0x00, 0x00, 0xaa, 0x11, 0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac },
+    "UFS partition", "Mac OS X", "" },            // 55465300-0000-11AA-AA11-00306543ECAC
+  { { 0xb4, 0x7c, 0x6e, 0x51, 0xcf, 0x6e, 0xd6, 0x11, 0x8f, 0xf8, 0x00, 0x02, 0x2d, 0x09, 0x71, 0x2b },
+    "data partition", "FreeBSD", "" },            // 516E7CB4-6ECF-11D6-8FF8-00022D09712B
+  { { 0xb6, 0x7c, 0x6e, 0x51, 0xcf, 0x6e, 0xd6, 0x11, 0x8f, 0xf8, 0x00, 0x02, 0x2d, 0x09, 0x71, 0x2b },
+    "UFS partition", "FreeBSD", "" },             // 516E7CB6-6ECF-11D6-8FF8-00022D09712B
+  { { 0xba, 0x7c, 0x6e, 0x51, 0xcf, 0x6e, 0xd6, 0x11, 0x8f, 0xf8, 0x00, 0x02, 0x2d, 0x09, 0x71, 0x2b },
+    "ZFS partition", "FreeBSD", "" },             // 516E7CBA-6ECF-11D6-8FF8-00022D09712B
+  { { 0xb8, 0x7c, 0x6e, 0x51, 0xcf, 0x6e, 0xd6, 0x11, 0x8f, 0xf8, 0x00, 0x02, 0x2d, 0x09, 0x71, 0x2b },
+    "Vinum Volume Manager partition", "FreeBSD", "" }, // 516E7CB8-6ECF-11D6-8FF8-00022D09712B
+  { { 0xb5, 0x7c, 0x6e, 0x51, 0xcf, 0x6e, 0xd6, 0x11, 0x8f, 0xf8, 0x00, 0x02, 0x2d, 0x09, 0x71, 0x2b },
+    "swap partition", "FreeBSD", "nofs" },        // 516E7CB5-6ECF-11D6-8FF8-00022D09712B
+  { { 0x9d, 0x6b, 0xbd, 0x83, 0x41, 0x7f, 0xdc, 0x11, 0xbe, 0x0b, 0x00, 0x15, 0x60, 0xb8, 0x4f, 0x0f },
+    "boot partition", "FreeBSD", "boot" },        // 83BD6B9D-7F41-11DC-BE0B-001560B84F0F
+  { { 0xa2, 0xa0, 0xd0, 0xeb, 0xe5, 0xb9, 0x33, 0x44, 0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7 },
+    "data partition", "Windows", "" },            // EBD0A0A2-B9E5-4433-87C0-68B6B72699C7
+  { { 0xa4, 0xbb, 0x94, 0xde, 0xd1, 0x06, 0x40, 0x4d, 0xa1, 0x6a, 0xbf, 0xd5, 0x01, 0x79, 0xd6, 0xac },
+    "recovery environment", "Windows", "boot" },  // DE94BBA4-06D1-4D40-A16A-BFD50179D6AC
+  { { 0x90, 0xfc, 0xaf, 0x37, 0x7d, 0xef, 0x96, 0x4e, 0x91, 0xc3, 0x2d, 0x7a, 0xe0, 0x55, 0xb1, 0x74 },
+    "IBM GPFS partition", "Windows", "" },        // 37AFFC90-EF7D-4E96-91C3-2D7AE055B174
+  { { 0xaa, 0xc8, 0x08, 0x58, 0x8f, 0x7e, 0xe0, 0x42, 0x85, 0xd2, 0xe1, 0xe9, 0x04, 0x34, 0xcf, 0xb3 },
+    "LDM configuration", "Windows", "nofs" },     // 5808C8AA-7E8F-42E0-85D2-E1E90434CFB3
+  { { 0xa0, 0x60, 0x9b, 0xaf, 0x31, 0x14, 0x62, 0x4f, 0xbc, 0x68, 0x33, 0x11, 0x71, 0x4a, 0x69, 0xad },
+    "LDM data partition", "Windows", "multi" },   // AF9B60A0-1431-4F62-BC68-3311714A69AD
+  { { 0x16, 0xe3, 0xc9, 0xe3, 0x5c, 0x0b, 0xb8, 0x4d, 0x81, 0x7d, 0xf9, 0x2d, 0xf0, 0x02, 0x15, 0xae },
+    "reserved partition", "Windows", "nofs" },    // E3C9E316-0B5C-4DB8-817D-F92DF00215AE
+  { { 0x5d, 0x2a, 0x3a, 0xfe, 0x32, 0x4f, 0xa7, 0x41, 0xb7, 0x25, 0xac, 0xcc, 0x32, 0x85, 0xa3, 0x09 },
+    "kernel", "ChromeOS", "" },                   // FE3A2A5D-4F32-41A7-B725-ACCC3285A309
+  { { 0x02, 0xe2, 0xb8, 0x3c, 0x7e, 0x3b, 0xdd, 0x47, 0x8a, 0x3c, 0x7f, 0xf2, 0xa1, 0x3c, 0xfc, 0xec },
+    "root filesystem", "ChromeOS", "" },          // 3CB8E202-3B7E-47DD-8A3C-7FF2A13CFCEC
+  { { 0x3d, 0x75, 0x0a, 0x2e, 0x48, 0x9e, 0xb0, 0x43, 0x83, 0x37, 0xb1, 0x51, 0x92, 0xcb, 0x1b, 0x5e },
+    "reserved", "ChromeOS", "" },                 // 2E0A753D-9E48-43B0-8337-B15192CB1B5E
+  { { 0x45, 0xcb, 0x82, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "boot partition", "Solaris", "boot" },        // 6A82CB45-1DD2-11B2-99A6-080020736631
+  { { 0x4d, 0xcf, 0x85, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "root partition", "Solaris", "" },            // 6A85CF4D-1DD2-11B2-99A6-080020736631
+  { { 0x6f, 0xc4, 0x87, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "swap partition", "Solaris", "nofs" },        // 6A87C46F-1DD2-11B2-99A6-080020736631
+  { { 0x2b, 0x64, 0x8b, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "backup partition", "Solaris", "" },          // 6A8B642B-1DD2-11B2-99A6-080020736631
+  { { 0xe9, 0xf2, 0x8e, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "/var partition", "Solaris", "" },            // 6A8EF2E9-1DD2-11B2-99A6-080020736631
+  { { 0x39, 0xba, 0x90, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "/home partition", "Solaris", "" },           // 6A90BA39-1DD2-11B2-99A6-080020736631
+  { { 0xa5, 0x83, 0x92, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "alternate sector", "Solaris", "nofs" },      // 6A9283A5-1DD2-11B2-99A6-080020736631
+  { { 0x3b, 0x5a, 0x94, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "reserved partition", "Solaris", "" },        // 6A945A3B-1DD2-11B2-99A6-080020736631
+  { { 0xd1, 0x30, 0x96, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "reserved partition", "Solaris", "" },        // 6A9630D1-1DD2-11B2-99A6-080020736631
+  { { 0x67, 0x07, 0x98, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "reserved partition", "Solaris", "" },        // 6A980767-1DD2-11B2-99A6-080020736631
+  { { 0x7f, 0x23, 0x96, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "reserved partition", "Solaris", "" },        // 6A96237F-1DD2-11B2-99A6-080020736631
+  { { 0xc7, 0x2a, 0x8d, 0x6a, 0xd2, 0x1d, 0xb2, 0x11, 0x99, 0xa6, 0x08, 0x00, 0x20, 0x73, 0x66, 0x31 },
+    "reserved partition", "Solaris", "" },        // 6A8D2AC7-1DD2-11B2-99A6-080020736631
+  { { 0x32, 0x8d, 0xf4, 0x49, 0x0e, 0xb1, 0xdc, 0x11, 0xb9, 0x9b, 0x00, 0x19, 0xd1, 0x87, 0x96, 0x48 },
+    "swap partition", "NetBSD", "nofs" },         // 49F48D32-B10E-11DC-B99B-0019D1879648
+  { { 0x5a, 0x8d, 0xf4, 0x49, 0x0e, 0xb1, 0xdc, 0x11, 0xb9, 0x9b, 0x00, 0x19, 0xd1, 0x87, 0x96, 0x48 },
+    "FFS partition", "NetBSD", "" },              // 49F48D5A-B10E-11DC-B99B-0019D1879648
+  { { 0x82, 0x8d, 0xf4, 0x49, 0x0e, 0xb1, 0xdc, 0x11, 0xb9, 0x9b, 0x00, 0x19, 0xd1, 0x87, 0x96, 0x48 },
+    "LFS partition", "NetBSD", "" },              // 49F48D82-B10E-11DC-B99B-0019D1879648
+  { { 0xaa, 0x8d, 0xf4, 0x49, 0x0e, 0xb1, 0xdc, 0x11, 0xb9, 0x9b, 0x00, 0x19, 0xd1, 0x87, 0x96, 0x48 },
+    "RAID partition", "NetBSD", "multi" },        // 49F48DAA-B10E-11DC-B99B-0019D1879648
+  { { 0xc4, 0x19, 0xb5, 0x2d, 0x0f, 0xb1, 0xdc, 0x11, 0xb9, 0x9b, 0x00, 0x19, 0xd1, 0x87, 0x96, 0x48 },
+    "concatenated partition", "NetBSD", "multi" }, // 2DB519C4-B10F-11DC-B99B-0019D1879648
+  { { 0xec, 0x19, 0xb5, 0x2d, 0x0f, 0xb1, 0xdc, 0x11, 0xb9, 0x9b, 0x00, 0x19, 0xd1, 0x87, 0x96, 0x48 },
+    "encrypted partition", "NetBSD", "encrypted" }, // 2DB519EC-B10F-11DC-B99B-0019D1879648
+  { { 0x31, 0x53, 0x46, 0x42, 0xa3, 0x3b, 0xf1, 0x10, 0x80, 0x2a, 0x48, 0x61, 0x69, 0x6b, 0x75, 0x21 },
+    "BeFS partition", "Haiku", "" },              // 42465331-3BA3-10F1-802A-4861696B7521 (is it really used ?)
+  { { 0 }, NULL, NULL, NULL }
+};
 
 #define PARTITION_PRECIOUS 1
 #define PARTITION_READONLY (1LL << 60)
@@ -621,20 +739,47 @@ static uint32_t crc32_tab[] =
   0x2d02ef8dL
 };
 
+/* Slice-by-8: crc32_slice[k][b] is the CRC of byte b followed by k zero   */
+/* bytes, which lets us consume 8 bytes per step instead of 1.            */
+
+static uint32_t crc32_slice[8][256];
+static pthread_once_t crc32_slice_once = PTHREAD_ONCE_INIT;
+
+static void init_crc32_slice()
+{
+  for (int i = 0; i < 256; i++)
+  {
+    crc32_slice[0][i] = crc32_tab[i];
+    for (int k = 1; k < 8; k++)
+      crc32_slice[k][i] = (crc32_slice[k-1][i] >> 8) ^ crc32_tab[crc32_slice[k-1][i] & 0xff];
+  }
+}
+
 /* Return a 32-bit CRC of the contents of the buffer. */
 
 uint32_t
 __efi_crc32(const void *buf, unsigned long len, uint32_t seed)
 {
-  unsigned long i;
   uint32_t crc32val;
   const unsigned char *s = (const unsigned char *)buf;
 
+  pthread_once(&crc32_slice_once, init_crc32_slice);
+
   crc32val = seed;
-  for (i = 0;  i < len;  i ++)
+  for (; len >= 8; len -= 8, s += 8)
   {
+    uint32_t lo = crc32val ^ (s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t)s[3] << 24));
+
     crc32val =
-      crc32_tab[(crc32val ^ s[i]) & 0xff] ^
+      crc32_slice[7][lo & 0xff] ^ crc32_slice[6][(lo >> 8) & 0xff] ^
+      crc32_slice[5][(lo >> 16) & 0xff] ^ crc32_slice[4][lo >> 24] ^
+      crc32_slice[3][s[4]] ^ crc32_slice[2][s[5]] ^
+      crc32_slice[1][s[6]] ^ crc32_slice[0][s[7]];
+  }
+  for (; len > 0; len--, s++)
+  {
+    crc32val =
+      crc32_tab[(crc32val ^ *s) & 0xff] ^
       (crc32val >> 8);
   }
   return crc32val;
@@ -652,7 +797,7 @@ efi_crc32(const void *buf, unsigned long len)
 }
 
 
-static efi_guid_t read_efi_guid(uint8_t *buffer)
+static efi_guid_t read_efi_guid(const uint8_t *buffer)
 {
   efi_guid_t result;
 
@@ -669,17 +814,6 @@ static efi_guid_t read_efi_guid(uint8_t *buffer)
 }
 
 
-bool operator ==(const efi_guid_t & guid1, const efi_guid_t & guid2)
-{
-  return (guid1.time_low == guid2.time_low) &&
-    (guid1.time_mid == guid2.time_mid) &&
-    (guid1.time_hi_and_version == guid2.time_hi_and_version) &&
-    (guid1.clock_seq_hi_and_reserved == guid2.clock_seq_hi_and_reserved) &&
-    (guid1.clock_seq_low == guid2.clock_seq_low) &&
-    (memcmp(guid1.node, guid2.node, sizeof(guid1.node))==0);
-}
-
-
 static string tostring(const efi_guid_t & guid)
 {
   char buffer[50];
@@ -688,18 +822,80 @@ static string tostring(const efi_guid_t & guid)
   return string(buffer);
 }
 
-bool operator ==(const efi_guid_t & guid1, const string & guid2)
+/*
+ * reads a GPT header and checks that it can be used
+ */
+static bool read_gpt_header(source & s, unsigned long long lba, gpth & gpt_header)
 {
-  return strcasecmp(tostring(guid1).c_str(), guid2.c_str()) == 0;
+  uint8_t buffer[BLOCKSIZE];
+
+  if(readlogicalblocks(s, buffer, lba, 1)!=1)
+    return false;
+
+  gpt_header.Signature = le_longlong(buffer);
+  gpt_header.Revision = be_long(buffer + 0x8);    // big endian so that 1.0 -> 0x100
+  gpt_header.HeaderSize = le_long(buffer + 0xc);
+  gpt_header.HeaderCRC32 = le_long(buffer + 0x10);
+  gpt_header.MyLBA = le_longlong(buffer + 0x18);
+  gpt_header.AlternateLBA = le_longlong(buffer + 0x20);
+  gpt_header.FirstUsableLBA = le_longlong(buffer + 0x28);
+  gpt_header.LastUsableLBA = le_longlong(buffer + 0x30);
+  gpt_header.DiskGUID = read_efi_guid(buffer + 0x38);
+  gpt_header.PartitionEntryLBA = le_longlong(buffer + 0x48);
+  gpt_header.NumberOfPartitionEntries = le_long(buffer + 0x50);
+  gpt_header.SizeOfPartitionEntry = le_long(buffer + 0x54);
+  gpt_header.PartitionEntryArrayCRC32 = le_long(buffer + 0x58);
+
+                                                  // zero-out the CRC32 before re-calculating it
+  memset(buffer + 0x10, 0, sizeof(gpt_header.HeaderCRC32));
+  if(gpt_header.Signature != GPT_HEADER_SIGNATURE)
+    return false;
+
+  if(efi_crc32(buffer, 92) != gpt_header.HeaderCRC32)
+    return false;                                 // check CRC32
+
+  if((gpt_header.SizeOfPartitionEntry < 128) || (gpt_header.SizeOfPartitionEntry % 128 != 0))
+    return false;                                 // entries come in multiples of 128 bytes
+
+  if((unsigned long long)gpt_header.NumberOfPartitionEntries * gpt_header.SizeOfPartitionEntry > GPT_MAX_TABLE_SIZE)
+    return false;                                 // corrupted (or hostile) header
+
+  return true;
+}
+
+/*
+ * the partition entry array is parsed in place: it's usually already in the
+ * block cache, otherwise it's read in one go (into table, to be freed)
+ */
+static const uint8_t * read_gpt_entries(source & s, const gpth & gpt_header, uint8_t * & table, bool & valid)
+{
+  unsigned long long tablesize = (unsigned long long)gpt_header.NumberOfPartitionEntries * gpt_header.SizeOfPartitionEntry;
+  const uint8_t *partitions = (const uint8_t*)peeklogicalblocks(s, gpt_header.PartitionEntryLBA, (tablesize + BLOCKSIZE - 1)/BLOCKSIZE);
+
+  table = NULL;
+  if(!partitions)
+  {
+    table = (uint8_t*)malloc(tablesize + BLOCKSIZE);
+    if(!table)
+      return NULL;
+    if(readlogicalblocks(s, table, gpt_header.PartitionEntryLBA, (tablesize + BLOCKSIZE - 1)/BLOCKSIZE) <= 0)
+      memset(table, 0, tablesize + BLOCKSIZE);
+    partitions = table;
+  }
+
+  valid = (efi_crc32(partitions, tablesize) == gpt_header.PartitionEntryArrayCRC32);
+  return partitions;
 }
 
 static bool detect_gpt(source & s, hwNode & n)
 {
-  static uint8_t buffer[BLOCKSIZE];
-  static gpth gpt_header;
+  uint8_t buffer[BLOCKSIZE];
+  gpth gpt_header;
   uint32_t i = 0;
   char gpt_version[13];
-  uint8_t *partitions = NULL;
+  const uint8_t *partitions = NULL;
+  uint8_t *table = NULL;
+  bool primary = false, valid = false;
   uint8_t type;
 
   if(s.offset!=0)
@@ -720,31 +916,44 @@ static bool detect_gpt(source & s, hwNode & n)
       return false;                               // the EFI pseudo-partition must be the only partition
   }
 
-                                                  // read the second sector
-  if(readlogicalblocks(s, buffer, GPT_PRIMARY_HEADER_LBA, 1)!=1)
-    return false;                                 // (partition table header)
+                                                  // read the second sector (partition table header)
+  primary = read_gpt_header(s, GPT_PRIMARY_HEADER_LBA, gpt_header);
+  if(primary)
+    partitions = read_gpt_entries(s, gpt_header, table, valid);
 
-  gpt_header.Signature = le_longlong(buffer);
-  gpt_header.Revision = be_long(buffer + 0x8);    // big endian so that 1.0 -> 0x100
-  gpt_header.HeaderSize = le_long(buffer + 0xc);
-  gpt_header.HeaderCRC32 = le_long(buffer + 0x10);
-  gpt_header.MyLBA = le_longlong(buffer + 0x18);
-  gpt_header.AlternateLBA = le_longlong(buffer + 0x20);
-  gpt_header.FirstUsableLBA = le_longlong(buffer + 0x28);
-  gpt_header.LastUsableLBA = le_longlong(buffer + 0x30);
-  gpt_header.DiskGUID = read_efi_guid(buffer + 0x38);
-  gpt_header.PartitionEntryLBA = le_longlong(buffer + 0x48);
-  gpt_header.NumberOfPartitionEntries = le_long(buffer + 0x50);
-  gpt_header.SizeOfPartitionEntry = le_long(buffer + 0x54);
-  gpt_header.PartitionEntryArrayCRC32 = le_long(buffer + 0x58);
+  if(!valid)                                      // try the backup copy, at the end of the disk
+  {
+    gpth backup;
+    uint8_t *backuptable = NULL;
+    const uint8_t *backuppartitions = NULL;
+    bool backupvalid = false;
+    unsigned long long lba = primary?gpt_header.AlternateLBA:0;
+
+    if(!primary && (s.size > 0) && (s.blocksize > 0))
+      lba = s.size / s.blocksize - 1;
+    if((lba > GPT_PRIMARY_HEADER_LBA) && read_gpt_header(s, lba, backup))
+      backuppartitions = read_gpt_entries(s, backup, backuptable, backupvalid);
+
+    if(backuppartitions && (backupvalid || !partitions))
+    {
+      free(table);
+      table = backuptable;
+      partitions = backuppartitions;
+      gpt_header = backup;
+      valid = backupvalid;
+      n.setConfig("gpt", "backup");
+    }
+    else
+      free(backuptable);
+  }
 
-                                                  // zero-out the CRC32 before re-calculating it
-  memset(buffer + 0x10, 0, sizeof(gpt_header.HeaderCRC32));
-  if(gpt_header.Signature != GPT_HEADER_SIGNATURE)
+  if(!partitions)
+  {
+    free(table);
     return false;
-
-  if(efi_crc32(buffer, 92) != gpt_header.HeaderCRC32)
-    return false;                                 // check CRC32
+  }
+  if(!valid)                                      // report what we have anyway
+    n.setConfig("gpt", "crc mismatch");
 
   snprintf(gpt_version, sizeof(gpt_version), "%d.%02d", (gpt_header.Revision >> 8), (gpt_header.Revision & 0xff));
 
@@ -754,362 +963,47 @@ static bool detect_gpt(source & s, hwNode & n)
   n.setHandle("GUID:" + tostring(gpt_header.DiskGUID));
   n.addHint("guid", tostring(gpt_header.DiskGUID));
 
-  partitions = (uint8_t*)malloc(gpt_header.NumberOfPartitionEntries * gpt_header.SizeOfPartitionEntry + BLOCKSIZE);
-  if(!partitions)
-    return false;
-  memset(partitions, 0, gpt_header.NumberOfPartitionEntries * gpt_header.SizeOfPartitionEntry + BLOCKSIZE);
-  readlogicalblocks(s, partitions,
-    gpt_header.PartitionEntryLBA,
-    (gpt_header.NumberOfPartitionEntries * gpt_header.SizeOfPartitionEntry)/BLOCKSIZE + 1);
-
   for(i=0; i<gpt_header.NumberOfPartitionEntries; i++)
   {
-    hwNode partition("volume", hw::volume);
-    efipartition p;
-
-    p.PartitionTypeGUID = read_efi_guid(partitions + gpt_header.SizeOfPartitionEntry * i);
-    p.PartitionGUID = read_efi_guid(partitions + gpt_header.SizeOfPartitionEntry * i + 0x10);
-    p.StartingLBA = le_longlong(partitions + gpt_header.SizeOfPartitionEntry * i + 0x20);
-    p.EndingLBA = le_longlong(partitions + gpt_header.SizeOfPartitionEntry * i + 0x28);
-    p.Attributes = le_longlong(partitions + gpt_header.SizeOfPartitionEntry * i + 0x30);
-    for(int j=0; j<36; j++)
-    {
-      wchar_t c = le_short(partitions + gpt_header.SizeOfPartitionEntry * i + 0x38 + 2*j);
-      if(!c)
-        break;
-      else
-        p.PartitionName += utf8(c);
-    }
+    const uint8_t *entry = partitions + gpt_header.SizeOfPartitionEntry * i;
 
-    if(!(p.PartitionTypeGUID == UNUSED_ENTRY_GUID))
-    {
+    if(memcmp(entry, unused_entry, sizeof(unused_entry)) != 0)
+    {                                             // unused entries aren't decoded at all
+      hwNode partition("volume", hw::volume);
       source spart = s;
-      if(p.PartitionTypeGUID == "C12A7328-F81F-11D2-BA4B-00A0C93EC93B")
-      {
-        partition.setDescription("System partition");
-        partition.setVendor("EFI");
-        partition.addCapability("boot");
-      }
-      else
-      if(p.PartitionTypeGUID == "024DEE41-33E7-11D3-9D69-0008C781F39F")
-      {
-        partition.setDescription("MBR partition scheme");
-        partition.setVendor("EFI");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "21686148-6449-6E6F-744E-656564454649")
-      {
-        partition.setDescription("BIOS Boot partition");
-        partition.setVendor("EFI");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F")
-      {
-        partition.setDescription("swap partition");
-        partition.setVendor("Linux");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "A19D880F-05FC-4D3B-A006-743F0F84911E")
-      {
-        partition.setDescription("RAID partition");
-        partition.setVendor("Linux");
-        partition.addCapability("multi");
-      }
-      else
-      if(p.PartitionTypeGUID == "E6D6D379-F507-44C2-A23C-238F2A3DF928")
-      {
-        partition.setDescription("LVM Physical Volume");
-        partition.setVendor("Linux");
-        partition.addCapability("multi");
-      }
-      else
-      if(p.PartitionTypeGUID == "8DA63339-0007-60C0-C436-083AC8230908")
+      efipartition p;
+
+      p.PartitionTypeGUID = read_efi_guid(entry);
+      p.PartitionGUID = read_efi_guid(entry + 0x10);
+      p.StartingLBA = le_longlong(entry + 0x20);
+      p.EndingLBA = le_longlong(entry + 0x28);
+      p.Attributes = le_longlong(entry + 0x30);
+      for(int j=0; j<36; j++)
       {
-        partition.setDescription("reserved partition");
-        partition.setVendor("Linux");
-        partition.addCapability("nofs");
+        wchar_t c = le_short(entry + 0x38 + 2*j);
+        if(!c)
+          break;
+        else
+          p.PartitionName += utf8(c);
       }
-      else
-      if(p.PartitionTypeGUID == "75894C1E-3AEB-11D3-B7C1-7B03A0000000")
-      {
-        partition.setDescription("data partition");
-        partition.setVendor("HP-UX");
-      }
-      else
-      if(p.PartitionTypeGUID == "E2A1E728-32E3-11D6-A682-7B03A0000000")
-      {
-        partition.setDescription("service partition");
-        partition.setVendor("HP-UX");
-        partition.addCapability("nofs");
-        partition.addCapability("boot");
-      }
-      else
-      if(p.PartitionTypeGUID == "48465300-0000-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("Apple HFS+ partition");
-        partition.setVendor("Mac OS X");
-      }
-      else
-      if(p.PartitionTypeGUID == "7C3457EF-0000-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("Apple APFS partition");
-        partition.setVendor("Mac OS X");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A898CC3-1DD2-11B2-99A6-080020736631")
-      {
-        partition.setDescription("OS X ZFS partition or Solaris /usr partition");
-        partition.setVendor("Solaris");
-      }
-      else
-      if(p.PartitionTypeGUID == "52414944-0000-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("RAID partition");
-        partition.setVendor("Mac OS X");
-        partition.addCapability("multi");
-      }
-      else
-      if(p.PartitionTypeGUID == "52414944-5F4F-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("RAID partition (offline)");
-        partition.setVendor("Mac OS X");
-        partition.addCapability("multi");
-        partition.addCapability("offline");
-      }
-      else
-      if(p.PartitionTypeGUID == "4C616265-6C00-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("Apple label");
-        partition.setVendor("Mac OS X");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "5265636F-7665-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("recovery partition");
-        partition.setVendor("Apple TV");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "53746F72-6167-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("Apple Core Storage (File Vault)");
-        partition.setVendor("Mac OS X");
-        partition.addCapability("encrypted");
-      }
-      else
-      if(p.PartitionTypeGUID == "426F6F74-0000-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("boot partition");
-        partition.setVendor("Mac OS X");
-        partition.addCapability("boot");
-      }
-      else
-      if(p.PartitionTypeGUID == "55465300-0000-11AA-AA11-00306543ECAC")
-      {
-        partition.setDescription("UFS partition");
-        partition.setVendor("Mac OS X");
-      }
-      else
-      if(p.PartitionTypeGUID == "516E7CB4-6ECF-11D6-8FF8-00022D09712B")
-      {
-        partition.setDescription("data partition");
-        partition.setVendor("FreeBSD");
-      }
-      else
-      if(p.PartitionTypeGUID == "516E7CB6-6ECF-11D6-8FF8-00022D09712B")
-      {
-        partition.setDescription("UFS partition");
-        partition.setVendor("FreeBSD");
-      }
-      else
-      if(p.PartitionTypeGUID == "516E7CBA-6ECF-11D6-8FF8-00022D09712B")
-      {
-        partition.setDescription("ZFS partition");
-        partition.setVendor("FreeBSD");
-      }
-      else
-      if(p.PartitionTypeGUID == "516E7CB8-6ECF-11D6-8FF8-00022D09712B")
-      {
-        partition.setDescription("Vinum Volume Manager partition");
-        partition.setVendor("FreeBSD");
-      }
-      else
-      if(p.PartitionTypeGUID == "516E7CB5-6ECF-11D6-8FF8-00022D09712B")
-      {
-        partition.setDescription("swap partition");
-        partition.setVendor("FreeBSD");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "83BD6B9D-7F41-11DC-BE0B-001560B84F0F")
-      {
-        partition.setDescription("boot partition");
-        partition.setVendor("FreeBSD");
-        partition.addCapability("boot");
-      }
-      else
-      if(p.PartitionTypeGUID == "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7")
-      {
-        partition.setDescription("data partition");
-        partition.setVendor("Windows");
-      }
-      else
-      if(p.PartitionTypeGUID == "DE94BBA4-06D1-4D40-A16A-BFD50179D6AC")
-      {
-        partition.setDescription("recovery environment");
-        partition.setVendor("Windows");
-        partition.addCapability("boot");
-      }
-      else
-      if(p.PartitionTypeGUID == "37AFFC90-EF7D-4E96-91C3-2D7AE055B174")
-      {
-        partition.setDescription("IBM GPFS partition");
-        partition.setVendor("Windows");
-      }
-      else
-      if(p.PartitionTypeGUID == "5808C8AA-7E8F-42E0-85D2-E1E90434CFB3")
-      {
-        partition.setDescription("LDM configuration");
-        partition.setVendor("Windows");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "AF9B60A0-1431-4F62-BC68-3311714A69AD")
-      {
-        partition.setDescription("LDM data partition");
-        partition.setVendor("Windows");
-        partition.addCapability("multi");
-      }
-      else
-      if(p.PartitionTypeGUID == "E3C9E316-0B5C-4DB8-817D-F92DF00215AE")
-      {
-        partition.setDescription("reserved partition");
-        partition.setVendor("Windows");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "FE3A2A5D-4F32-41A7-B725-ACCC3285A309")
-      {
-        partition.setDescription("kernel");
-        partition.setVendor("ChromeOS");
-      }
-      else
-      if(p.PartitionTypeGUID == "3CB8E202-3B7E-47DD-8A3C-7FF2A13CFCEC")
-      {
-        partition.setDescription("root filesystem");
-        partition.setVendor("ChromeOS");
-      }
-      else
-      if(p.PartitionTypeGUID == "2E0A753D-9E48-43B0-8337-B15192CB1B5E")
-      {
-        partition.setDescription("reserved");
-        partition.setVendor("ChromeOS");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A82CB45-1DD2-11B2-99A6-080020736631")
-      {
-        partition.setDescription("boot partition");
-        partition.setVendor("Solaris");
-        partition.addCapability("boot");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A85CF4D-1DD2-11B2-99A6-080020736631")
-      {
-        partition.setDescription("root partition");
-        partition.setVendor("Solaris");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A87C46F-1DD2-11B2-99A6-080020736631")
-      {
-        partition.setDescription("swap partition");
-        partition.setVendor("Solaris");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A8B642B-1DD2-11B2-99A6-080020736631")
-      {
-        partition.setDescription("backup partition");
-        partition.setVendor("Solaris");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A8EF2E9-1DD2-11B2-99A6-080020736631")
-      {
-        partition.setDescription("/var partition");
-        partition.setVendor("Solaris");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A90BA39-1DD2-11B2-99A6-080020736631")
-      {
-        partition.setDescription("/home partition");
-        partition.setVendor("Solaris");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A9283A5-1DD2-11B2-99A6-080020736631")
-      {
-        partition.setDescription("alternate sector");
-        partition.setVendor("Solaris");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "6A945A3B-1DD2-11B2-99A6-080020736631" ||
-         p.PartitionTypeGUID == "6A9630D1-1DD2-11B2-99A6-080020736631" ||
-         p.PartitionTypeGUID == "6A980767-1DD2-11B2-99A6-080020736631" ||
-         p.PartitionTypeGUID == "6A96237F-1DD2-11B2-99A6-080020736631" ||
-         p.PartitionTypeGUID == "6A8D2AC7-1DD2-11B2-99A6-080020736631"
-        )
-      {
-        partition.setDescription("reserved partition");
-        partition.setVendor("Solaris");
-      }
-      else
-      if(p.PartitionTypeGUID == "49F48D32-B10E-11DC-B99B-0019D1879648")
-      {
-        partition.setDescription("swap partition");
-        partition.setVendor("NetBSD");
-        partition.addCapability("nofs");
-      }
-      else
-      if(p.PartitionTypeGUID == "49F48D5A-B10E-11DC-B99B-0019D1879648")
-      {
-        partition.setDescription("FFS partition");
-        partition.setVendor("NetBSD");
-      }
-      else
-      if(p.PartitionTypeGUID == "49F48D82-B10E-11DC-B99B-0019D1879648")
-      {
-        partition.setDescription("LFS partition");
-        partition.setVendor("NetBSD");
-      }
-      else
-      if(p.PartitionTypeGUID == "49F48DAA-B10E-11DC-B99B-0019D1879648")
-      {
-        partition.setDescription("RAID partition");
-        partition.setVendor("NetBSD");
-        partition.addCapability("multi");
-      }
-      else
-      if(p.PartitionTypeGUID == "2DB519C4-B10F-11DC-B99B-0019D1879648")
-      {
-        partition.setDescription("concatenated partition");
-        partition.setVendor("NetBSD");
-        partition.addCapability("multi");
-      }
-      else
-      if(p.PartitionTypeGUID == "2DB519EC-B10F-11DC-B99B-0019D1879648")
-      {
-        partition.setDescription("encrypted partition");
-        partition.setVendor("NetBSD");
-        partition.addCapability("encrypted");
-      }
-      else
-      if(p.PartitionTypeGUID == "42465331-3ba3-10f1-802a-4861696b7521")		// is it really used ?
+
+      const gpt_type *t = gpt_types;
+
+      while(t->description && (memcmp(entry, t->guid, sizeof(t->guid)) != 0))
+        t++;
+      if(t->description)
       {
-        partition.setDescription("BeFS partition");
-        partition.setVendor("Haiku");
+        const char *capability = t->capabilities;
+
+        partition.setDescription(t->description);
+        partition.setVendor(t->vendor);
+        while(*capability)
+        {
+          size_t len = strcspn(capability, " ");
+
+          partition.addCapability(string(capability, len));
+          capability += len + strspn(capability + len, " ");
+        }
       }
       else
         partition.setDescription("EFI partition");
@@ -1144,7 +1038,7 @@ static bool detect_gpt(source & s, hwNode & n)
     }
   }
 
-  free(partitions);
+  free(table);
 
   return true;
 }
@@ -1152,7 +1046,7 @@ static bool detect_gpt(source & s, hwNode & n)
 
 static bool detect_dosmap(source & s, hwNode & n)
 {
-  static unsigned char buffer[BLOCKSIZE];
+  unsigned char buffer[BLOCKSIZE];
   int i = 0;
   unsigned char flags;
   unsigned char type;
@@ -1218,7 +1112,7 @@ static bool detect_dosmap(source & s, hwNode & n)
 
 static bool detect_macmap(source & s, hwNode & n)
 {
-  static unsigned char buffer[BLOCKSIZE];
+  unsigned char buffer[BLOCKSIZE];
   unsigned long count = 0, i = 0;
   unsigned long long start = 0, size = 0;
   string type = "";
@@ -1285,7 +1179,7 @@ static bool detect_macmap(source & s, hwNode & n)
 
 static bool detect_lif(source & s, hwNode & n)
 {
-  static unsigned char buffer[LIFBLOCKSIZE];
+  unsigned char buffer[LIFBLOCKSIZE];
   source lifvolume;
   unsigned long dir_start = 0, dir_length = 0;
   unsigned lif_version = 0;
@@ -1336,7 +1230,7 @@ static bool detect_lif(source & s, hwNode & n)
 
 static bool detect_luks(source & s, hwNode & n)
 {
-  static char buffer[BLOCKSIZE];
+  char buffer[BLOCKSIZE];
   source luksvolume;
   unsigned luks_version = 0;
 
@@ -1393,6 +1287,9 @@ bool scan_partitions(hwNode & n)
   s.blocksize = BLOCKSIZE;
   s.size = medium->getSize();
 
+  opencache(s);
+  prefetchblocks(s);                              // partition maps and superblocks all live in the first few KB
+
   while(map_types[i].id)
   {
     if(map_types[i].detect && map_types[i].detect(s, *medium))
@@ -1410,6 +1307,7 @@ bool scan_partitions(hwNode & n)
       medium->setClass(hw::volume);
   }
 
+  closecache(s);
   close(fd);
 
 //if(medium != &n) free(medium);
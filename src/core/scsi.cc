@@ -8,6 +8,7 @@
 #include <glob.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -27,11 +28,14 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
 
 __ID("@(#) $Id$");
 
 #define SG_X "/dev/sg[0-9]*"
-#define SG_MAJOR 21
+#define SYS_CLASS_SCSIDEVICE "/sys/class/scsi_device"
+#define SYS_DEV "/sys/dev"
 
 #ifndef SCSI_IOCTL_GET_PCI
 #define SCSI_IOCTL_GET_PCI 0x5387
@@ -53,6 +57,9 @@ __ID("@(#) $Id$");
 #define MX_ALLOC_LEN 255
 #define EBUFF_SZ 256
 
+#define SG_TIMEOUT 10000                          /* per command, in ms */
+#define MAXSCSIPROBES 16                          /* devices interrogated at the same time */
+
 /* Some of the following error/status codes are exchanged between the
    various layers of the SCSI sub-system in Linux and should never
    reach the user. They are placed here for completeness. What appears
@@ -203,8 +210,6 @@ static const char *devices[] =
   NULL
 };
 
-static map < string, string > sg_map;
-
 static string scsi_handle(unsigned int host,
 int channel = -1,
 int id = -1,
@@ -354,7 +359,7 @@ int mx_resp_len)
   io_hdr.dxferp = resp;
   io_hdr.cmdp = senseCmdBlk;
   io_hdr.sbp = sense_b;
-  io_hdr.timeout = 20000;                         /* 20 seconds */
+  io_hdr.timeout = SG_TIMEOUT;
 
   if (ioctl(sg_fd, SG_IO, &io_hdr) < 0)
     return false;
@@ -404,7 +409,7 @@ int noisy)
   io_hdr.dxferp = resp;
   io_hdr.cmdp = inqCmdBlk;
   io_hdr.sbp = sense_b;
-  io_hdr.timeout = 20000;                         /* 20 seconds */
+  io_hdr.timeout = SG_TIMEOUT;
 
   if (ioctl(sg_fd, SG_IO, &io_hdr) < 0)
     return false;
@@ -441,6 +446,46 @@ static u_int16_t decode_word(void *ptr)
 }
 
 
+static void set_rpm(hwNode & node, unsigned long rpm)
+{
+  if (rpm / 15000 == 1)
+    node.addCapability("15000rpm", "15000 rotations per minute");
+  else
+  {
+    if (rpm / 10000 == 1)
+      node.addCapability("10000rpm", "10000 rotations per minute");
+    else
+    {
+      if (rpm / 7200 == 1)
+        node.addCapability("7200rpm", "7200 rotations per minute");
+      else
+      {
+        if (rpm / 5400 == 1)
+          node.addCapability("5400rpm", "5400 rotations per minute");
+      }
+    }
+  }
+}
+
+
+static bool do_serialnumber(int sg_fd,
+hwNode & node)
+{
+  uint8_t rsp_buff[MX_ALLOC_LEN + 1];
+
+  memset(rsp_buff, 0, sizeof(rsp_buff));
+  if (do_inq(sg_fd, 0, 1, 0x80, rsp_buff, MX_ALLOC_LEN, 0))
+  {
+    uint8_t _len = rsp_buff[3];
+    if (_len > 0)
+      node.setSerial(hw::strip(string((char *)rsp_buff + 4, _len)));
+    return true;
+  }
+
+  return false;
+}
+
+
 static bool do_inquiry(int sg_fd,
 hwNode & node)
 {
@@ -483,79 +528,132 @@ hwNode & node)
   if (ansiversion)
     node.setConfig("ansiversion", tostring(ansiversion));
 
+  do_serialnumber(sg_fd, node);
+
+  return true;
+}
+
+
+static bool do_modepages(int sg_fd,
+hwNode & node)
+{
+  uint8_t rsp_buff[MX_ALLOC_LEN + 1];
+
   memset(rsp_buff, 0, sizeof(rsp_buff));
-  if (do_inq(sg_fd, 0, 1, 0x80, rsp_buff, MX_ALLOC_LEN, 0))
+  if (!do_modesense(sg_fd, 0x3F, 0, rsp_buff, sizeof(rsp_buff)))
+    return false;
+
+  unsigned long long sectsize = 0;
+  unsigned long long heads = 0;
+  unsigned long long cyl = 0;
+  unsigned long long sectors = 0;
+  unsigned long rpm = 0;
+  uint8_t *end = rsp_buff + rsp_buff[0];
+  uint8_t *p = NULL;
+
+  if (rsp_buff[3] == 8)
+    sectsize = decode_3_bytes(rsp_buff + 9);
+
+  p = & rsp_buff[4];
+  p += rsp_buff[3];
+  while (p < end)
   {
-    uint8_t _len = rsp_buff[3];
-    if (_len > 0)
-      node.setSerial(hw::strip(string((char *)rsp_buff + 4, _len)));
+    u_int8_t page = *p & 0x3F;
+
+    if (page == 3)
+    {
+      sectors = decode_word(p + 10);
+      sectsize = decode_word(p + 12);
+    }
+    if (page == 4)
+    {
+      cyl = decode_3_bytes(p + 2);
+      rpm = decode_word(p + 20);
+      heads = p[5];
+    }
+
+    p += p[1] + 2;
   }
 
-  memset(rsp_buff, 0, sizeof(rsp_buff));
-  if (do_modesense(sg_fd, 0x3F, 0, rsp_buff, sizeof(rsp_buff)))
+  node.setCapacity(heads * cyl * sectors * sectsize);
+  set_rpm(node, rpm);
+
+  return true;
+}
+
+
+/*
+ * handle -> device nodes (/dev/sda, /dev/sr0, /dev/cdrom...), sorted by name
+ */
+static map < string, vector < string > > devicenames;
+
+struct scsidevice
+{
+  string path;
+  string handle;
+};
+
+static void probe_device(size_t i, void * data)
+{
+  scsidevice & d = (*(vector < scsidevice > *)data)[i];
+  struct stat buf;
+  My_scsi_idlun m_idlun;
+
+  if (stat(d.path.c_str(), &buf) != 0)
+    return;
+
+  if (S_ISBLK(buf.st_mode) || S_ISCHR(buf.st_mode))
   {
-    unsigned long long sectsize = 0;
-    unsigned long long heads = 0;
-    unsigned long long cyl = 0;
-    unsigned long long sectors = 0;
-    unsigned long rpm = 0;
-    uint8_t *end = rsp_buff + rsp_buff[0];
-    uint8_t *p = NULL;
-
-    if (rsp_buff[3] == 8)
-      sectsize = decode_3_bytes(rsp_buff + 9);
-
-    p = & rsp_buff[4];
-    p += rsp_buff[3];
-    while (p < end)
-    {
-      u_int8_t page = *p & 0x3F;
+    char sysdev[64];
+    int host, channel, id, lun;
 
-      if (page == 3)
-      {
-        sectors = decode_word(p + 10);
-        sectsize = decode_word(p + 12);
-      }
-      if (page == 4)
-      {
-        cyl = decode_3_bytes(p + 2);
-        rpm = decode_word(p + 20);
-        heads = p[5];
-      }
+    snprintf(sysdev, sizeof(sysdev), SYS_DEV "/%s/%u:%u/device",
+      S_ISBLK(buf.st_mode)?"block":"char",
+      major(buf.st_rdev), minor(buf.st_rdev));
 
-      p += p[1] + 2;
+    if (sscanf(shortname(readlink(sysdev)).c_str(), "%d:%d:%d:%d",
+      &host, &channel, &id, &lun) == 4)
+    {
+      d.handle = scsi_handle(host, channel, id, lun);
+      return;                                     // no need to open it
     }
+  }
 
-    node.setCapacity(heads * cyl * sectors * sectsize);
+  int fd = open(d.path.c_str(), O_RDONLY | O_NONBLOCK);
 
-    if (rpm / 15000 == 1)
-      node.addCapability("15000rpm", "15000 rotations per minute");
-    else
+  if (fd >= 0)
+  {
+    int bus = -1;
+    union
     {
-      if (rpm / 10000 == 1)
-        node.addCapability("10000rpm", "10000 rotations per minute");
-      else
+      char host[50];
+      int length;
+    } tmp;
+    tmp.length = sizeof(tmp.host);
+    memset(tmp.host, 0, sizeof(tmp.host));
+
+    if(ioctl(fd, SCSI_IOCTL_PROBE_HOST, &tmp.length) >= 0)
+    {
+      if (ioctl(fd, SCSI_IOCTL_GET_BUS_NUMBER, &bus) >= 0)
       {
-        if (rpm / 7200 == 1)
-          node.addCapability("7200rpm", "7200 rotations per minute");
-        else
+        memset(&m_idlun, 0, sizeof(m_idlun));
+        if (ioctl(fd, SCSI_IOCTL_GET_IDLUN, &m_idlun) >= 0)
         {
-          if (rpm / 5400 == 1)
-            node.addCapability("5400rpm", "5400 rotations per minute");
+          d.handle = scsi_handle(bus, (m_idlun.mux4 >> 16) & 0xff,
+            m_idlun.mux4 & 0xff,
+            (m_idlun.mux4 >> 8) & 0xff);
         }
       }
     }
+    close(fd);
   }
-
-  return true;
 }
 
 static void scan_devices()
 {
-  int fd = -1;
   int i = 0;
   size_t j = 0;
-  My_scsi_idlun m_idlun;
+  vector < scsidevice > found;
 
   for (i = 0; devices[i] != NULL; i++)
   {
@@ -565,51 +663,39 @@ static void scan_devices()
     {
       for(j=0; j < entries.gl_pathc; j++)
       {
-        fd = open(entries.gl_pathv[j], O_RDONLY | O_NONBLOCK);
-        if (fd >= 0)
-        {
-          int bus = -1;
-          union
-          {
-            char host[50];
-            int length;
-          } tmp;
-          tmp.length = sizeof(tmp.host);
-          memset(tmp.host, 0, sizeof(tmp.host));
+        scsidevice d;
 
-          if(ioctl(fd, SCSI_IOCTL_PROBE_HOST, &tmp.length) >= 0)
-          {
-            if (ioctl(fd, SCSI_IOCTL_GET_BUS_NUMBER, &bus) >= 0)
-            {
-              memset(&m_idlun, 0, sizeof(m_idlun));
-              if (ioctl(fd, SCSI_IOCTL_GET_IDLUN, &m_idlun) >= 0)
-              {
-                sg_map[string(entries.gl_pathv[j])] = scsi_handle(bus, (m_idlun.mux4 >> 16) & 0xff,
-                  m_idlun.mux4 & 0xff,
-                  (m_idlun.mux4 >> 8) & 0xff);
-              }
-            }
-          }
-          close(fd);
-        }
+        d.path = entries.gl_pathv[j];
+        found.push_back(d);
       }
       globfree(&entries);
     }
   }
+
+  parallelize(found.size(), probe_device, &found, MAXSCSIPROBES);
+
+  for (j = 0; j < found.size(); j++)
+    if (found[j].handle != "")
+      devicenames[found[j].handle].push_back(found[j].path);
+
+  for (map < string, vector < string > >::iterator n = devicenames.begin();
+    n != devicenames.end(); n++)
+    sort(n->second.begin(), n->second.end());
 }
 
 
 static void find_logicalname(hwNode & n)
 {
-  map < string, string >::iterator i = sg_map.begin();
+  map < string, vector < string > >::const_iterator i =
+    devicenames.find(n.getHandle());
 
-  for (i = sg_map.begin(); i != sg_map.end(); i++)
+  if (i == devicenames.end())
+    return;
+
+  for (size_t j = 0; j < i->second.size(); j++)
   {
-    if (i->second == n.getHandle())
-    {
-      n.setLogicalName(i->first);
-      n.claim();
-    }
+    n.setLogicalName(i->second[j]);
+    n.claim();
   }
 }
 
@@ -658,101 +744,123 @@ static bool atapi(const hwNode & n)
 }
 
 
-static void scan_sg(hwNode & n)
+static hwNode scsi_node(int type)
 {
-  int sg;
-  int fd = -1;
-  My_sg_scsi_id m_id;
-  string host = "";
-  string businfo = "";
-  string adapter_businfo = "";
-  int emulated = 0;
-  bool ghostdeventry = false;
-  size_t j;
-  glob_t entries;
-
-  if(glob(SG_X, 0, NULL, &entries) == 0)
-  {
-    for(j=0; j < entries.gl_pathc; j++)
-    {
-      sg = strtol(strpbrk(entries.gl_pathv[j], "0123456789"), NULL, 10);
-
-      ghostdeventry = !exists(entries.gl_pathv[j]);
-
-      if(ghostdeventry)
-        mknod(entries.gl_pathv[j], (S_IFCHR | S_IREAD), MKDEV(SG_MAJOR, sg));
-      fd = open(entries.gl_pathv[j], OPEN_FLAG | O_NONBLOCK);
-      if(ghostdeventry)
-        unlink(entries.gl_pathv[j]);
-  if (fd < 0)
-        continue;
-
-  memset(&m_id, 0, sizeof(m_id));
-  if (ioctl(fd, SG_GET_SCSI_ID, &m_id) < 0)
-  {
-    close(fd);
-        continue;        // we failed to get info but still hope we can continue
-  }
-
-  emulated = 0;
-  ioctl(fd, SG_EMULATED_HOST, &emulated);
-
-  host = host_logicalname(m_id.host_no);
-  businfo = scsi_businfo(m_id.host_no);
-  adapter_businfo =
-      sysfs::entry::byClass("scsi_host", host_kname(m_id.host_no))
-      .parent().businfo();			// "normal" case (legacy?)
-  if(adapter_businfo.empty())
-    adapter_businfo =
-        sysfs::entry::byClass("scsi_host", host_kname(m_id.host_no))
-	.parent().parent().businfo();		// 1 level of indirection: USB→SCSI
-  if(adapter_businfo.empty())
-    adapter_businfo =
-        sysfs::entry::byClass("scsi_host", host_kname(m_id.host_no))
-	.parent().parent().parent().businfo();	// 2 levels of indirection: PCI→(S)ATA→SCSI
-
-  hwNode device = hwNode("generic");
-  hwNode *parent = NULL;
-
-  switch (m_id.scsi_type)
+  switch (type)
   {
     case 0:
     case 14:
     case 20:
-      device = hwNode("disk", hw::disk);
-      break;
+      return hwNode("disk", hw::disk);
     case 1:
-      device = hwNode("tape", hw::tape);
-      break;
+      return hwNode("tape", hw::tape);
     case 3:
-      device = hwNode("processor", hw::processor);
-      break;
+      return hwNode("processor", hw::processor);
     case 4:
     case 5:
-      device = hwNode("cdrom", hw::disk);
-      break;
+      return hwNode("cdrom", hw::disk);
     case 6:
-      device = hwNode("scanner", hw::generic);
-      break;
+      return hwNode("scanner", hw::generic);
     case 7:
-      device = hwNode("magnetooptical", hw::disk);
-      break;
+      return hwNode("magnetooptical", hw::disk);
     case 8:
-      device = hwNode("changer", hw::generic);
-      break;
+      return hwNode("changer", hw::generic);
     case 0xd:
-      device = hwNode("enclosure", hw::generic);
-      break;
+      return hwNode("enclosure", hw::generic);
   }
 
-  device.setDescription(string(scsi_type(m_id.scsi_type)));
-  device.setHandle(scsi_handle(m_id.host_no,
-    m_id.channel, m_id.scsi_id, m_id.lun));
-  device.setBusInfo(scsi_businfo(m_id.host_no,
-    m_id.channel, m_id.scsi_id, m_id.lun));
-  device.setPhysId(m_id.channel, m_id.scsi_id, m_id.lun);
+  return hwNode("generic");
+}
+
+
+static bool isdisk(int type)
+{
+  return (type == 0) || (type == 7) || (type == 14) || (type == 20);
+}
+
+
+static string firstentry(const string & dir)
+{
+  struct dirent **namelist = NULL;
+  string result = "";
+  int n = scandir(dir.c_str(), &namelist, NULL, alphasort);
+
+  if (n < 0)
+    return result;
+
+  for (int i = 0; i < n; i++)
+  {
+    if ((result == "") && (namelist[i]->d_name[0] != '.'))
+      result = namelist[i]->d_name;
+    free(namelist[i]);
+  }
+  free(namelist);
+
+  return result;
+}
+
+
+/*
+ * SCSI devices are interrogated in parallel, then added to the tree one
+ * after the other (in /dev/sg* order, as they always were) as finding their
+ * parents needs sysfs entries (which aren't thread-safe).
+ *
+ * Whatever the kernel already knows (INQUIRY data, VPD pages) is read from
+ * /sys/class/scsi_device; commands are only sent (via SG_IO on the block
+ * device, or on an existing sg node) for what's missing.
+ */
+struct sgdevice
+{
+  string path;                                    // sysfs directory or sg node
+  string node;                                    // device node to send commands to
+  bool valid;
+  My_sg_scsi_id m_id;
+  int emulated;
+  hwNode device;
+
+  sgdevice(): valid(false), emulated(0), device("generic") {}
+};
+
+static bool hctl_order(const sgdevice & a, const sgdevice & b)
+{
+  if (a.m_id.host_no != b.m_id.host_no)
+    return a.m_id.host_no < b.m_id.host_no;
+  if (a.m_id.channel != b.m_id.channel)
+    return a.m_id.channel < b.m_id.channel;
+  if (a.m_id.scsi_id != b.m_id.scsi_id)
+    return a.m_id.scsi_id < b.m_id.scsi_id;
+  return a.m_id.lun < b.m_id.lun;
+}
+
+static bool sg_order(const sgdevice & a, const sgdevice & b)
+{
+  bool asg = (a.node.compare(0, 7, "/dev/sg") == 0);
+  bool bsg = (b.node.compare(0, 7, "/dev/sg") == 0);
+
+  if (asg != bsg)                                 // devices without sg node last
+    return asg;
+  if (asg)
+    return a.node < b.node;                       // same as glob(SG_X)
+  return hctl_order(a, b);
+}
+
+static void describe(sgdevice & d)
+{
+  hwNode & device = d.device;
+
+  device.setDescription(string(scsi_type(d.m_id.scsi_type)));
+  device.setHandle(scsi_handle(d.m_id.host_no,
+    d.m_id.channel, d.m_id.scsi_id, d.m_id.lun));
+  device.setBusInfo(scsi_businfo(d.m_id.host_no,
+    d.m_id.channel, d.m_id.scsi_id, d.m_id.lun));
+  device.setPhysId(d.m_id.channel, d.m_id.scsi_id, d.m_id.lun);
   find_logicalname(device);
-  do_inquiry(fd, device);
+}
+
+static void finish(sgdevice & d)
+{
+  hwNode & device = d.device;
+
   if(device.getVendor() == "ATA")
   {
     device.setDescription("ATA " + device.getDescription());
@@ -763,58 +871,258 @@ static void scan_sg(hwNode & n)
     device.setDescription("SCSI " + device.getDescription());
     device.addHint("bus.icon", string("scsi"));
   }
-  if ((m_id.scsi_type == 4) || (m_id.scsi_type == 5))
+  if ((d.m_id.scsi_type == 4) || (d.m_id.scsi_type == 5))
     scan_cdrom(device);
-  if ((m_id.scsi_type == 0) || (m_id.scsi_type == 7) ||
-      (m_id.scsi_type == 14) || (m_id.scsi_type == 20))
-    scan_disk(device);
+}
+
+static void probe_sysfs(size_t i, void * data)
+{
+  sgdevice & d = (*(vector < sgdevice > *)data)[i];
+  hwNode & device = d.device;
+  string dir = d.path + "/device";
+  string blockdev = firstentry(dir + "/block");
+  string sg = firstentry(dir + "/scsi_generic");
+  string inquiry = get_string(dir + "/vendor");
+  string rawinquiry = get_string(dir + "/inquiry");
+  bool modesense = false;
+  int fd = -1;
+
+  if (sg != "")
+    d.node = "/dev/" + sg;                        // doesn't touch the media
+  else
+  if (blockdev != "")
+    d.node = "/dev/" + blockdev;
+
+  d.m_id.scsi_type = get_number(dir + "/type", -1);
+  device = scsi_node(d.m_id.scsi_type);
+  describe(d);
 
-  if (!adapter_businfo.empty())
+  if (inquiry != "")
   {
-    parent = n.findChildByBusInfo(adapter_businfo);
+    long level = get_number(dir + "/scsi_level", 0);
+    string vpd = get_string(dir + "/vpd_pg80");
+
+    device.setVendor(inquiry);
+    device.setProduct(hw::strip(get_string(dir + "/model")));
+    device.setVersion(hw::strip(get_string(dir + "/rev")));
+    if (level > 1)
+      device.setConfig("ansiversion", tostring(level - 1));
+    if ((vpd.length() > 4) && ((size_t)be_short(vpd.data() + 2) <= vpd.length() - 4))
+      device.setSerial(hw::strip(vpd.substr(4, be_short(vpd.data() + 2))));
+    if (rawinquiry.length() > 1)                  // RMB bit, also set for tapes and changers
+    {
+      if (rawinquiry[1] & 0x80)
+        device.addCapability("removable", "support is removable");
+    }
+    else
+    if ((blockdev != "") && (get_number(dir + "/block/" + blockdev + "/removable") == 1))
+      device.addCapability("removable", "support is removable");
   }
 
-  if (!parent)
-    parent = n.findChildByLogicalName(host);
-
-                                                  // IDE-SCSI pseudo host controller
-  if (emulated && device.getConfig("driver")=="ide-scsi")
+  if (isdisk(d.m_id.scsi_type))
   {
-    hwNode *ideatapi = n.findChild(atapi);
+    string vpd = get_string(dir + "/vpd_pgb1");   // block device characteristics
 
-    if (ideatapi)
-      parent = ideatapi->addChild(hwNode("scsi", hw::storage));
+    if (vpd.length() >= 6)
+      set_rpm(device, be_short(vpd.data() + 4));
+    else
+      modesense = true;
   }
 
-  if (!parent)
-  {
-    hwNode *core = n.getChild("core");
+  if ((inquiry == "") || modesense || (device.getSerial() == ""))
+  {                                               // not enough from sysfs
+    string node = "";
+
+    if (blockdev != "")
+      node = "/dev/" + blockdev;
+    else
+      node = d.node;
 
-    if (core)
-      parent = core->addChild(hwNode("scsi", hw::storage));
+    if ((node != "") && exists(node))             // never create ghost entries
+    {
+      fd = open(node.c_str(), OPEN_FLAG | O_NONBLOCK);
+      if (fd < 0)
+        fd = open(node.c_str(), O_RDONLY | O_NONBLOCK);
+    }
+    if (fd >= 0)
+    {
+      if (device.getVendor() == "")
+        do_inquiry(fd, device);
+      else
+      if (device.getSerial() == "")
+        do_serialnumber(fd, device);              // no VPD page 0x80 in sysfs
+      if (modesense)
+        do_modepages(fd, device);
+      close(fd);
+    }
   }
 
-  if (!parent)
-    parent = n.addChild(hwNode("scsi", hw::storage));
+  finish(d);
+}
+
+static void probe_sg(size_t i, void * data)
+{
+  sgdevice & d = (*(vector < sgdevice > *)data)[i];
+  int fd = open(d.path.c_str(), OPEN_FLAG | O_NONBLOCK);
+
+  if (fd < 0)
+    return;
 
-  if (parent)
+  memset(&d.m_id, 0, sizeof(d.m_id));
+  if (ioctl(fd, SG_GET_SCSI_ID, &d.m_id) < 0)
   {
+    close(fd);
+    return;                                       // we failed to get info but still hope we can continue
+  }
+  d.valid = true;
+
+  d.emulated = 0;
+  ioctl(fd, SG_EMULATED_HOST, &d.emulated);
+
+  d.device = scsi_node(d.m_id.scsi_type);
+  describe(d);
+  do_inquiry(fd, d.device);
+  do_modepages(fd, d.device);
+  close(fd);
+
+  finish(d);
+}
 
-  if(parent->getBusInfo() == "")
-    parent->setBusInfo(adapter_businfo);
-  parent->setLogicalName(host);
-  parent->claim();
+static void scan_sg(hwNode & n)
+{
+  string host = "";
+  string adapter_businfo = "";
+  size_t j;
+  vector < sgdevice > found;
+  struct dirent **namelist = NULL;
+  int count = scandir(SYS_CLASS_SCSIDEVICE, &namelist, NULL, alphasort);
 
-  if (emulated)
+  if (count >= 0)
   {
-    parent->addCapability("emulated", "Emulated device");
+    for (int i = 0; i < count; i++)
+    {
+      sgdevice d;
+
+      memset(&d.m_id, 0, sizeof(d.m_id));
+      if (sscanf(namelist[i]->d_name, "%d:%d:%d:%d", &d.m_id.host_no,
+        &d.m_id.channel, &d.m_id.scsi_id, &d.m_id.lun) == 4)
+      {
+        d.path = string(SYS_CLASS_SCSIDEVICE"/") + namelist[i]->d_name;
+        d.valid = true;
+        found.push_back(d);
+      }
+      free(namelist[i]);
+    }
+    free(namelist);
+
+    parallelize(found.size(), probe_sysfs, &found, MAXSCSIPROBES);
+    sort(found.begin(), found.end(), sg_order);
+
+    map < int, int > emulated;                    // emulated hosts (ide-scsi, usb-storage)
+    for (j = 0; j < found.size(); j++)
+    {
+      int host = found[j].m_id.host_no;
+
+      if ((emulated.find(host) == emulated.end()) && (found[j].node != "") &&
+        exists(found[j].node))
+      {
+        int fd = open(found[j].node.c_str(), OPEN_FLAG | O_NONBLOCK);
+
+        if (fd < 0)
+          fd = open(found[j].node.c_str(), O_RDONLY | O_NONBLOCK);
+        if (fd >= 0)
+        {
+          emulated[host] = 0;
+          ioctl(fd, SG_EMULATED_HOST, &emulated[host]);
+          close(fd);
+        }
+      }
+      if (emulated.find(host) != emulated.end())
+        found[j].emulated = emulated[host];
+    }
   }
-  parent->addChild(device);
+  else                                            // no sysfs: go through existing sg nodes
+  {
+    glob_t entries;
+
+    if(glob(SG_X, 0, NULL, &entries) == 0)
+    {
+      found.resize(entries.gl_pathc);
+      for(j=0; j < entries.gl_pathc; j++)
+        found[j].path = entries.gl_pathv[j];
+      globfree(&entries);
+    }
+
+    parallelize(found.size(), probe_sg, &found, MAXSCSIPROBES);
   }
 
-  close(fd);
+  for(j=0; j < found.size(); j++)
+  {
+    if(!found[j].valid)
+      continue;
+
+    My_sg_scsi_id & m_id = found[j].m_id;
+    int emulated = found[j].emulated;
+    hwNode & device = found[j].device;
+    hwNode *parent = NULL;
+
+    host = host_logicalname(m_id.host_no);
+    adapter_businfo =
+        sysfs::entry::byClass("scsi_host", host_kname(m_id.host_no))
+        .parent().businfo();			// "normal" case (legacy?)
+    if(adapter_businfo.empty())
+      adapter_businfo =
+          sysfs::entry::byClass("scsi_host", host_kname(m_id.host_no))
+	  .parent().parent().businfo();		// 1 level of indirection: USB→SCSI
+    if(adapter_businfo.empty())
+      adapter_businfo =
+          sysfs::entry::byClass("scsi_host", host_kname(m_id.host_no))
+	  .parent().parent().parent().businfo();	// 2 levels of indirection: PCI→(S)ATA→SCSI
+
+    if (isdisk(m_id.scsi_type))
+      scan_disk(device);
+
+    if (!adapter_businfo.empty())
+    {
+      parent = n.findChildByBusInfo(adapter_businfo);
+    }
+
+    if (!parent)
+      parent = n.findChildByLogicalName(host);
+
+                                                  // IDE-SCSI pseudo host controller
+    if (emulated && device.getConfig("driver")=="ide-scsi")
+    {
+      hwNode *ideatapi = n.findChild(atapi);
+
+      if (ideatapi)
+        parent = ideatapi->addChild(hwNode("scsi", hw::storage));
+    }
+
+    if (!parent)
+    {
+      hwNode *core = n.getChild("core");
+
+      if (core)
+        parent = core->addChild(hwNode("scsi", hw::storage));
+    }
+
+    if (!parent)
+      parent = n.addChild(hwNode("scsi", hw::storage));
+
+    if (parent)
+    {
+      if(parent->getBusInfo() == "")
+        parent->setBusInfo(adapter_businfo);
+      parent->setLogicalName(host);
+      parent->claim();
+
+      if (emulated)
+      {
+        parent->addCapability("emulated", "Emulated device");
+      }
+      parent->addChild(device);
     }
-    globfree(&entries);
   }
 }
 
@@ -1,64 +1,94 @@
 #include "version.h"
 #include "spd.h"
 #include "osutils.h"
+#include "jedec.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <string>
+#include <vector>
 #include <dirent.h>
 #include <stdio.h>
 #include <cstring>
 
 __ID("@(#) $Id$");
 
-/* SPD is 2048-bit long */
-#define SPD_MAXSIZE (2048/8)
+/* SPD is 2048-bit long (4096-bit for DDR4, 8192-bit for DDR5) */
+#define SPD_MAXSIZE (8192/8)
 #define SPD_BLKSIZE 0x10
 
 #define TYPE_EDO  0x02
 #define TYPE_SDRAM  0x04
+#define TYPE_DDR4  0x0C
+#define TYPE_DDR5  0x12
 
 #define PROCSENSORS "/proc/sys/dev/sensors"
 #define EEPROMPREFIX "eeprom-"
+#define SYSI2CDEVICES "/sys/bus/i2c/devices"
+#define MAXSPDREADS 8                             // EEPROMs read at the same time
+
+struct spd_eeprom
+{
+  string path;
+  unsigned char data[SPD_MAXSIZE];
+  size_t size;
+};
 
-static unsigned char spd[SPD_MAXSIZE];
-static bool spd_page_loaded[SPD_MAXSIZE / SPD_BLKSIZE];
-static string current_eeprom = "";
 static unsigned int current_bank = 0;
 
-static unsigned char get_spd_byte(unsigned int offset)
+/*
+ * legacy eeprom driver: 16-byte chunks as text (only the first 64 bytes are
+ * used for these old memory types)
+ */
+static bool load_legacy_eeprom(spd_eeprom & e)
 {
-  if ((offset < 0) || (offset >= SPD_MAXSIZE))
-    return 0;
+  memset(e.data, 0, sizeof(e.data));
+  e.size = 0;
 
-  if (!spd_page_loaded[offset / SPD_BLKSIZE])
+  for (unsigned int offset = 0; offset < 64; offset += SPD_BLKSIZE)
   {
     char chunkname[10];
-    string name = "";
     FILE *in = NULL;
 
-    snprintf(chunkname, sizeof(chunkname), "%02x",
-      (offset / SPD_BLKSIZE) * SPD_BLKSIZE);
-
-    name = current_eeprom + "/" + string(chunkname);
+    snprintf(chunkname, sizeof(chunkname), "%02x", offset);
 
-    in = fopen(name.c_str(), "r");
-    if (in)
+    in = fopen((e.path + "/" + string(chunkname)).c_str(), "r");
+    if (!in)
+      break;
+    for (int i = 0; i < SPD_BLKSIZE; i++)
     {
-      for (int i = 0; i < SPD_BLKSIZE; i++)
-        if(fscanf(in, "%d",
-          (int *) &spd[i + (offset / SPD_BLKSIZE) * SPD_BLKSIZE]) < 1)
-            break;
-      fclose(in);
-      spd_page_loaded[offset / SPD_BLKSIZE] = true;
+      int value = 0;
+
+      if(fscanf(in, "%d", &value) < 1)
+        break;
+      e.data[offset + i] = value;
     }
-    else
-      spd_page_loaded[offset / SPD_BLKSIZE] = false;
+    fclose(in);
+    e.size = offset + SPD_BLKSIZE;
   }
 
-  return spd[offset];
+  return e.size > 0;
+}
+
+
+/*
+ * ee1004/at24/spd5118/eeprom drivers: the whole SPD in a single read
+ */
+static void load_eeprom(size_t i, void *data)
+{
+  spd_eeprom & e = (*(vector < spd_eeprom > *) data)[i];
+  int fd = open(e.path.c_str(), O_RDONLY);
+  ssize_t count = 0;
+
+  if (fd < 0)
+    return;
+
+  count = pread(fd, e.data, sizeof(e.data), 0);
+  if (count > 0)
+    e.size = count;
+  close(fd);
 }
 
 
@@ -97,8 +127,177 @@ static hwNode *get_current_bank(hwNode & memory)
 }
 
 
-static bool scan_eeprom(hwNode & memory,
-string name)
+static unsigned int spd_crc16(const unsigned char *data, size_t len)
+{
+  unsigned int crc = 0;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    crc ^= data[i] << 8;
+    for (int j = 0; j < 8; j++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+
+  return crc & 0xFFFF;
+}
+
+
+static const char *spd_module_type(unsigned char type)
+{
+  switch (type & 0x0F)
+  {
+    case 0x1:
+      return "RDIMM";
+    case 0x2:
+      return "UDIMM";
+    case 0x3:
+      return "SODIMM";
+    case 0x4:
+      return "LRDIMM";
+    default:
+      return "DIMM";
+  }
+}
+
+
+/*
+ * what DDR4/DDR5 modules have in common: timings, manufacturer and part
+ * number (filled in only where DMI didn't already)
+ */
+static void spd_describe(hwNode & bank, const char *type, unsigned char moduletype,
+unsigned long tck,                                // ps
+const unsigned char *manufacturer,
+const unsigned char *serial,
+const unsigned char *partno, size_t partnolen,
+unsigned char version)
+{
+  char buff[100];
+
+  if (tck > 0)
+  {
+// data rates are multiples of 400/3 MT/s but tCK is rounded to the ps
+    unsigned long rate = ((2000000 * 3 / tck) + 200) / 400 * 400 / 3;
+
+    if (bank.getClock() == 0)
+      bank.setClock(rate * 1000000ULL);           // transfers per second
+    if (bank.getDescription() == "")
+    {
+      snprintf(buff, sizeof(buff), "%s %s %lu MHz (%0.1fns)",
+        spd_module_type(moduletype), type, rate, tck / 2000.0);
+      bank.setDescription(buff);
+    }
+  }
+
+  if (bank.getVendor() == "")
+  {
+    string vendor = "";
+
+    for (int i = 0; i < (manufacturer[0] & 0x7F); i++)
+      vendor += "7F";
+    snprintf(buff, sizeof(buff), "%02X", manufacturer[1]);
+    bank.setVendor(jedec_resolve(vendor + buff));
+  }
+  if (bank.getSerial() == "")
+  {
+    snprintf(buff, sizeof(buff), "0x%lx", be_long(serial));
+    bank.setSerial(buff);
+  }
+  if (bank.getProduct() == "")
+    bank.setProduct(hw::strip(string((const char *) partno, partnolen)));
+
+  snprintf(buff, sizeof(buff), "spd-%d.%d", (version & 0xF0) >> 4,
+    version & 0x0F);
+  bank.addCapability(buff);
+}
+
+
+static bool scan_ddr4(hwNode & memory, const spd_eeprom & e)
+{
+  static const unsigned long density[] = { 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 12288, 24576 };  // Mbit
+  const unsigned char *spd = e.data;
+
+  if ((e.size < 512) || (spd_crc16(spd, 126) != (unsigned int) (spd[126] | (spd[127] << 8))))
+    return false;
+
+  hwNode *bank = get_current_bank(memory);
+
+  if (!bank)
+    return false;
+
+  unsigned int ranks = ((spd[12] >> 3) & 0x7) + 1;
+  unsigned int width = 4 << (spd[12] & 0x7);
+  unsigned int buswidth = 8 << (spd[13] & 0x7);
+  unsigned int dies = 1;
+
+  if ((spd[6] & 0x3) == 0x2)                      // 3DS: each die is a logical rank
+    dies = ((spd[6] >> 4) & 0x7) + 1;
+
+  if ((bank->getSize() == 0) && ((spd[4] & 0xF) < sizeof(density)/sizeof(density[0])))
+    bank->setSize((unsigned long long) density[spd[4] & 0xF] * 1024 * 1024 / 8 *
+      (buswidth / width) * ranks * dies);
+
+  switch ((spd[13] >> 3) & 0x3)                   // bus width extension
+  {
+    case 0x00:
+      bank->setConfig("errordetection", "none");
+      break;
+    case 0x01:
+      bank->addCapability("ecc");
+      bank->setConfig("errordetection", "ecc");
+      break;
+  }
+  bank->setConfig("rank", ranks * dies);
+
+// medium timebase is 125ps, fine timebase 1ps (signed correction)
+  long tck = spd[18] * 125 + (signed char) spd[125];
+  spd_describe(*bank, "DDR4", spd[3], tck > 0 ? tck : 0,
+    &spd[320], &spd[325], &spd[329], 20, spd[1]);
+
+  return true;
+}
+
+
+static bool scan_ddr5(hwNode & memory, const spd_eeprom & e)
+{
+  static const unsigned long density[] = { 0, 4, 8, 12, 16, 24, 32, 48, 64 };  // Gbit
+  static const unsigned int diecount[] = { 1, 0, 2, 4, 8, 16, 0, 0 };
+  const unsigned char *spd = e.data;
+
+  if ((e.size < 1024) || (spd_crc16(spd, 510) != (unsigned int) (spd[510] | (spd[511] << 8))))
+    return false;
+
+  hwNode *bank = get_current_bank(memory);
+
+  if (!bank)
+    return false;
+
+  unsigned int ranks = ((spd[234] >> 3) & 0x7) + 1;
+  unsigned int channels = ((spd[235] >> 5) & 0x3) + 1;
+  unsigned int buswidth = 8 << (spd[235] & 0x7);
+  unsigned int width = 4 << ((spd[6] >> 5) & 0x3);
+  unsigned int dies = diecount[(spd[4] >> 5) & 0x7];
+
+  if ((bank->getSize() == 0) && ((spd[4] & 0x1F) < sizeof(density)/sizeof(density[0])))
+    bank->setSize((unsigned long long) density[spd[4] & 0x1F] * 1024 * 1024 * 1024 / 8 *
+      channels * (buswidth / width) * dies * ranks);
+
+  if ((spd[235] >> 3) & 0x3)                      // ECC bits per sub-channel
+  {
+    bank->addCapability("ecc");
+    bank->setConfig("errordetection", "ecc");
+  }
+  else
+    bank->setConfig("errordetection", "none");
+  bank->setConfig("rank", ranks);
+
+  spd_describe(*bank, "DDR5", spd[3], spd[20] | (spd[21] << 8),
+    &spd[512], &spd[517], &spd[521], 30, spd[1]);
+
+  return true;
+}
+
+
+static bool scan_eeprom(hwNode & memory, const spd_eeprom & e)
 {
   int memory_type = -1;
   char buff[20];
@@ -106,19 +305,26 @@ string name)
   unsigned char rows = 0;
   unsigned char density = 0;
   unsigned long long size = 0;
+  const unsigned char *spd = e.data;
+
+  if (e.size < 64)
+    return false;
 
-  current_eeprom = string(PROCSENSORS) + "/" + name;
-  memset(spd, 0, sizeof(spd));
-  memset(spd_page_loaded, 0, sizeof(spd_page_loaded));
+  memory_type = spd[0x02];
+  if ((memory_type == 0x00) || (memory_type == 0xFF))
+    return false;                                 // blank EEPROM
+
+  if (memory_type == TYPE_DDR4)
+    return scan_ddr4(memory, e);
+  if (memory_type == TYPE_DDR5)
+    return scan_ddr5(memory, e);
 
   for (int i = 0; i < 63; i++)
-    checksum += get_spd_byte(i);
+    checksum += spd[i];
 
-  if (checksum != get_spd_byte(63))
+  if (checksum != spd[63])
     return false;
 
-  memory_type = get_spd_byte(0x02);
-
   hwNode *bank = get_current_bank(memory);
 
   if (!bank)
@@ -134,13 +340,13 @@ string name)
       break;
   }
 
-  rows = get_spd_byte(5);
+  rows = spd[5];
   snprintf(buff, sizeof(buff), "%d", rows);
   bank->setConfig("rows", buff);
 
   if (bank->getSize() == 0)
   {
-    density = get_spd_byte(31);
+    density = spd[31];
     for (int j = 0; (j < 8) && (rows > 0); j++)
       if (density & (1 << j))
     {
@@ -153,7 +359,7 @@ string name)
     bank->setSize(size);
   }
 
-  switch (get_spd_byte(11))                       // error detection and correction scheme
+  switch (spd[11])                                // error detection and correction scheme
   {
     case 0x00:
       bank->setConfig("errordetection", "none");
@@ -168,7 +374,7 @@ string name)
       break;
   }
 
-  int version = get_spd_byte(62);
+  int version = spd[62];
 
   snprintf(buff, sizeof(buff), "spd-%d.%d", (version & 0xF0) >> 4,
     version & 0x0F);
@@ -178,6 +384,52 @@ string name)
 }
 
 
+/*
+ * SPD EEPROMs bound to a kernel driver on the SMBus (0x50-0x57), all read
+ * concurrently: on big servers, most of the time goes into waiting for the
+ * (slow) bus
+ */
+static bool scan_sysfs_eeproms(hwNode & memory)
+{
+  struct dirent **namelist = NULL;
+  vector < spd_eeprom > eeproms;
+  int n = scandir(SYSI2CDEVICES, &namelist, NULL, alphasort);
+
+  if (n < 0)
+    return false;
+
+  for (int i = 0; i < n; i++)
+  {
+    string dir = string(SYSI2CDEVICES"/") + namelist[i]->d_name;
+    string driver = hw::strip(get_string(dir + "/name"));
+    unsigned int bus = 0, address = 0;
+
+    if ((sscanf(namelist[i]->d_name, "%u-%x", &bus, &address) == 2) &&
+      (address >= 0x50) && (address <= 0x57) &&
+      ((driver == "ee1004") || (driver == "spd5118") || (driver == "spd") || (driver == "eeprom")) &&
+      exists(dir + "/eeprom"))
+    {
+      eeproms.push_back(spd_eeprom());
+      eeproms.back().path = dir + "/eeprom";
+      eeproms.back().size = 0;
+    }
+    free(namelist[i]);
+  }
+  free(namelist);
+
+  if (eeproms.empty())
+    return false;
+
+  parallelize(eeproms.size(), load_eeprom, &eeproms, MAXSPDREADS);
+
+  for (size_t i = 0; i < eeproms.size(); i++)
+    if (scan_eeprom(memory, eeproms[i]))
+      current_bank++;
+
+  return true;
+}
+
+
 static bool scan_eeproms(hwNode & memory)
 {
   struct dirent **namelist;
@@ -185,6 +437,9 @@ static bool scan_eeproms(hwNode & memory)
 
   current_bank = 0;
 
+  if (scan_sysfs_eeproms(memory))
+    return true;
+
   pushd(PROCSENSORS);
   n = scandir(".", &namelist, selecteeprom, alphasort);
   popd();
@@ -194,7 +449,10 @@ static bool scan_eeproms(hwNode & memory)
 
   for (int i = 0; i < n; i++)
   {
-    if (scan_eeprom(memory, namelist[i]->d_name))
+    spd_eeprom e;
+
+    e.path = string(PROCSENSORS) + "/" + namelist[i]->d_name;
+    if (load_legacy_eeprom(e) && scan_eeprom(memory, e))
       current_bank++;
     free(namelist[i]);
   }
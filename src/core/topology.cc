@@ -0,0 +1,322 @@
+/*
+ * topology.cc
+ *
+ * CPU packages, dies, cores, threads, caches and NUMA nodes, collected from
+ * /sys/devices/system/{cpu,node} in a single sweep.
+ *
+ * Packages are numbered like the CPU nodes ("cpu@N", in the order of their
+ * first logical CPU), so that other scans can index them directly.
+ */
+
+#include "version.h"
+#include "config.h"
+#include "topology.h"
+#include "osutils.h"
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <set>
+
+__ID("@(#) $Id$");
+
+#define SYS_DEVICES_CPU "/sys/devices/system/cpu"
+#define SYS_DEVICES_NODE "/sys/devices/system/node"
+
+static topology collected;
+static bool done = false;
+
+/*
+ * "0-3,8-11"
+ */
+static vector < int > cpulist(const string & list)
+{
+  vector < int > result;
+  vector < string > ranges;
+
+  splitlines(hw::strip(list), ranges, ',');
+  for (size_t i = 0; i < ranges.size(); i++)
+  {
+    int first = 0, last = 0;
+
+    switch (sscanf(ranges[i].c_str(), "%d-%d", &first, &last))
+    {
+      case 1:
+        result.push_back(first);
+        break;
+      case 2:
+        for (int cpu = first; cpu <= last; cpu++)
+          result.push_back(cpu);
+        break;
+    }
+  }
+
+  return result;
+}
+
+/*
+ * directories named like "cpu0", "node1" (sorted numerically)
+ */
+static vector < int > instances(const char * dir, const char * prefix)
+{
+  struct dirent **namelist = NULL;
+  int count = scandir(dir, &namelist, NULL, NULL);
+  set < int > result;
+  size_t length = strlen(prefix);
+
+  for (int i = 0; i < count; i++)
+  {
+    const char * name = namelist[i]->d_name;
+    char * end = NULL;
+
+    if ((strncmp(name, prefix, length) == 0) && isdigit(name[length]))
+    {
+      long n = strtol(name + length, &end, 10);
+      if (end && (*end == '\0'))
+        result.insert(n);
+    }
+    free(namelist[i]);
+  }
+  if (count >= 0)
+    free(namelist);
+
+  return vector < int > (result.begin(), result.end());
+}
+
+static unsigned long long cache_size(const string & size)       // "48K"
+{
+  char * unit = NULL;
+  unsigned long long result = strtoull(size.c_str(), &unit, 10);
+
+  if (unit && (*unit == 'K'))
+    return result * 1024;
+  if (unit && (*unit == 'M'))
+    return result * 1024 * 1024;
+  return result;
+}
+
+static void collect_caches(topology_package & package, int cpu, set < string > & seen)
+{
+  string dir = string(SYS_DEVICES_CPU"/cpu") + tostring(cpu) + "/cache";
+  vector < int > indexes = instances(dir.c_str(), "index");
+
+  for (size_t i = 0; i < indexes.size(); i++)
+  {
+    string index = dir + "/index" + tostring(indexes[i]);
+    unsigned int level = get_number(index + "/level");
+    string type = hw::strip(get_string(index + "/type"));
+    string shared = hw::strip(get_string(index + "/shared_cpu_list"));
+    string key = tostring(level) + type + ":" + shared;
+
+    if (!level || (seen.find(key) != seen.end()))
+      continue;                                   // already counted
+    seen.insert(key);
+
+    size_t c = 0;
+    for (c = 0; c < package.caches.size(); c++)
+      if ((package.caches[c].level == level) && (package.caches[c].type == type))
+        break;
+    if (c == package.caches.size())
+    {
+      topology_cache cache;
+
+      cache.level = level;
+      cache.type = type;
+      cache.size = 0;
+      package.caches.push_back(cache);
+    }
+    package.caches[c].size += cache_size(get_string(index + "/size"));
+  }
+}
+
+static void collect()
+{
+  vector < int > cpus = instances(SYS_DEVICES_CPU, "cpu");
+  map < int, size_t > packages;                   // physical id -> index
+  map < size_t, set < string > > cores, dies, caches;
+  map < int, size_t > cpupackage;
+
+  for (size_t i = 0; i < cpus.size(); i++)
+  {
+    string dir = string(SYS_DEVICES_CPU"/cpu") + tostring(cpus[i]) + "/topology";
+
+    if (!exists(dir))
+      continue;                                   // offline
+
+    int id = get_number(dir + "/physical_package_id", -1);
+
+    if (packages.find(id) == packages.end())
+    {
+      topology_package package;
+
+      package.id = id;
+      package.dies = package.cores = 0;
+      packages[id] = collected.packages.size();
+      collected.packages.push_back(package);
+    }
+
+    size_t p = packages[id];
+    topology_package & package = collected.packages[p];
+    string die = hw::strip(get_string(dir + "/die_id", "0"));
+
+    package.cpus.push_back(cpus[i]);
+    cpupackage[cpus[i]] = p;
+    dies[p].insert(die);
+    cores[p].insert(die + ":" + hw::strip(get_string(dir + "/core_id")));
+    collect_caches(package, cpus[i], caches[p]);
+  }
+
+  for (size_t p = 0; p < collected.packages.size(); p++)
+  {
+    collected.packages[p].dies = dies[p].size();
+    collected.packages[p].cores = cores[p].size();
+  }
+
+  vector < int > nodes = instances(SYS_DEVICES_NODE, "node");
+  for (size_t i = 0; i < nodes.size(); i++)
+  {
+    string dir = string(SYS_DEVICES_NODE"/node") + tostring(nodes[i]);
+    topology_node node;
+
+    node.id = nodes[i];
+    node.cpus = cpulist(get_string(dir + "/cpulist"));
+    node.distances = hw::strip(get_string(dir + "/distance"));
+
+    for (size_t c = 0; c < node.cpus.size(); c++)
+      if (cpupackage.find(node.cpus[c]) != cpupackage.end())
+      {
+        vector < int > & packagenodes = collected.packages[cpupackage[node.cpus[c]]].nodes;
+
+        if (packagenodes.empty() || (packagenodes.back() != node.id))
+          packagenodes.push_back(node.id);
+      }
+
+    collected.nodes.push_back(node);
+  }
+}
+
+const topology & cpu_topology()
+{
+  if (!done)
+  {
+    collect();
+    done = true;
+  }
+
+  return collected;
+}
+
+/*
+ * CPU nodes indexed by their "cpu@N" bus info, found in one walk
+ */
+vector < hwNode * > cpu_nodes(hwNode & n)
+{
+  vector < hwNode * > result;
+  vector < hwNode * > todo(1, &n);
+
+  while (!todo.empty())
+  {
+    hwNode * node = todo.back();
+    unsigned int index = 0;
+    char dummy;
+
+    todo.pop_back();
+    if (sscanf(node->getBusInfo().c_str(), "cpu@%u%c", &index, &dummy) == 1)
+    {
+      if (index >= result.size())
+        result.resize(index + 1, NULL);
+      result[index] = node;
+    }
+    for (unsigned int i = 0; i < node->countChildren(); i++)
+      todo.push_back(node->getChild(i));
+  }
+
+  return result;
+}
+
+/*
+ * logical CPUs behind "cpu@N": CPU nodes are packages when there are as many
+ * of them (x86), logical CPUs otherwise
+ */
+vector < int > logical_cpus(size_t cpu, size_t count)
+{
+  const topology & t = cpu_topology();
+
+  if (count == t.packages.size())
+    return t.packages[cpu].cpus;
+
+  return vector < int > (1, cpu);
+}
+
+static string nodelist(const vector < int > & nodes)
+{
+  string result = "";
+
+  for (size_t i = 0; i < nodes.size(); i++)
+    result += (i ? "," : "") + tostring(nodes[i]);
+
+  return result;
+}
+
+static void add_caches(hwNode & cpu, const topology_package & package)
+{
+  for (unsigned int i = 0; i < cpu.countChildren(); i++)
+    if (cpu.getChild(i)->getClass() == hw::memory)
+      return;                                     // already known (DMI...)
+
+  for (size_t i = 0; i < package.caches.size(); i++)
+  {
+    const topology_cache & c = package.caches[i];
+    hwNode cache("cache", hw::memory);
+
+    cache.setDescription("L" + tostring(c.level) + " cache");
+    cache.setSize(c.size);
+    cache.setConfig("level", c.level);
+    cache.claim();
+    if (c.type == "Instruction")
+      cache.addCapability("instruction", _("Instruction cache"));
+    if (c.type == "Data")
+      cache.addCapability("data", _("Data cache"));
+    if (c.type == "Unified")
+      cache.addCapability("unified", _("Unified cache"));
+    cpu.addChild(cache);
+  }
+}
+
+bool scan_topology(hwNode & n)
+{
+  const topology & t = cpu_topology();
+  vector < hwNode * > cpus = cpu_nodes(n);
+  hwNode * memory = n.getChild("core/memory");
+
+  if (t.packages.empty())
+    return false;
+
+  for (size_t i = 0; (i < t.packages.size()) && (cpus.size() == t.packages.size()); i++)
+  {
+    const topology_package & package = t.packages[i];
+    hwNode * cpu = cpus[i];
+
+    if (!cpu)
+      continue;
+
+    if (cpu->getConfig("cores") == "")
+      cpu->setConfig("cores", package.cores);
+    if (cpu->getConfig("threads") == "")
+      cpu->setConfig("threads", package.cpus.size());
+    if (package.dies > 1)
+      cpu->setConfig("dies", package.dies);
+    if (t.nodes.size() > 1)
+      cpu->setConfig("numanodes", nodelist(package.nodes));
+    add_caches(*cpu, package);
+  }
+
+  if (memory && (t.nodes.size() > 1))             // sizes come from scan_memory()
+    for (size_t i = 0; i < t.nodes.size(); i++)
+      memory->setConfig("numa" + tostring(t.nodes[i].id) + ".distances",
+        t.nodes[i].distances);
+
+  return true;
+}
@@ -0,0 +1,42 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include "hw.h"
+#include <vector>
+#include <map>
+
+struct topology_cache
+{
+  unsigned int level;
+  string type;                                    // Data, Instruction or Unified
+  unsigned long long size;                        // all the instances in the package
+};
+
+struct topology_package
+{
+  int id;
+  vector < int > cpus;                            // logical CPUs
+  unsigned int dies, cores;
+  vector < int > nodes;                           // NUMA nodes
+  vector < topology_cache > caches;
+};
+
+struct topology_node
+{
+  int id;
+  vector < int > cpus;
+  string distances;
+};
+
+struct topology
+{
+  vector < topology_package > packages;           // ordered by their first CPU
+  vector < topology_node > nodes;
+};
+
+const topology & cpu_topology();
+vector < hwNode * > cpu_nodes(hwNode & n);
+vector < int > logical_cpus(size_t cpu, size_t count);
+
+bool scan_topology(hwNode & n);
+#endif
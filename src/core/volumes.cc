@@ -237,7 +237,7 @@ static string datetime(time_t timestamp, bool utc = true)
 
 static bool detect_ext2(hwNode & n, source & s)
 {
-  static char buffer[EXT2_DEFAULT_BLOCK_SIZE];
+  char buffer[EXT2_DEFAULT_BLOCK_SIZE];
   source ext2volume;
   ext2_super_block *sb = (ext2_super_block*)buffer;
   uint32_t ext2_version = 0;
@@ -349,7 +349,7 @@ static bool detect_ext2(hwNode & n, source & s)
 
 static bool detect_luks(hwNode & n, source & s)
 {
-  static char buffer[BLOCKSIZE];
+  char buffer[BLOCKSIZE];
   source luksvolume;
   unsigned luks_version = 0;
 
@@ -385,7 +385,7 @@ static bool detect_luks(hwNode & n, source & s)
 
 static bool detect_reiserfs(hwNode & n, source & s)
 {
-  static char buffer[REISERFSBLOCKSIZE];
+  char buffer[REISERFSBLOCKSIZE];
   source reiserfsvolume;
   string magic;
   long long blocksize = 0;
@@ -456,7 +456,7 @@ static string dos_serial(unsigned long serial)
 
 static bool detect_fat(hwNode & n, source & s)
 {
-  static char buffer[BLOCKSIZE];
+  char buffer[BLOCKSIZE];
   source fatvolume;
   string magic, label;
   unsigned long long bytes_per_sector = 512;
@@ -587,7 +587,7 @@ enum {
 
 static bool detect_hfsx(hwNode & n, source & s)
 {
-  static char buffer[HFSBLOCKSIZE];
+  char buffer[HFSBLOCKSIZE];
   source hfsvolume;
   string magic;
   HFSPlusVolumeHeader *vol = (HFSPlusVolumeHeader*)buffer;
@@ -709,7 +709,7 @@ struct HFSMasterDirectoryBlock
 
 static bool detect_hfs(hwNode & n, source & s)
 {
-  static char buffer[HFSBLOCKSIZE];
+  char buffer[HFSBLOCKSIZE];
   source hfsvolume;
   string magic;
   HFSMasterDirectoryBlock *vol = (HFSMasterDirectoryBlock*)buffer;
@@ -785,7 +785,7 @@ struct apfs_super_block {
 
 static bool detect_apfs(hwNode & n, source & s)
 {
-  static char buffer[APFS_STANDARD_BLOCK_SIZE];
+  char buffer[APFS_STANDARD_BLOCK_SIZE];
   source apfsvolume;
   apfs_super_block *sb = (apfs_super_block*)buffer;
   unsigned long block_size;
@@ -953,7 +953,7 @@ static time_t ntfs2utc(int64_t ntfs_time)
 
 static bool detect_ntfs(hwNode & n, source & s)
 {
-  static char buffer[BLOCKSIZE];
+  char buffer[BLOCKSIZE];
   source ntfsvolume;
   string magic, serial, name, version;
   unsigned long long bytes_per_sector = 512;
@@ -1086,7 +1086,7 @@ static bool detect_ntfs(hwNode & n, source & s)
 
 static bool detect_swap(hwNode & n, source & s)
 {
-  static char buffer[SWAPBLOCKSIZE];
+  char buffer[SWAPBLOCKSIZE];
   source swapvolume;
   unsigned long version = 0;
   unsigned long pages = 0;
@@ -1146,6 +1146,8 @@ bool scan_volume(hwNode & n, source & s)
 {
   int i = 0;
 
+  prefetchblocks(s);                              // no-op unless a cache is attached to s
+
   while(fs_types[i].id)
   {
     if(fs_types[i].detect && fs_types[i].detect(n, s))
@@ -1,6 +1,7 @@
 #include "hw.h"
 #include "print.h"
 #include "main.h"
+#include "disk.h"
 #include "version.h"
 #include "options.h"
 #include "osutils.h"
@@ -11,6 +12,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <iostream>
+#include <vector>
+#include <string>
 
 #ifndef NONLS
 #include <locale.h>
@@ -48,6 +51,10 @@ void usage(const char *progname)
   fprintf(stderr, _("\t-sanitize       sanitize output (remove sensitive information like serial numbers, etc.)\n"));
   fprintf(stderr, _("\t-numeric        output numeric IDs (for PCI, USB, etc.)\n"));
   fprintf(stderr, _("\t-notime         exclude volatile attributes (timestamps) from output\n"));
+  fprintf(stderr, _("\t-capsets        output identical capability lists only once (XML, JSON)\n"));
+  fprintf(stderr, _("\t-no-media       don't access media in optical and removable drives\n"));
+  fprintf(stderr, _("\t-net-filter PATTERNS  only scan matching network interfaces (e.g. 'eth*,!veth*')\n"));
+  fprintf(stderr, _("\t-disk-image FILE...  only report partitions and volumes found in disk image files\n"));
   fprintf(stderr, "\n");
 }
 
@@ -74,6 +81,7 @@ void status(const char *message)
 int main(int argc,
 char **argv)
 {
+  vector < string > images;
 
 #ifndef NONLS
   setlocale (LC_ALL, "");
@@ -95,6 +103,7 @@ char **argv)
   disable("output:quiet");
   disable("output:sanitize");
   disable("output:numeric");
+  disable("output:capsets");
   enable("output:time");
 
 // define some aliases for nodes classes
@@ -197,12 +206,35 @@ char **argv)
       validoption = true;
     }
 
+    if (strcmp(argv[1], "-capsets") == 0)
+    {
+      enable("output:capsets");
+      validoption = true;
+    }
+
     if (strcmp(argv[1], "-notime") == 0)
     {
         disable("output:time");
         validoption = true;
     }
 
+    if (strcmp(argv[1], "-no-media") == 0)
+    {
+      disable("media");
+      validoption = true;
+    }
+
+    if (strcmp(argv[1], "-disk-image") == 0)
+    {
+      while ((argc >= 3) && (argv[2][0] != '-'))
+      {                                           // consume all the file names
+        images.push_back(argv[2]);
+        memmove(argv+2, argv+3, (argc-2)*(sizeof(argv[0])));
+        argc--;
+      }
+      validoption = (images.size() > 0);
+    }
+
     if(validoption)
     {	/* shift */
       memmove(argv+1, argv+2, (argc-1)*(sizeof(argv[0])));
@@ -223,7 +255,7 @@ char **argv)
 
   if(enabled("output:X")) execl(SBINDIR"/gtk-lshw", SBINDIR"/gtk-lshw", NULL);
 
-  if (geteuid() != 0)
+  if ((geteuid() != 0) && images.empty())
   {
     fprintf(stderr, _("WARNING: you should run this program as super-user.\n"));
   }
@@ -232,7 +264,10 @@ char **argv)
     hwNode computer("computer",
       hw::system);
 
-    scan_system(computer);
+    if (images.empty())
+      scan_system(computer);
+    else
+      scan_images(computer, images);
 
     if (enabled("output:hwpath"))
       printhwpath(computer);
@@ -254,11 +289,17 @@ char **argv)
       computer.dump(getenv("OUTFILE"));
   }
 
-  if (geteuid() != 0)
+  if ((geteuid() != 0) && images.empty())
   {
     fprintf(stderr, _("WARNING: output may be incomplete or inaccurate, you should run this program as super-user.\n"));
   }
 
+  if (probes_abandoned())                         // hung disks: don't wait for them
+  {
+    cout.flush();
+    fflush(NULL);
+    _exit(0);
+  }
 
   return 0;
 }